@@ -1088,7 +1088,38 @@ OPTION(kvsdbg_port, OPT_INT)
 OPTION(op_scheduler, OPT_STR)
 OPTION(mon_max_pool_per_osd, OPT_U64)
 OPTION(kvsstore_dev_path, OPT_STR)
+OPTION(kvsstore_emul_read_latency_us, OPT_U64)
+OPTION(kvsstore_emul_write_latency_us, OPT_U64)
+OPTION(kvsstore_emul_delete_latency_us, OPT_U64)
+OPTION(kvsstore_emul_iter_latency_us, OPT_U64)
+OPTION(kvsstore_emul_xfer_us_per_kb, OPT_DOUBLE)
+OPTION(kvsstore_emul_queue_depth, OPT_U64)
+OPTION(kvsstore_aio_queues, OPT_U64)
+OPTION(kvsstore_queue_depth, OPT_U64)
+OPTION(kvsstore_queue_max_bytes, OPT_U64)
+OPTION(kvsstore_throttle_bytes, OPT_U64)
+OPTION(kvsstore_perf_detail, OPT_BOOL)
+OPTION(kvsstore_aio_queue_cores, OPT_STR)
+OPTION(kvsstore_index_interval_ms, OPT_U64)
+OPTION(kvsstore_index_max_pages, OPT_U64)
+OPTION(kvsstore_index_threads, OPT_U64)
+OPTION(kvsstore_index_cache_bytes, OPT_U64)
 OPTION(kvsstore_readcache_bytes, OPT_U64)
+OPTION(kvsstore_prefetch_max_chunks, OPT_U64)
+OPTION(kvsstore_prefetch_trigger, OPT_U64)
+OPTION(kvsstore_wb_max_bytes, OPT_U64)
+OPTION(kvsstore_batch_data_ios, OPT_BOOL)
+OPTION(kvsstore_aio_pool_size, OPT_U64)
+OPTION(kvsstore_blob_cache_size, OPT_U64)
+OPTION(kvsstore_omap_iterator_batch, OPT_U64)
+OPTION(kvsstore_inline_max, OPT_U64)
+OPTION(kvsstore_compression_mode, OPT_STR)
+OPTION(kvsstore_compression_algorithm, OPT_STR)
+OPTION(kvsstore_compression_required_ratio, OPT_DOUBLE)
+OPTION(kvsstore_compression_probe_chunks, OPT_U64)
+OPTION(kvsstore_cache_type, OPT_STR)   // lru, 2q
+OPTION(kvsstore_2q_cache_kin_ratio, OPT_DOUBLE)
+OPTION(kvsstore_2q_cache_kout_ratio, OPT_DOUBLE)
 OPTION(kvsstore_max_cached_onodes, OPT_U64)
 OPTION(enable_onode_prefetch, OPT_STR)
 OPTION(kvsstore_csum_type, OPT_STR)
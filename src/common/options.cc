@@ -4983,18 +4983,140 @@ std::vector<Option> get_global_options() {
         Option("kvsstore_dev_path", Option::TYPE_STR, Option::LEVEL_ADVANCED)
             .set_default("/dev/nvme2n1")
             .set_description("Default KV device if nothing is mentioned"),
+        Option("kvsstore_emul_read_latency_us", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(0)
+            .set_description("Service time of a retrieve command on the emulated KV device")
+            .set_long_description("Used when kvsstore_dev_path is 'emul:' or 'emul:<image file>'"),
+        Option("kvsstore_emul_write_latency_us", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(0)
+            .set_description("Service time of a store or batch command on the emulated KV device"),
+        Option("kvsstore_emul_delete_latency_us", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(0)
+            .set_description("Service time of a delete command on the emulated KV device"),
+        Option("kvsstore_emul_iter_latency_us", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(0)
+            .set_description("Service time of an iterator command on the emulated KV device"),
+        Option("kvsstore_emul_xfer_us_per_kb", Option::TYPE_FLOAT, Option::LEVEL_DEV)
+            .set_default(0)
+            .set_description("Transfer time per KB of value added to each command on the emulated KV device"),
+        Option("kvsstore_emul_queue_depth", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(128)
+            .set_min(1)
+            .set_description("Number of commands the emulated KV device services in parallel"),
+        Option("kvsstore_aio_queues", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(1)
+            .set_min_max(1, 16)
+            .set_description("Number of submission/completion queue pairs opened on the KV device")
+            .set_long_description("Each queue pair has its own aio context and completion thread; transactions and reads are routed to a queue by their OpSequencer"),
+        Option("kvsstore_aio_queue_cores", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+            .set_default("")
+            .set_description("Comma separated list of CPU cores to pin the completion threads to, one per queue pair"),
+        Option("kvsstore_queue_depth", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(64)
+            .set_min_max(1, 128)
+            .set_description("Number of commands each queue pair may have in flight on the KV device")
+            .set_long_description("Commands beyond the limit, and commands the device refuses while it is busy, wait in a submission queue and are sent as the commands in flight complete"),
+        Option("kvsstore_queue_max_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+            .set_default(16_M)
+            .set_description("Size of the values each queue pair may have in flight on the KV device (0 for no limit)"),
+        Option("kvsstore_perf_detail", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+            .set_default(false)
+            .set_description("Collect the latency histograms of the transaction stages and the latencies of the device commands")
+            .set_long_description("The histograms are dumped with 'perf histogram dump' and the device command latencies with 'perf dump'. Timing the device commands costs two clock reads per command. Read at mount."),
+        Option("kvsstore_throttle_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+            .set_default(64_M)
+            .set_description("Size of the transactions that may be queued and not yet completed (0 for no limit)")
+            .set_long_description("queue_transactions blocks while the transactions in flight hold more data than this"),
+        Option("kvsstore_index_interval_ms", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(100)
+            .set_min(1)
+            .set_description("How often the background indexer applies the device oplog to the onode and collection index")
+            .set_long_description("The indexer keeps running without waiting while oplog pages are still pending, so this bounds the indexing lag of an idle store"),
+        Option("kvsstore_index_max_pages", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(64)
+            .set_min(1)
+            .set_description("Maximum number of oplog pages applied to the index in one indexing pass"),
+        Option("kvsstore_index_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(4)
+            .set_min_max(1, 32)
+            .set_description("Number of threads an indexing pass updates the onode index partitions with")
+            .set_long_description("Each pool shard has its own onode index, so the updates of different partitions are applied and stored in parallel"),
+        Option("kvsstore_index_cache_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+            .set_default(64_M)
+            .set_description("Size of the cache of onode and collection index nodes shared by the indexer and the iterators")
+            .set_long_description("Index nodes an iterator may still read after the indexer replaced them are kept in addition to this"),
         Option("kvsstore_readcache_bytes", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
             .set_default(1024 * 1024 * 1024ul)
             .set_description("the size of read cache (default: 1GB)"),
+        Option("kvsstore_prefetch_max_chunks", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(32)
+            .set_description("Maximum number of chunks read ahead of a sequential reader (0 disables read-ahead)")
+            .set_long_description("The window starts small and doubles while the reader keeps up with it; it is also limited to 1/8 of a cache shard"),
+        Option("kvsstore_wb_max_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+            .set_default(1_M)
+            .set_description("Size of the dirty chunks a collection may buffer while a flush is in flight (0 stores chunks with each transaction)")
+            .set_long_description("Chunks written while the previous flush of the collection is in flight are stored together by the next flush, and a chunk written several times is stored once. Transactions complete when their chunks are stored."),
+        Option("kvsstore_batch_data_ios", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+            .set_default(true)
+            .set_description("Pack the data chunk stores and deletes of a transaction or flush into device batch commands")
+            .set_long_description("Up to 8 deletes and stores of chunks no larger than 8 KiB go in one batch command; the commands the device does not apply are resubmitted one by one"),
+        Option("kvsstore_aio_pool_size", Option::TYPE_UINT, Option::LEVEL_DEV)
+            .set_default(256)
+            .set_description("Number of free I/O command descriptors each sequencer keeps for reuse"),
+        Option("kvsstore_blob_cache_size", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(8192)
+            .set_description("Number of shared blobs of cloned objects kept in memory")
+            .set_long_description("Blobs changed by transactions in flight are kept in addition; the others are read again from the device when they are needed"),
+        Option("kvsstore_prefetch_trigger", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(1)
+            .set_description("Number of sequential reads of an object after which read-ahead starts"),
+        Option("kvsstore_omap_iterator_batch", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(128)
+            .set_description("Number of omap entries an omap iterator reads ahead at a time"),
+        Option("kvsstore_inline_max", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+            .set_default(4_K)
+            .set_description("Objects up to this size keep their data in the onode (0 disables, at most 4 KiB)")
+            .set_long_description("An inlined object is read and written with its onode; it is moved to data chunks when it grows past the limit"),
+        Option("kvsstore_compression_mode", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+            .set_default("none")
+            .set_enum_allowed({"none", "passive", "aggressive", "force"})
+            .set_description("Default policy for compressing data chunks")
+            .set_long_description("'none' means never use compression.  'passive' means use compression when clients hint that data is compressible.  'aggressive' means use compression unless clients hint that data is not compressible.  'force' means use compression under all circumstances.  The pool property 'compression_mode' overrides this."),
+        Option("kvsstore_compression_algorithm", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+            .set_default("snappy")
+            .set_enum_allowed({"", "snappy", "zlib", "zstd", "lz4"})
+            .set_description("Default compressor for data chunks")
+            .set_long_description("The pool property 'compression_algorithm' overrides this."),
+        Option("kvsstore_compression_required_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+            .set_default(.875)
+            .set_description("Compressed chunks are stored only if their size, with the header, is at most this fraction of the original")
+            .set_long_description("The pool property 'compression_required_ratio' overrides this."),
+        Option("kvsstore_compression_probe_chunks", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+            .set_default(4)
+            .set_description("Number of chunks of an object that may fail to compress before compression is no longer tried for it (0: always try)")
+            .set_long_description("Once a chunk of the object compressed, all its chunks are tried. The probe is not applied in 'force' mode and starts over when the onode is reloaded."),
+        Option("kvsstore_cache_type", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+            .set_default("lru")
+            .set_enum_allowed({"lru", "2q"})
+            .set_description("Replacement algorithm of the onode and buffer caches")
+            .set_long_description("With '2q', onodes and buffers loaded once (e.g. by a scrub or backfill scan) stay in a probation queue and only the ones loaded again after leaving it enter the hot queue. Read when the store is created."),
+        Option("kvsstore_2q_cache_kin_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+            .set_default(.5)
+            .set_min_max(0.0, 1.0)
+            .set_description("Share of a 2q cache shard given to the probation queue"),
+        Option("kvsstore_2q_cache_kout_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+            .set_default(.5)
+            .set_min_max(0.0, 1.0)
+            .set_description("Number of evicted entries a 2q cache shard remembers, relative to the number of entries it holds"),
         Option("kvsstore_max_cached_onodes", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
             .set_default(100000ul)
             .set_description("the size of read cache (default: 1M)"),
             
         Option("enable_onode_prefetch", Option::TYPE_STR, Option::LEVEL_ADVANCED)
             .set_default("disabled")
-            .set_enum_allowed({"enq", "deq", "disabled"})
+            .set_enum_allowed({"enq", "disabled"})
             .set_description("enable onode prefetching")
-            .set_long_description("enable onode prefetching. prefetch at enqueue time, dequeue time or no prefetch."),
+            .set_long_description("enable onode prefetching. prefetch at enqueue time or no prefetch."),
         Option("kvsstore_csum_type", Option::TYPE_STR, Option::LEVEL_ADVANCED)
             .set_default("crc32c")
             .set_enum_allowed({"none", "crc32c"})
@@ -421,6 +421,18 @@ public:
    * @returns true if object exists, false otherwise
    */
   virtual bool exists(CollectionHandle& c, const ghobject_t& oid) = 0;
+
+  /**
+   * prefetch_onode -- hint that an object is about to be accessed
+   *
+   * The store may start loading the metadata of the object in the
+   * background so that the operations that follow find it in memory.
+   * It must not block.  The default does nothing.
+   *
+   * @param c collection for object
+   * @param oid oid of object
+   */
+  virtual void prefetch_onode(CollectionHandle& c, const ghobject_t& oid) {}
   /**
    * set_collection_opts -- std::set pool options for a collectioninformation for an object
    *
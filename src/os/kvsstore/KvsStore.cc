@@ -21,6 +21,7 @@
 #include "common/safe_io.h"
 #include "common/Formatter.h"
 #include "common/EventTrace.h"
+#include "include/str_list.h"
 #include "compressor/CompressionPlugin.h"
 #include "compressor/Compressor.h"
 
@@ -50,13 +51,150 @@
 void KvsStore::_init_perf_logger(CephContext *cct) {
     FTRACE
     PerfCountersBuilder b(cct, "KvsStore", l_kvsstore_first, l_kvsstore_last);
+    b.add_u64(l_kvsstore_index_lag, "index_lag",
+              "Oplog pages not yet applied to the onode and collection index");
+    b.add_u64_counter(l_kvsstore_index_pages, "index_pages",
+              "Oplog pages applied to the index");
+    b.add_u64(l_kvsstore_index_pages_per_sec, "index_pages_per_sec",
+              "Oplog pages applied per second in the last indexing pass");
+    b.add_time_avg(l_kvsstore_index_lat, "index_lat",
+              "Average time of an indexing pass");
+    b.add_u64(l_kvsstore_index_cache_bytes, "index_cache_bytes",
+              "Size of the index nodes in the node cache");
+    b.add_u64(l_kvsstore_index_cache_hit, "index_cache_hit",
+              "Index node reads served by the node cache");
+    b.add_u64(l_kvsstore_index_cache_miss, "index_cache_miss",
+              "Index node reads that went to the device");
+    b.add_u64_counter(l_kvsstore_prefetch_issued, "prefetch_issued",
+              "Chunks read ahead of sequential readers");
+    b.add_u64_counter(l_kvsstore_prefetch_hit, "prefetch_hit",
+              "Chunks of sequential reads found in the cache");
+    b.add_u64_counter(l_kvsstore_prefetch_miss, "prefetch_miss",
+              "Chunks of sequential reads that had to be read from the device");
+    b.add_u64_counter(l_kvsstore_prefetch_waste, "prefetch_waste",
+              "Prefetched chunks that were never read");
+    b.add_u64_counter(l_kvsstore_wb_flushes, "wb_flushes",
+              "Flushes of the write-back buffers");
+    b.add_u64_counter(l_kvsstore_wb_merged, "wb_merged",
+              "Chunk stores absorbed by a later write of the same chunk");
+    b.add_u64_counter(l_kvsstore_rmw_cached, "rmw_cached",
+              "Partially written chunks read from memory instead of the device");
+    b.add_u64_counter(l_kvsstore_clone_shared, "clone_shared",
+              "Chunks shared with a clone instead of copied");
+    b.add_u64_counter(l_kvsstore_clone_unshared, "clone_unshared",
+              "Shared chunks that were rewritten and stopped being shared");
+    b.add_u64_counter(l_kvsstore_inline_read, "inline_read",
+              "Reads served from data stored in the onode");
+    b.add_u64_counter(l_kvsstore_inline_promoted, "inline_promoted",
+              "Inlined objects moved to data chunks");
+    b.add_u64(l_kvsstore_read_retries, "read_retries",
+              "Values read a second time because the read buffer was too small");
+    b.add_u64(l_kvsstore_read_size_sorted, "read_size_sorted",
+              "Default read buffer size of the sorted key space");
+    b.add_u64(l_kvsstore_read_size_notsorted, "read_size_notsorted",
+              "Default read buffer size of the unsorted key space");
+    b.add_u64_counter(l_kvsstore_compress_success, "compress_success",
+              "Data chunks stored compressed");
+    b.add_u64_counter(l_kvsstore_compress_rejected, "compress_rejected",
+              "Data chunks stored raw because they did not compress enough");
+    b.add_u64_counter(l_kvsstore_compressed_original, "compressed_original",
+              "Original size of the data chunks stored compressed", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_compressed, "compressed",
+              "Stored size of the data chunks stored compressed", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_onode_prefetch_issued, "onode_prefetch_issued",
+              "Onodes read ahead of the operations that use them");
+    b.add_u64_counter(l_kvsstore_onode_prefetch_waste, "onode_prefetch_waste",
+              "Prefetched onodes dropped because the object was looked up or changed meanwhile");
+    b.add_u64(l_kvsstore_queue_ops, "queue_ops",
+              "Commands in flight on the device queue pairs");
+    b.add_u64(l_kvsstore_queue_bytes, "queue_bytes",
+              "Size of the values in flight on the device queue pairs", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64(l_kvsstore_queue_waiting, "queue_waiting",
+              "Commands waiting in the submission queues for the device to make room");
+    b.add_u64(l_kvsstore_queue_parked, "queue_parked",
+              "Times a command waited in a submission queue");
+
+    // latencies of the transaction stages and of the device commands, with their
+    // latency x size histograms. Histogram latencies are in nanoseconds.
+    PerfHistogramCommon::axis_config_d lat_axis{
+        "Latency (usec)", PerfHistogramCommon::SCALE_LOG2, 0, 10000, 32 };
+    PerfHistogramCommon::axis_config_d size_axis{
+        "Size (bytes)", PerfHistogramCommon::SCALE_LOG2, 0, 512, 32 };
+    PerfHistogramCommon::axis_config_d keys_axis{
+        "Keys", PerfHistogramCommon::SCALE_LOG2, 0, 1, 16 };
+
+    static const struct {
+        int idx, hist_idx;
+        const char *name, *hist_name, *desc;
+    } latencies[] = {
+        { l_kvsstore_throttle_lat, l_kvsstore_throttle_lat_hist,
+          "throttle_lat", "throttle_lat_histogram", "Wait of queue_transactions for the transaction throttle" },
+        { l_kvsstore_state_prepare_lat, l_kvsstore_state_prepare_lat_hist,
+          "state_prepare_lat", "state_prepare_lat_histogram", "Preparation of the transaction updates" },
+        { l_kvsstore_state_write_nodes_lat, l_kvsstore_state_write_nodes_lat_hist,
+          "state_write_nodes_lat", "state_write_nodes_lat_histogram", "Synchronous write of the onodes and metadata" },
+        { l_kvsstore_state_submit_lat, l_kvsstore_state_submit_lat_hist,
+          "state_submit_lat", "state_submit_lat_histogram", "Submission of the data I/Os" },
+        { l_kvsstore_state_aio_wait_lat, l_kvsstore_state_aio_wait_lat_hist,
+          "state_aio_wait_lat", "state_aio_wait_lat_histogram", "Wait for the device to complete the data I/Os" },
+        { l_kvsstore_state_io_done_lat, l_kvsstore_state_io_done_lat_hist,
+          "state_io_done_lat", "state_io_done_lat_histogram", "Wait for the preceding transactions of the sequencer" },
+        { l_kvsstore_state_finalize_lat, l_kvsstore_state_finalize_lat_hist,
+          "state_finalize_lat", "state_finalize_lat_histogram", "Wait in the finalize queue" },
+        { l_kvsstore_state_finishing_lat, l_kvsstore_state_finishing_lat_hist,
+          "state_finishing_lat", "state_finishing_lat_histogram", "Completion of the transaction" },
+        { l_kvsstore_commit_lat, l_kvsstore_commit_lat_hist,
+          "commit_lat", "commit_lat_histogram", "Transaction latency, from queue_transactions to completion" },
+        { l_kvsstore_dev_store_sorted_lat, l_kvsstore_dev_store_sorted_lat_hist,
+          "dev_store_sorted_lat", "dev_store_sorted_lat_histogram", "Stores to the sorted key space" },
+        { l_kvsstore_dev_store_notsorted_lat, l_kvsstore_dev_store_notsorted_lat_hist,
+          "dev_store_notsorted_lat", "dev_store_notsorted_lat_histogram", "Stores to the unsorted key space" },
+        { l_kvsstore_dev_retrieve_sorted_lat, l_kvsstore_dev_retrieve_sorted_lat_hist,
+          "dev_retrieve_sorted_lat", "dev_retrieve_sorted_lat_histogram", "Retrieves from the sorted key space" },
+        { l_kvsstore_dev_retrieve_notsorted_lat, l_kvsstore_dev_retrieve_notsorted_lat_hist,
+          "dev_retrieve_notsorted_lat", "dev_retrieve_notsorted_lat_histogram", "Retrieves from the unsorted key space" },
+        { l_kvsstore_dev_delete_sorted_lat, l_kvsstore_dev_delete_sorted_lat_hist,
+          "dev_delete_sorted_lat", "dev_delete_sorted_lat_histogram", "Deletes from the sorted key space" },
+        { l_kvsstore_dev_delete_notsorted_lat, l_kvsstore_dev_delete_notsorted_lat_hist,
+          "dev_delete_notsorted_lat", "dev_delete_notsorted_lat_histogram", "Deletes from the unsorted key space" },
+        { l_kvsstore_dev_iterate_lat, l_kvsstore_dev_iterate_lat_hist,
+          "dev_iterate_lat", "dev_iterate_lat_histogram", "Listings of the onode index" },
+    };
+    for (const auto &l : latencies) {
+        b.add_time_avg(l.idx, l.name, l.desc);
+        b.add_u64_counter_histogram(l.hist_idx, l.hist_name, lat_axis,
+                                    (l.idx == l_kvsstore_dev_iterate_lat)? keys_axis : size_axis, l.desc);
+    }
+    b.add_u64_counter(l_kvsstore_dev_store_sorted_bytes, "dev_store_sorted_bytes",
+              "Bytes stored to the sorted key space", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_dev_store_notsorted_bytes, "dev_store_notsorted_bytes",
+              "Bytes stored to the unsorted key space", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_dev_retrieve_sorted_bytes, "dev_retrieve_sorted_bytes",
+              "Bytes retrieved from the sorted key space", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_dev_retrieve_notsorted_bytes, "dev_retrieve_notsorted_bytes",
+              "Bytes retrieved from the unsorted key space", NULL, 0, unit_t(UNIT_BYTES));
+
+    b.add_u64_counter(l_kvsstore_onode_hits, "onode_hits",
+              "Onode lookups served by the onode cache");
+    b.add_u64_counter(l_kvsstore_onode_misses, "onode_misses",
+              "Onode lookups that read the device");
+    b.add_u64_counter(l_kvsstore_buffer_hit_bytes, "buffer_hit_bytes",
+              "Bytes read from the buffer cache", NULL, 0, unit_t(UNIT_BYTES));
+    b.add_u64_counter(l_kvsstore_buffer_miss_bytes, "buffer_miss_bytes",
+              "Bytes read that missed the buffer cache", NULL, 0, unit_t(UNIT_BYTES));
     this->logger = b.create_perf_counters();
     cct->get_perfcounters_collection()->add(logger);
 }
 
+static void device_command_observer(void *arg, int opcode, int spaceid, uint32_t bytes, const ceph::timespan &lat)
+{
+    static_cast<KvsStore*>(arg)->_log_device_command(opcode, spaceid, bytes, lat);
+}
+
 KvsStore::KvsStore(CephContext *cct, const std::string &path) :
     ObjectStoreAdapter(cct, path), db(cct), finisher(cct, "kvs_commit_finisher", "kcfin"),
-    kv_callback_thread(this),  kv_finalize_thread(this), kv_index_thread(this) {
+    throttle_bytes(cct, "kvsstore_throttle_bytes", cct->_conf->kvsstore_throttle_bytes),
+    kv_finalize_thread(this), kv_index_thread(this) {
 
     FTRACE
     // perf counter
@@ -81,20 +219,21 @@ void KvsStore::set_cache_shards(unsigned num) {
     uint64_t max_shard_buffer = KVS_CACHE_MAX_DATA_SIZE / num;
 
     // KvsStore does not support a dynamic cache configuration
-    // we set the max size of each cache here
+    // we set the max size and the replacement algorithm of each cache here
+    const std::string type = cct->_conf->kvsstore_cache_type;
     for (unsigned i = 0; i < num; ++i) {
-        auto p = OnodeCacheShard::create(cct, "", logger);
+        auto p = OnodeCacheShard::create(cct, type, logger);
         p->set_max(max_shard_onodes);
         onode_cache_shards[i] = p;
     }
 
     for (unsigned i = 0; i < num; ++i) {
-        auto p = BufferCacheShard::create(cct, "", logger);
+        auto p = BufferCacheShard::create(cct, type, logger);
         p->set_max(max_shard_buffer);
         buffer_cache_shards[i] =p;
     }
 
-    derr << "KvsStore Cache: max_shard_onodes: " << max_shard_onodes << " max_shard_buffer: " << max_shard_buffer << dendl;
+    derr << "KvsStore Cache: type: " << type << " max_shard_onodes: " << max_shard_onodes << " max_shard_buffer: " << max_shard_buffer << dendl;
 }
 
 
@@ -166,7 +305,7 @@ int KvsStore::open_db(bool create) {
 
     finisher.start();
 
-    if (this->db.open(cct->_conf->kvsstore_dev_path) != 0) {
+    if (this->db.open(cct->_conf->kvsstore_dev_path, create) != 0) {
         TR << "device is not opened :" << cct->_conf->kvsstore_dev_path;
         return -1;
     }
@@ -178,10 +317,22 @@ int KvsStore::open_db(bool create) {
         }
     }
 
+    // timing every device command costs two clock reads: only in detail
+    perf_detail = cct->_conf->kvsstore_perf_detail;
+    db.submit_queues.set_observer(perf_detail? device_command_observer : nullptr, this);
+
 
 
 
-    kv_callback_thread.create("kvscallback");
+    // one completion thread per queue pair, optionally pinned to kvsstore_aio_queue_cores
+    const std::vector<std::string> cores = get_str_vec(cct->_conf->kvsstore_aio_queue_cores, ", ");
+    for (unsigned i = 0; i < db.kadi.get_num_queues(); i++) {
+        kv_callback_threads.emplace_back(new KVCallbackThread(this, i));
+        if (i < cores.size()) {
+            kv_callback_threads.back()->set_affinity(atoi(cores[i].c_str()));
+        }
+        kv_callback_threads.back()->create("kvscallback");
+    }
     kv_index_thread.create("kvsindex");
     kv_finalize_thread.create("kvsfinalize");
 
@@ -207,6 +358,7 @@ void KvsStore::close_db() {
     {
         std::unique_lock<std::mutex> l ( kv_lock );
         kv_index_stop = true;
+        kv_cond.notify_all();
     }
 
     kv_index_thread.join();
@@ -217,7 +369,10 @@ void KvsStore::close_db() {
 
     {
         kv_stop = true;
-        kv_callback_thread.join();
+        for (auto &t : kv_callback_threads) {
+            t->join();
+        }
+        kv_callback_threads.clear();
     }
 
     this->db.close();
@@ -236,8 +391,10 @@ int KvsStore::mkfs_kvsstore() {
 
 int KvsStore::mount_kvsstore() {
     FTRACE
-    // load nid_last for atomic accesses
-    this->nid_last = this->kvsb.nid_last;
+    // load nid_last for atomic accesses. The superblock is only updated every
+    // SB_FLUSH_FREQUENCY nids, so skip the ones that may have been used before a crash:
+    // nids also name shared blobs and data key versions, which must not be reused.
+    this->nid_last = this->kvsb.nid_last + SB_FLUSH_FREQUENCY + 1;
 
     // to update superblock
     this->kvsb.is_uptodate = 0;
@@ -309,6 +466,10 @@ void KvsStore::osr_drain_all() {
         osr->drain();
     }
 
+    while (onode_prefetches.load() > 0 || chunk_prefetches.load() > 0) {
+        usleep(100);
+    }
+
     {
         std::lock_guard l(zombie_osr_lock);
         for (auto &osr : zombies) {
@@ -357,7 +518,21 @@ int KvsStore::fiemap_impl(CollectionHandle &c_, const ghobject_t &oid,
     dout(20) << __func__ << " " << offset << "~" << len << " size "
              << o->onode.size << dendl;
 
-    destmap[0] = o->onode.size;
+    // the range is data except for the chunks that are holes
+    if (len > 0) {
+        const uint32_t shift = get_chunk_shift(o->onode);
+        interval_set<uint64_t> data, holes;
+        data.insert(offset, len);
+        for (auto h = o->onode.holes.begin(); h != o->onode.holes.end(); ++h) {
+            holes.insert((uint64_t)h.get_start() << shift, (uint64_t)h.get_len() << shift);
+        }
+        interval_set<uint64_t> overlap;
+        overlap.intersection_of(data, holes);
+        data.subtract(overlap);
+        for (auto d = data.begin(); d != data.end(); ++d) {
+            destmap[d.get_start()] = d.get_len();
+        }
+    }
 
     out:
     dout(20) << __func__ << " " << offset << "~" << len << " size = 0 ("
@@ -368,53 +543,71 @@ int KvsStore::fiemap_impl(CollectionHandle &c_, const ghobject_t &oid,
 
 int KvsStore::open_collections() {
     FTRACE
+    std::set<std::string> names;
 
-    db.compact();
-
-    KvsIterator *it = db.get_iterator(GROUP_PREFIX_COLL);
-    for (it->begin(); it->valid(); it->next()) {
-        coll_t cid;
-        kv_key collkey = it->key();
-        std::string name((char *) collkey.key + sizeof(kvs_coll_key), collkey.length - sizeof(kvs_coll_key));
-
-        if (cid.parse(name)) {
-            auto c = ceph::make_ref<Collection>(this,
-                                                onode_cache_shards[cid.hash_to_shard(onode_cache_shards.size())],
-                                                buffer_cache_shards[cid.hash_to_shard(
-                                                        buffer_cache_shards.size())],
-                                                cid);
-
-            bufferlist bl;
-            int r = db.read_kvkey(&collkey, bl, true);
-            if (r != 0) {
-                TR << "read failed, r= " << r;
-                break;
-            }
+    // the checkpointed collection set and the oplog tail name the collections, so
+    // mount does not wait for the tail to be indexed: the indexer does it in the background
+    const bool checkpointed = db.list_collections(names);
+    if (!checkpointed) {
+        // the store predates the checkpointed set: index everything and walk the tree once
+        db.compact();
 
-            auto p = bl.cbegin();
-            try {
-                decode(c->cnode, p);
-            } catch (buffer::error &e) {
-                TR << " failed to decode cnode, key:"
-                     << print_kvssd_key((char *) collkey.key, collkey.length) << ", length = " << bl.length() << ", hash = " << ceph_str_hash_linux(bl.c_str(), bl.length());
+        KvsIterator *it = db.get_iterator(GROUP_PREFIX_COLL);
+        for (it->begin(); it->valid(); it->next()) {
+            kv_key collkey = it->key();
+            names.insert(std::string((char *) collkey.key + sizeof(kvs_coll_key), collkey.length - sizeof(kvs_coll_key)));
+        }
+        delete it;
+    }
 
-                if (it) delete it;
-                return -EIO;
-            }
+    std::vector<coll_t> cids(names.size());
+    unsigned i = 0;
+    for (const std::string &name : names) {
+        if (!cids[i++].parse(name)) {
+            derr << __func__ << " unrecognized collection " << name << dendl;
+            ceph_abort_msg("unrecognized collection");
+        }
+    }
 
-            dout(20) << __func__ << " opened " << cid << " " << c << dendl;
-            _osr_attach(c.get());
-            coll_map[cid] = c;
+    // the cnodes are read all at once
+    std::vector<bufferlist> bls(cids.size());
+    IoContext ioc(0, __func__);
+    for (i = 0; i < cids.size(); i++) {
+        db.aio_read_coll(cids[i], bls[i], &ioc);
+    }
+    if (!cids.empty()) {
+        int r = ioc.aio_submit_and_wait(&db.kadi, __func__);
+        if (r != 0) {
+            derr << __func__ << " failed to read the collections, r = " << r << dendl;
+            return -EIO;
+        }
+    }
 
-        } else {
-            TR << " unrecognized collection " << print_kvssd_key(it->key().key, it->key().length);
-            derr << __func__ << " unrecognized collection " << print_kvssd_key(it->key().key, it->key().length)
-                 << dendl;
-            ceph_abort_msg("unrecognized collection");
+    for (i = 0; i < cids.size(); i++) {
+        const coll_t &cid = cids[i];
+        auto c = ceph::make_ref<Collection>(this,
+                                            onode_cache_shards[cid.hash_to_shard(onode_cache_shards.size())],
+                                            buffer_cache_shards[cid.hash_to_shard(
+                                                    buffer_cache_shards.size())],
+                                            cid);
+        _set_compression(c.get(), pool_opts_t());
+
+        auto p = bls[i].cbegin();
+        try {
+            decode(c->cnode, p);
+        } catch (buffer::error &e) {
+            derr << __func__ << " failed to decode cnode of " << cid << ", length = " << bls[i].length() << dendl;
+            return -EIO;
         }
+
+        dout(20) << __func__ << " opened " << cid << " " << c << dendl;
+        _osr_attach(c.get());
+        coll_map[cid] = c;
     }
-    if (it) delete it;
 
+    if (!checkpointed) {
+        db.set_collections(names);
+    }
     return 0;
 }
 
@@ -488,6 +681,7 @@ ObjectStore::CollectionHandle KvsStore::create_new_collection(
                                         onode_cache_shards[cid.hash_to_shard(onode_cache_shards.size())],
                                         buffer_cache_shards[cid.hash_to_shard(buffer_cache_shards.size())],
                                         cid);
+    _set_compression(c.get(), pool_opts_t());
     new_coll_map[cid] = c;
 
     _osr_attach(c.get());
@@ -502,6 +696,131 @@ int KvsStore::set_collection_opts(CollectionHandle &ch,
     Collection *c = static_cast<Collection*>(ch.get());
     if (!c->exists)
         return -ENOENT;
+
+    // objects keep the chunk size they were written with; this applies to new data only
+    int64_t chunk_size = 0;
+    uint8_t chunk_shift = 0;
+    if (opts.get(pool_opts_t::KVS_CHUNK_SIZE, &chunk_size) && chunk_size > 0) {
+        if (!isp2(chunk_size) ||
+            chunk_size < (1ll << KVS_OBJECT_SPLIT_SHIFT_MIN) || chunk_size > (1ll << KVS_OBJECT_SPLIT_SHIFT_MAX)) {
+            derr << __func__ << " " << ch->cid << " invalid kvs_chunk_size " << chunk_size << dendl;
+            return -EINVAL;
+        }
+        chunk_shift = ctz(chunk_size);
+    }
+
+    std::unique_lock l(c->lock);
+    c->cnode.chunk_shift = chunk_shift;
+    _set_compression(c, opts);
+    return 0;
+}
+
+
+/// chooses how the chunks of new writes to the collection are compressed, from
+/// the pool options or the kvsstore_compression_* defaults
+void KvsStore::_set_compression(Collection *c, const pool_opts_t &opts)
+{
+    FTRACE
+    std::string mode = cct->_conf->kvsstore_compression_mode;
+    std::string alg = cct->_conf->kvsstore_compression_algorithm;
+    double ratio = cct->_conf->kvsstore_compression_required_ratio;
+    opts.get(pool_opts_t::COMPRESSION_MODE, &mode);
+    opts.get(pool_opts_t::COMPRESSION_ALGORITHM, &alg);
+    opts.get(pool_opts_t::COMPRESSION_REQUIRED_RATIO, &ratio);
+
+    auto m = Compressor::get_comp_mode_type(mode);
+    if (!m) {
+        derr << __func__ << " " << c->cid << " unrecognized compression mode '" << mode
+             << "', reverting to 'none'" << dendl;
+    }
+    c->comp_mode = (m)? *m : Compressor::COMP_NONE;
+    c->comp_required_ratio = ratio;
+    c->compressor.reset();
+    if (c->comp_mode != Compressor::COMP_NONE && !alg.empty()) {
+        c->compressor = Compressor::create(cct, alg);
+        if (!c->compressor) {
+            derr << __func__ << " " << c->cid << " unable to initialize " << alg << " compressor" << dendl;
+        }
+    }
+    dout(10) << __func__ << " " << c->cid << " mode " << Compressor::get_comp_mode_name(c->comp_mode)
+             << " alg " << (c->compressor ? c->compressor->get_type_name() : "(none)")
+             << " required_ratio " << c->comp_required_ratio << dendl;
+}
+
+/// compresses a data chunk into out, header first, if the collection's mode and
+/// the object's hints ask for it and it shrinks to the required ratio
+bool KvsStore::_compress_chunk(Collection *c, OnodeRef &o, const bufferlist &data, bufferlist &out)
+{
+    FTRACE
+    const Compressor::CompressionMode cm = c->comp_mode;
+    const uint32_t hints = o->onode.alloc_hint_flags;
+    if (!c->compressor || data.length() == 0 ||
+        !(cm == Compressor::COMP_FORCE ||
+          (cm == Compressor::COMP_AGGRESSIVE && (hints & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) ||
+          (cm == Compressor::COMP_PASSIVE && (hints & CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE)))) {
+        return false;
+    }
+
+    // stop trying once the first chunks of the object did not compress
+    const uint64_t probe = cct->_conf->kvsstore_compression_probe_chunks;
+    if (cm != Compressor::COMP_FORCE && probe > 0 && !o->comp_accepted && o->comp_rejected >= probe) {
+        return false;
+    }
+
+    kvsstore_compression_header_t chdr;
+    chdr.type = c->compressor->get_type();
+    chdr.length = data.length();
+    encode(chdr, out);
+
+    bufferlist compressed;
+    int r = c->compressor->compress(data, compressed);
+    const uint64_t stored = out.length() + compressed.length();
+    if (r != 0 || stored >= data.length() || stored > data.length() * c->comp_required_ratio) {
+        out.clear();
+        o->comp_rejected++;
+        logger->inc(l_kvsstore_compress_rejected);
+        return false;
+    }
+
+    out.claim_append(compressed);
+    o->comp_accepted = true;
+    logger->inc(l_kvsstore_compress_success);
+    logger->inc(l_kvsstore_compressed_original, data.length());
+    logger->inc(l_kvsstore_compressed, out.length());
+    return true;
+}
+
+/// replaces a chunk read from the device with its uncompressed data
+int KvsStore::_decompress_chunk(const CompressorRef &compressor, bufferlist &bl)
+{
+    FTRACE
+    kvsstore_compression_header_t chdr;
+    auto p = bl.cbegin();
+    try {
+        decode(chdr, p);
+    } catch (buffer::error &e) {
+        derr << __func__ << " failed to decode the compression header, length = " << bl.length() << dendl;
+        return -EIO;
+    }
+
+    // chunks written under another setting of the pool carry their own algorithm
+    CompressorRef dc = compressor;
+    if (!dc || (int)dc->get_type() != chdr.type) {
+        dc = (cp && (int)cp->get_type() == chdr.type)? cp : Compressor::create(cct, chdr.type);
+    }
+    if (!dc) {
+        derr << __func__ << " no compressor for type " << Compressor::get_comp_alg_name(chdr.type) << dendl;
+        return -EIO;
+    }
+
+    bufferlist raw;
+    int r = dc->decompress(p, p.get_remaining(), raw);
+    if (r < 0 || raw.length() != chdr.length) {
+        derr << __func__ << " decompression failed: r = " << r << ", length = " << raw.length()
+             << ", expected " << chdr.length << dendl;
+        return -EIO;
+    }
+    bl.swap(raw);
     return 0;
 }
 
@@ -641,15 +960,32 @@ int KvsStore::read(CollectionHandle &c_, const ghobject_t &oid, uint64_t offset,
 int KvsStore::_do_read_chunks_async(OnodeRef &o, ready_regions_t &ready_regions, chunk2read_t &chunk2read, BufferCacheShard *cache) {
     IoContext ioc( 0, __func__);
     FTRACE
+    if (o->c && o->c->osr) {
+        ioc.qid = o->c->osr->get_sequencer_id();
+    }
     int r = 0;
     if (chunk2read.size() > 0) {
-        _prepare_read_chunk_ioc(o->oid, ready_regions, chunk2read, &ioc);
+        _prepare_read_chunk_ioc(o, ready_regions, chunk2read, &ioc);
         r = ioc.aio_submit_and_wait(&db.kadi, __func__);
+        if (r != 0) return r;
+
+        // the cache holds the uncompressed data
+        const uint32_t shift = get_chunk_shift(o->onode);
+        for (uint16_t &chunkid : chunk2read) {
+            bufferlist &bl = ready_regions[(uint64_t)chunkid << shift];
+            if (!o->onode.is_compressed(chunkid) || bl.length() == 0) continue;
+            r = _decompress_chunk((o->c)? o->c->compressor : CompressorRef(), bl);
+            if (r != 0) {
+                derr << __func__ << " failed to decompress chunk " << chunkid << " of " << o->oid << dendl;
+                return r;
+            }
+        }
 
         // update cache if needed
         if (KVS_CACHE_BUFFERED_READ && cache) {
             for (uint16_t &chunkid : chunk2read) {
-                o->bc.did_read(cache, (chunkid << KVS_OBJECT_SPLIT_SHIFT) /* offset */, ready_regions[chunkid]);
+                const uint64_t off = (uint64_t)chunkid << shift;
+                o->bc.did_read(cache, off, ready_regions[off]);
             }
         }
     }
@@ -671,21 +1007,42 @@ int KvsStore::_do_read(Collection *c,OnodeRef o,uint64_t offset,size_t length,bu
         length = o->onode.size - offset;
     }
 
+    if (o->onode.inlined) {
+        bl.substr_of(o->onode.inline_data, offset, length);
+        logger->inc(l_kvsstore_inline_read);
+        return bl.length();
+    }
+
     ready_regions_t ready_regions;
     chunk2read_t chunk2read;
 
     TRR << "read cache oid = " << o->oid;
 
-    _read_cache(c->cache, o, offset, length, 0, ready_regions, chunk2read);
+    // scrub and recovery reads are flagged DONTNEED: they neither fill nor reorder the buffer cache
+    const bool nocache = op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED | CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    _read_cache(c->cache, o, offset, length, nocache ? BufferSpace::NOCACHE_READ : 0, ready_regions, chunk2read);
+
+    // client reads only: the readahead looks up the cache as well
+    uint64_t hit_bytes = 0;
+    for (const auto &p : ready_regions) {
+        hit_bytes += p.second.length();
+    }
+    logger->inc(l_kvsstore_buffer_hit_bytes, hit_bytes);
+    logger->inc(l_kvsstore_buffer_miss_bytes, length - std::min<uint64_t>(hit_bytes, length));
+
+    // start reading ahead before waiting for the missing chunks
+    if (!nocache) {
+        _readahead(c, o, offset, length, op_flags, chunk2read.size());
+    }
 
     if (chunk2read.size()) {
         TRR << "read from KVSSD oid = " << o->oid ;
-        r = _do_read_chunks_async(o, ready_regions, chunk2read, c->cache);
+        ready_regions_t chunks;
+        r = _do_read_chunks_async(o, chunks, chunk2read, nocache ? nullptr : c->cache);
         if (r != 0) return r;
+        _merge_read_chunks(offset, length, chunks, ready_regions);
     }
 
-
-
     _generate_read_result_bl(o, offset, length, ready_regions, bl);
 
     TRR << "generate read result oid = " << o->oid << ", final length = " << bl.length();
@@ -695,14 +1052,16 @@ int KvsStore::_do_read(Collection *c,OnodeRef o,uint64_t offset,size_t length,bu
     return r;
 }
 
-int KvsStore::_prepare_read_chunk_ioc(const ghobject_t &oid, ready_regions_t& ready_regions,chunk2read_t& chunk2read, IoContext *ioc)
+int KvsStore::_prepare_read_chunk_ioc(OnodeRef &o, ready_regions_t& ready_regions,chunk2read_t& chunk2read, IoContext *ioc)
 {
     FTRACE
     int r = 0;
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const std::string key = _get_chunk_key(o);
     for (const uint16_t &chunkid : chunk2read) {
-        bufferlist &bl = ready_regions[chunkid];
+        bufferlist &bl = ready_regions[(uint64_t)chunkid << shift];
         TRR << "Read Chunk: id = " << chunkid;
-        db.aio_read_chunk(oid, chunkid, KVS_OBJECT_SPLIT_SIZE, bl, ioc);
+        db.aio_read_chunk(o->onode.get_chunk_key(chunkid, key), chunkid, 1u << shift, bl, ioc);
     }
     return r;
 }
@@ -743,6 +1102,7 @@ void KvsStore::_read_cache(BufferCacheShard *cache, OnodeRef o, uint64_t offset
     o->bc.read(cache, offset, length, ready_regions, cache_interval, read_cache_policy);
 
     // find chunks to read
+    const uint32_t shift = get_chunk_shift(o->onode);
     unsigned current_off = offset;
     unsigned remaining_bytes = length;
 
@@ -762,14 +1122,15 @@ void KvsStore::_read_cache(BufferCacheShard *cache, OnodeRef o, uint64_t offset
                 l = pc->first - current_off;                    // length of a gap
             }
 
-            // assume that all cached data size is aligned with a chunk size except the last one.
-
-            uint32_t num_chunks_to_read = ((l -1) / KVS_OBJECT_SPLIT_SIZE) + 1;
-
-            uint32_t r_off = current_off;
-            for (unsigned i = 0 ; i < num_chunks_to_read; i++) {
-                chunk2read.push_back(get_chunk_index(r_off));
-                r_off += KVS_OBJECT_SPLIT_SIZE;
+            // the gap may start and end in the middle of a chunk
+            uint16_t first = get_chunk_index(current_off, shift);
+            const uint16_t last = get_chunk_index(current_off + l - 1, shift);
+            if (!chunk2read.empty() && chunk2read.back() == first) {
+                first++;    // the previous gap ended in the same chunk
+            }
+            for (uint32_t chunkid = first; chunkid <= last; chunkid++) {
+                if (o->onode.is_hole(chunkid)) continue;   // zeros, nothing to read
+                chunk2read.push_back(chunkid);
             }
         }
 
@@ -778,6 +1139,251 @@ void KvsStore::_read_cache(BufferCacheShard *cache, OnodeRef o, uint64_t offset
     }
 }
 
+void KvsStore::_merge_read_chunks(uint64_t offset, size_t length, ready_regions_t &chunks, ready_regions_t &ready_regions)
+{
+    FTRACE
+    const uint64_t end = offset + length;
+
+    interval_set<uint64_t> cached;
+    for (const auto &p : ready_regions) {
+        cached.insert(p.first, p.second.length());
+    }
+
+    // add the parts of the chunks that were not found in the cache
+    for (auto &p : chunks) {
+        const uint64_t s = std::max(p.first, offset);
+        const uint64_t e = std::min(p.first + p.second.length(), end);
+        if (s >= e) continue;   // a hole, or outside of the request
+
+        interval_set<uint64_t> wanted, overlap;
+        wanted.insert(s, e - s);
+        overlap.intersection_of(wanted, cached);
+        wanted.subtract(overlap);
+
+        for (auto w = wanted.begin(); w != wanted.end(); ++w) {
+            ready_regions[w.get_start()].substr_of(p.second, w.get_start() - p.first, w.get_len());
+        }
+    }
+}
+
+/// -------------------------------------------------------------------------
+/// Read-ahead
+/// -------------------------------------------------------------------------
+
+static void prefetch_aio_callback(kv_io_context &op, void *post_data)
+{
+    FTRACE
+    kvaio_t *aio = static_cast<kvaio_t*>(post_data);
+    IoContext *ioc = aio->parent;
+
+    if (op.retcode == 0) {
+        aio->bp.set_length(op.value.length);
+        aio->pbl->append(std::move(aio->bp));
+    }
+
+    if (ioc->mark_io_complete()) {
+        KvsStore::PrefetchContext *ctx = static_cast<KvsStore::PrefetchContext*>(ioc->parent);
+        ctx->store->_prefetch_finish(ctx);
+    }
+}
+
+// detects sequential readers of an object and keeps a window of chunks
+// ahead of them in the buffer cache.
+void KvsStore::_readahead(Collection *c, OnodeRef &o, uint64_t offset, size_t length, uint32_t op_flags, size_t chunks_missed)
+{
+    FTRACE
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const uint64_t chunksize = 1ull << shift;
+    // a stream may not take more than 1/8 of the cache shard
+    const uint32_t max_chunks = std::min<uint64_t>(cct->_conf->kvsstore_prefetch_max_chunks,
+                                                   c->cache->max / (8 * chunksize));
+    if (max_chunks == 0 || (op_flags & CEPH_OSD_OP_FLAG_FADVISE_RANDOM)) return;
+
+    const uint32_t trigger = (op_flags & CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL) ? 0 : cct->_conf->kvsstore_prefetch_trigger;
+    const uint64_t end = p2roundup<uint64_t>(offset + length, chunksize);
+    const uint64_t object_end = p2roundup<uint64_t>(o->onode.size, chunksize);
+
+    uint64_t pf_off = 0, pf_len = 0;
+    {
+        std::lock_guard<std::mutex> l(o->ra.lock);
+        auto &ra = o->ra;
+
+        if (offset != ra.next_off) {
+            // the stream is broken: chunks prefetched beyond the last read are wasted
+            const uint64_t read_end = p2roundup<uint64_t>(ra.next_off, chunksize);
+            if (ra.end > read_end) {
+                logger->inc(l_kvsstore_prefetch_waste, (ra.end - read_end) >> shift);
+                ra.window = std::max<uint32_t>(ra.window / 2, 1);
+            }
+            ra.seq = 0;
+            ra.end = 0;
+        }
+        ra.seq++;
+        ra.next_off = offset + length;
+
+        if (ra.seq <= trigger) return;
+
+        if (offset < ra.end) {
+            const uint64_t chunks = (end - p2align<uint64_t>(offset, chunksize)) >> shift;
+            logger->inc(l_kvsstore_prefetch_hit, chunks - std::min<uint64_t>(chunks, chunks_missed));
+        }
+        if (chunks_missed) {
+            logger->inc(l_kvsstore_prefetch_miss, chunks_missed);
+        }
+
+        // refill once less than half a window is left ahead of the reader
+        ra.window = std::min(std::max(ra.window, std::min<uint32_t>(4, max_chunks)), max_chunks);
+        if (ra.end >= end + ((uint64_t)ra.window << shift) / 2) return;
+
+        const uint64_t from = std::max(ra.end, end);
+        const uint64_t to = std::min(end + ((uint64_t)ra.window << shift), object_end);
+        if (from >= to) return;
+
+        pf_off = from;
+        pf_len = to - from;
+        ra.end = to;
+        ra.window = std::min(ra.window * 2, max_chunks);
+    }
+
+    _prefetch_chunks(c, o, pf_off, pf_len);
+}
+
+void KvsStore::_prefetch_chunks(Collection *c, OnodeRef &o, uint64_t offset, uint64_t length)
+{
+    FTRACE
+    PrefetchContext *ctx = new PrefetchContext(this, c, o, o->bc.get_gen(c->cache));
+
+    ready_regions_t cached;
+    chunk2read_t chunk2read;
+    _read_cache(c->cache, o, offset, length, 0, cached, chunk2read);
+    if (chunk2read.empty()) {
+        delete ctx;
+        return;
+    }
+
+    if (c->osr) {
+        ctx->ioc.qid = c->osr->get_sequencer_id();
+    }
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const std::string key = _get_chunk_key(o);
+    ctx->compressor = c->compressor;
+    for (const uint16_t &chunkid : chunk2read) {
+        bufferlist &bl = ctx->chunks[(uint64_t)chunkid << shift];
+        if (o->onode.is_compressed(chunkid)) {
+            ctx->compressed.insert((uint64_t)chunkid << shift);
+        }
+        db.aio_read_chunk(o->onode.get_chunk_key(chunkid, key), chunkid, 1u << shift, bl, &ctx->ioc, prefetch_aio_callback);
+    }
+
+    chunk_prefetches++;
+    logger->inc(l_kvsstore_prefetch_issued, chunk2read.size());
+    if (ctx->ioc.aio_submit(&db.kadi) != 0) {
+        _prefetch_finish(ctx);
+    }
+}
+
+void KvsStore::_prefetch_finish(PrefetchContext *ctx)
+{
+    FTRACE
+    uint64_t wasted = 0;
+    for (auto &p : ctx->chunks) {
+        if (p.second.length() > 0 && ctx->compressed.count(p.first) &&
+            _decompress_chunk(ctx->compressor, p.second) != 0) {
+            p.second.clear();
+        }
+        // skip chunks that were rewritten or read in the meantime
+        if (p.second.length() == 0 || !ctx->o->exists ||
+            !ctx->o->bc.did_prefetch(ctx->c->cache, ctx->gen, p.first, p.second)) {
+            wasted++;
+        }
+    }
+    if (wasted) {
+        logger->inc(l_kvsstore_prefetch_waste, wasted);
+    }
+    delete ctx;
+    chunk_prefetches--;
+}
+
+static void onode_prefetch_aio_callback(kv_io_context &op, void *post_data)
+{
+    FTRACE
+    kvaio_t *aio = static_cast<kvaio_t*>(post_data);
+    IoContext *ioc = aio->parent;
+
+    // an onode larger than the read is dropped rather than read again
+    if (op.retcode == 0 && op.value.actual_value_size <= op.value.length) {
+        aio->bp.set_length(op.value.length);
+        aio->pbl->append(std::move(aio->bp));
+    } else {
+        ioc->set_return_value((op.retcode)? op.retcode : -ENOSPC);
+    }
+
+    if (ioc->mark_io_complete()) {
+        KvsStore::OnodePrefetchContext *ctx = static_cast<KvsStore::OnodePrefetchContext*>(ioc->parent);
+        ctx->store->_prefetch_onode_finish(ctx);
+    }
+}
+
+/// starts reading the onode of an object that an operation will need; the
+/// onode is cached when the read completes unless the object was looked up
+/// in the meantime
+void KvsStore::prefetch_onode(CollectionHandle &c_, const ghobject_t &oid)
+{
+    FTRACE
+    Collection *c = static_cast<Collection*>(c_.get());
+    if (!c || !c->exists || !c->contains(oid)) return;
+
+    if (c->onode_map.lookup(oid)) return;
+    {
+        std::lock_guard<std::mutex> l(c->prefetch_lock);
+        if (!c->prefetching.emplace(oid, true).second) return;
+        c->num_prefetching++;
+    }
+
+    OnodePrefetchContext *ctx = new OnodePrefetchContext(this, c, oid);
+    if (c->osr) {
+        ctx->ioc.qid = c->osr->get_sequencer_id();
+    }
+    db.aio_read_onode(oid, ctx->bl, &ctx->ioc, c->onode_size_hint, onode_prefetch_aio_callback);
+
+    onode_prefetches++;
+    logger->inc(l_kvsstore_onode_prefetch_issued);
+    if (ctx->ioc.aio_submit(&db.kadi) != 0) {
+        _prefetch_onode_finish(ctx);
+    }
+}
+
+void KvsStore::_prefetch_onode_finish(OnodePrefetchContext *ctx)
+{
+    FTRACE
+    Collection *c = ctx->c.get();
+    bool valid;
+    {
+        std::lock_guard<std::mutex> l(c->prefetch_lock);
+        auto it = c->prefetching.find(ctx->oid);
+        ceph_assert(it != c->prefetching.end());
+        valid = it->second;
+        c->prefetching.erase(it);
+        c->num_prefetching--;
+    }
+
+    // objects that do not exist are not cached, as in Collection::get_onode; the
+    // completion thread does not wait for a writer of the collection
+    std::shared_lock l(c->lock, std::try_to_lock);
+    if (valid && l.owns_lock() && ctx->ioc.get_return_value() == 0 && ctx->bl.length() > 0 &&
+        c->exists && c->contains(ctx->oid)) {
+        if (ctx->bl.length() > c->onode_size_hint) c->onode_size_hint = ctx->bl.length();
+        OnodeRef o(Onode::decode(c, ctx->oid, ctx->bl));
+        c->onode_map.add(ctx->oid, o);
+    } else {
+        logger->inc(l_kvsstore_onode_prefetch_waste);
+    }
+
+    if (l.owns_lock()) l.unlock();
+    delete ctx;
+    onode_prefetches--;
+}
+
 /// -------------------------------------------------------------------------
 /// Transaction
 /// -------------------------------------------------------------------------
@@ -793,19 +1399,35 @@ int KvsStore::queue_transactions(CollectionHandle &ch, vector<Transaction> &tls,
 
     //auto t = ceph_clock_now();
 
+    uint64_t bytes = 0;
+    for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
+        bytes += (*p).get_num_bytes();
+    }
+
+    // wait for the transactions in flight to make room, without tripping
+    // the heartbeat of the op thread
+    const utime_t tstart = ceph_clock_now();
+    if (handle)
+        handle->suspend_tp_timeout();
+    throttle_bytes.get(bytes);
+    if (handle)
+        handle->reset_tp_timeout();
+
     // prepare
     TransContext *txc = _txc_create(static_cast<Collection*>(ch.get()), osr, &on_commit);
-
+    txc->bytes = bytes;
+    _log_latency(l_kvsstore_throttle_lat, l_kvsstore_throttle_lat_hist, txc->start - tstart, bytes);
 
     for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
-        txc->bytes += (*p).get_num_bytes();
         _txc_add_transaction(txc, &(*p));
     }
+    _txc_log_state_latency(txc, l_kvsstore_state_prepare_lat);
 
     // synchronously write metadata to protect the transaction
     if (_txc_write_nodes(txc) != 0) {
         ceph_abort_msg("sync metadata write failed");
     }
+    _txc_log_state_latency(txc, l_kvsstore_state_write_nodes_lat);
 
     _txc_state_proc(txc);
 
@@ -834,12 +1456,14 @@ int KvsStore::_txc_write_nodes(TransContext *txc) {
     bufferlist sbbl;
     std::vector<bufferlist*> bls;
     bls.reserve(txc->onodes.size());
-    IoContext *ioc = new IoContext(0, __func__);
+    IoContext ioc_(0, __func__);
+    IoContext *ioc = &ioc_;
+    ioc->qid = txc->osr->get_sequencer_id();
 
     for (const OnodeRef& o : txc->onodes) {
         kvsstore_omap_list omap_list(&o->onode, cp);
         TRU << "omap flush" << o->oid;
-        omap_list.flush(cct, *ioc, db.omap_writefunc, bls);
+        omap_list.flush(cct, *ioc, db.omap_writefunc, db.omap_removefunc, db.omap_readfunc, bls);
 
         size_t bound = 0;
         denc(o->onode, bound);
@@ -861,12 +1485,17 @@ int KvsStore::_txc_write_nodes(TransContext *txc) {
         }*/
 
         bls.push_back(bl);
+        if (bl->length() > o->c->onode_size_hint) {
+            o->c->onode_size_hint = bl->length();
+        }
 
         //_check_onode_validity(o->onode, bl);
 
         db.aio_write_onode(o->oid, *bl, ioc);
     }
 
+    _txc_write_blobs(txc, ioc, bls);
+
     // objects we modified but didn't affect the onode
     auto p = txc->modified_objects.begin();
     while (p != txc->modified_objects.end()) {
@@ -888,19 +1517,85 @@ int KvsStore::_txc_write_nodes(TransContext *txc) {
     if (!ioc->has_pending_aios())
         return 0;
 
-    int r =  ioc->aio_submit_and_wait(&db.kadi, __func__);
+    int r = _txc_group_commit(*ioc);
 
     for (bufferlist *bl : bls) {
         delete bl;
     }
 
-    delete ioc;
     return r;
 }
 
+/// the writes of concurrent transactions are gathered into a group while the previous group
+/// is being written. The first writer that finds no group in flight submits the whole group
+/// and wakes up the others when it completes.
+int KvsStore::_txc_group_commit(IoContext &ioc) {
+    FTRACE
+    std::unique_lock<std::mutex> l(commit_lock);
+    if (!commit_open_group) {
+        commit_open_group = std::make_shared<MetaCommitGroup>();
+        commit_open_group->ioc.aio_pool = &db.aio_pool;
+        commit_open_group->ioc.submit_queues = &db.submit_queues;
+    }
+    std::shared_ptr<MetaCommitGroup> g = commit_open_group;
+    g->join(ioc);
+
+    while (!g->done) {
+        if (!commit_inflight && g == commit_open_group) {
+            commit_inflight = true;
+            commit_open_group.reset();
+            l.unlock();
+
+            dout(20) << __func__ << " writing a group of " << g->num_txcs << " txcs, "
+                     << g->ioc.pending_aios.size() << " writes" << dendl;
+
+            int r = g->ioc.aio_submit_and_wait(&db.kadi, __func__);
+            // the writes go back to the pools of their sequencers while all the
+            // transactions of the group are still waiting
+            g->ioc.release_running_aios();
+
+            l.lock();
+            g->r = r;
+            g->done = true;
+            commit_inflight = false;
+            commit_cond.notify_all();
+            break;
+        }
+        commit_cond.wait(l);
+    }
+
+    return g->r;
+}
+
+void KvsStore::MetaCommitGroup::join(IoContext &src) {
+    if (num_txcs++ == 0) {
+        ioc.qid = src.qid;
+    }
+    for (kvaio_t &a : src.pending_aios) {
+        kvaio_t *aio = &a;
+        // a later write to the same key supersedes the earlier one in the group
+        std::string key(aio->key, aio->keylength);
+        key.push_back((char)aio->spaceid);
+
+        auto it = writes.find(key);
+        if (it != writes.end()) {
+            ioc.pending_aios.erase(ioc.pending_aios.iterator_to(*it->second));
+            kvaio_pool::dispose(it->second);
+            it->second = aio;
+        } else {
+            writes.emplace(std::move(key), aio);
+        }
+        aio->parent = &ioc;
+    }
+    ioc.pending_aios.splice(ioc.pending_aios.end(), src.pending_aios);
+}
+
 KvsStore::TransContext* KvsStore::_txc_create(Collection *c, OpSequencer *osr, list<Context*> *on_commits) {
     FTRACE
     TransContext *txc = new TransContext(this, cct, c, osr, on_commits);
+    txc->ioc->qid = osr->get_sequencer_id();    // completions of a sequencer are reaped by one queue
+    txc->ioc->batch_writes = cct->_conf->kvsstore_batch_data_ios;
+    txc->ioc->aio_pool = &osr->aio_pool;
     osr->queue_new(txc);
     return txc;
 }
@@ -1198,7 +1893,7 @@ void KvsStore::_txc_add_transaction(TransContext *txc, Transaction *t) {
                 break;
 
             case Transaction::OP_SETALLOCHINT: {
-                r = 0; // alloc hint not needed
+                r = _set_alloc_hint(txc, c, o, op->expected_object_size, op->expected_write_size, op->alloc_hint_flags);
             }
                 break;
 
@@ -1272,6 +1967,9 @@ void KvsStore::_assign_nid(TransContext *txc, OnodeRef o)
     uint64_t nid = ++nid_last;
     dout(20) << __func__ << " " << nid << dendl;
     o->onode.nid = nid;
+    // a new object never stores data under the keys of an earlier one of the same name,
+    // which may still be shared with its clones
+    o->onode.data_ver = nid;
     txc->last_nid = nid;
     o->exists = true;
 }
@@ -1359,7 +2057,38 @@ int KvsStore::_do_write_read_chunks_if_needed(CollectionRef& c, OnodeRef &o, con
     if (tail_off != -1)
         uchunk2read.insert(tail_off / chunksize);
 
+    // chunks that are buffered as a whole, dirty or clean, are read from memory
+    for (auto it = uchunk2read.begin(); it != uchunk2read.end(); ) {
+        const uint64_t c_off = (uint64_t)*it * chunksize;
+        const uint64_t c_len = std::min(chunksize, object_length - c_off);
+        if (o->onode.is_hole(*it)) {
+            bufferlist &bl = readyregions[c_off];
+            bl.append_zero(c_len);
+            bl.rebuild();
+            it = uchunk2read.erase(it);
+            continue;
+        }
+        ready_regions_t cached;
+        interval_set<uint32_t> cached_intervals;
+        o->bc.read(c->cache, c_off, c_len, cached, cached_intervals);
+        if (cached_intervals.size() != c_len) {
+            ++it;
+            continue;
+        }
+
+        bufferlist &bl = readyregions[c_off];
+        for (auto &p : cached) {
+            bl.claim_append(p.second);
+        }
+        bl.rebuild();   // private copy: the cached data may still be in flight
+        logger->inc(l_kvsstore_rmw_cached);
+        it = uchunk2read.erase(it);
+    }
+
     chunk2read.assign(uchunk2read.begin(), uchunk2read.end());
+    if (chunk2read.empty()) {
+        return 0;
+    }
 
     // read the chunks asynchronously
 
@@ -1392,6 +2121,62 @@ void KvsStore::_do_write_pad_zeros(ready_regions_t &readyregions, zero_regions_t
 
 
 
+/// whether the object keeps its data in the onode after a change up to end
+bool KvsStore::_can_inline(OnodeRef &o, uint64_t end)
+{
+    const uint64_t max = std::min<uint64_t>(cct->_conf->kvsstore_inline_max, KVS_INLINE_MAX_SIZE);
+    if (end > max) return false;
+    // an empty object owns no chunks
+    return o->onode.inlined || o->onode.size == 0;
+}
+
+void KvsStore::_do_write_inline(OnodeRef &o, uint64_t offset, uint64_t length, bufferlist::iterator* blp)
+{
+    FTRACE
+    // the old data may still be referenced by an onode being written, so it is copied
+    const bufferlist &old = o->onode.inline_data;
+    const uint64_t end = offset + length;
+    bufferlist data;
+    data.substr_of(old, 0, std::min<uint64_t>(offset, old.length()));
+    data.append_zero(offset - data.length());
+    if (blp) {
+        blp->copy(length, data);
+    } else {
+        data.append_zero(length);
+    }
+    if (end < old.length()) {
+        bufferlist tail;
+        tail.substr_of(old, end, old.length() - end);
+        data.claim_append(tail);
+    }
+    data.rebuild();
+
+    o->onode.inline_data.swap(data);
+    o->onode.inlined = true;
+    o->onode.size = o->onode.inline_data.length();
+}
+
+/// moves the data of an inlined object to chunks
+void KvsStore::_do_promote_inline(TransContext *txc, CollectionRef &c, OnodeRef &o)
+{
+    FTRACE
+    bufferlist data;
+    data.swap(o->onode.inline_data);
+    o->onode.inlined = false;
+    o->onode.chunk_shift = c->cnode.chunk_shift;
+
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const std::string key = _get_chunk_key(o);
+    uint16_t chunkid = 0;
+    for (uint64_t c_off = 0; c_off < data.length(); c_off += (1ull << shift), chunkid++) {
+        bufferlist bl;
+        bl.substr_of(data, c_off, std::min<uint64_t>(1ull << shift, data.length() - c_off));
+        o->bc.write(c->cache, txc->seq, c_off, bl, 0);
+        _do_write_chunk(txc, c, o, key, chunkid, bl);
+    }
+    logger->inc(l_kvsstore_inline_promoted);
+}
+
 int KvsStore::_do_write(TransContext *txc, CollectionRef& c, OnodeRef &o,
         uint64_t offset, uint64_t length, bufferlist::iterator* blp)
 {
@@ -1402,12 +2187,30 @@ int KvsStore::_do_write(TransContext *txc, CollectionRef& c, OnodeRef &o,
         return 0;
     }
 
+    if (_can_inline(o, offset + length)) {
+        _do_write_inline(o, offset, length, blp);
+        return 0;
+    }
+    if (o->onode.inlined) {
+        _do_promote_inline(txc, c, o);
+    }
+
     zero_regions_t zero_regions;
     ready_regions_t ready_regions;
 
+    if (o->onode.size == 0) {
+        // an object without data takes the chunk size of its pool
+        o->onode.chunk_shift = c->cnode.chunk_shift;
+    }
+
+    if (offset > o->onode.size) {
+        int r = _do_extend(txc, c, o, offset);
+        if (r != 0) return r;
+    }
+
     const uint64_t object_length = o->onode.size;
     const uint64_t e = offset + length;
-    const uint64_t chunksize = KVS_OBJECT_SPLIT_SIZE;
+    const uint64_t chunksize = 1ull << get_chunk_shift(o->onode);
 
     int r = _do_write_read_chunks_if_needed(c, o, object_length, offset, length, ready_regions, zero_regions, chunksize);
     if (r != 0) return r;
@@ -1464,30 +2267,26 @@ int KvsStore::_do_write(TransContext *txc, CollectionRef& c, OnodeRef &o,
     }
 
     TRW << "Sending IOs to KVSSD";
-    // send write to KVSSD
-    void *buf_addr;
-    uint64_t buf_len;
-    uint32_t to_write;
 
-//    unsigned i =0;
-    uint32_t c_off = start_c_off;
-    uint16_t chunkid = p2align(start_c_off, chunksize);
-    while (sum > 0) {
-        o->bc.get_buffer_address(c->cache, c_off, &buf_addr, &buf_len);
-        to_write = std::min(sum, buf_len);
-
-        TRW << "AIO write: chunk " << chunkid << ", to_write " << to_write  ;
+    // store each modified chunk as a whole, up to the end of the object
+    const uint64_t new_size = std::max<uint64_t>(offset, o->onode.size);
+    const std::string key = _get_chunk_key(o);
+    uint64_t c_off = start_c_off;
+    uint16_t chunkid = start_c_off / chunksize;
+    for (uint64_t i = 0; i < nc; i++, c_off += chunksize, chunkid++) {
+        bufferlist &bl = ready_regions[c_off];
+        bufferlist data;
+        data.substr_of(bl, 0, std::min<uint64_t>(bl.length(), new_size - c_off));
 
-        db.aio_write_chunk(o->oid, chunkid, buf_addr, to_write, txc->ioc);
+        TRW << "AIO write: chunk " << chunkid << ", to_write " << data.length()  ;
 
-        sum   -= to_write;
-        c_off += to_write;
-        chunkid++;
+        // a shared chunk is copied on write: the new data goes under the object's own key
+        _unshare_chunk(txc, o, chunkid);
+        o->onode.fill_hole(chunkid);
+        _do_write_chunk(txc, c, o, key, chunkid, data);
     }
 
-    if (offset > o->onode.size) {
-        o->onode.size = offset;
-    }
+    o->onode.size = new_size;
     TRW << "_do_write finished" ;
 
     return 0;
@@ -1501,13 +2300,129 @@ int KvsStore::_zero(TransContext *txc, CollectionRef &c, OnodeRef &o,
              << std::hex << offset << "~" << length << std::dec
              << dendl;
 
-    int r = _do_write(txc, c, o, offset, length, 0);
+    if (length == 0) {
+        return 0;
+    }
+    if (_can_inline(o, std::max<uint64_t>(offset + length, o->onode.size))) {
+        _do_write_inline(o, offset, length, 0);
+        txc->write_onode(o);
+        return 0;
+    }
+    if (o->onode.inlined) {
+        _do_promote_inline(txc, c, o);
+    }
+
+    int r = 0;
+    const uint64_t shift = get_chunk_shift(o->onode);
+    const uint64_t chunksize = 1ull << shift;
+    uint64_t end = offset + length;
+
+    if (length > 0 && end > o->onode.size) {
+        // zeros past the end only extend the object
+        const uint64_t size = o->onode.size;
+        r = _do_extend(txc, c, o, end);
+        end = std::max(offset, size);
+    }
+
+    // whole chunks are dropped instead of being written with zeros
+    const uint64_t first = p2roundup<uint64_t>(offset, chunksize);
+    const uint64_t last = p2align<uint64_t>(end, chunksize);
+    if (r == 0 && first < last) {
+        if (offset < first) {
+            r = _do_write(txc, c, o, offset, first - offset, 0);
+        }
+        _do_punch(txc, c, o, first >> shift, (last - first) >> shift);
+        if (r == 0 && last < end) {
+            r = _do_write(txc, c, o, last, end - last, 0);
+        }
+    } else if (r == 0 && offset < end) {
+        r = _do_write(txc, c, o, offset, end - offset, 0);
+    }
+    txc->write_onode(o);
+
     dout(10) << __func__ << " " << c->cid << " " << o->oid << " 0x"
              << std::hex << offset << "~" << length << std::dec
              << " = " << r << dendl;
     return r;
 }
 
+/// grows the object to new_size: the rest of its last chunk is cleared and
+/// the chunks after it are left as holes
+int KvsStore::_do_extend(TransContext *txc, CollectionRef &c, OnodeRef &o, uint64_t new_size)
+{
+    FTRACE
+    const uint64_t size = o->onode.size;
+    if (new_size <= size) return 0;
+
+    if (size == 0) {
+        o->onode.chunk_shift = c->cnode.chunk_shift;
+    }
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const uint64_t chunksize = 1ull << shift;
+
+    // a truncated chunk may still hold data past the old end
+    const uint64_t tail_end = std::min(p2roundup<uint64_t>(size, chunksize), new_size);
+    if (size < tail_end && !o->onode.is_hole(size >> shift)) {
+        int r = _do_write(txc, c, o, size, tail_end - size, 0);
+        if (r != 0) return r;
+    }
+
+    const uint64_t first = p2roundup<uint64_t>(size, chunksize) >> shift;
+    const uint64_t last = p2roundup<uint64_t>(new_size, chunksize) >> shift;
+    if (first < last) {
+        o->onode.punch_holes(first, last - first);
+    }
+    o->onode.size = new_size;
+    return 0;
+}
+
+/// drops n whole chunks below the object size, which then read as zeros
+void KvsStore::_do_punch(TransContext *txc, CollectionRef &c, OnodeRef &o, uint32_t chunkid, uint32_t n)
+{
+    FTRACE
+    const uint32_t shift = get_chunk_shift(o->onode);
+    const std::string key = _get_chunk_key(o);
+    for (uint32_t i = chunkid; i < chunkid + n; i++) {
+        o->bc.discard(c->cache, (uint64_t)i << shift, 1ull << shift);
+        o->onode.set_compressed(i, false);
+        if (o->onode.is_hole(i)) continue;
+        if (o->onode.get_shared(i)) {
+            _unshare_chunk(txc, o, i);
+        } else {
+            txc->wb_chunks.emplace_back(key, i, true);
+        }
+    }
+    o->onode.punch_holes(chunkid, n);
+}
+
+/// stores a chunk through the write-back buffer, compressed if it is worth it
+void KvsStore::_do_write_chunk(TransContext *txc, CollectionRef &c, OnodeRef &o, const std::string &key, uint16_t chunkid, bufferlist &data)
+{
+    FTRACE
+    bufferlist compressed;
+    if (_compress_chunk(c.get(), o, data, compressed)) {
+        o->onode.set_compressed(chunkid, true);
+        txc->wb_chunks.emplace_back(key, chunkid, false, &compressed);
+    } else {
+        o->onode.set_compressed(chunkid, false);
+        txc->wb_chunks.emplace_back(key, chunkid, false, &data);
+    }
+}
+
+int KvsStore::_set_alloc_hint(TransContext *txc, CollectionRef &c, OnodeRef &o,
+                              uint64_t expected_object_size, uint64_t expected_write_size, uint32_t flags)
+{
+    FTRACE
+    dout(15) << __func__ << " " << c->cid << " " << o->oid
+             << " flags " << ceph_osd_alloc_hint_flag_string(flags) << dendl;
+    // only the flags are used, to choose whether to compress the data
+    if (o->onode.alloc_hint_flags != flags) {
+        o->onode.alloc_hint_flags = flags;
+        txc->write_onode(o);
+    }
+    return 0;
+}
+
 int KvsStore::_truncate(TransContext *txc, CollectionRef &c, OnodeRef &o,
                         uint64_t offset) {
     FTRACE
@@ -1527,25 +2442,49 @@ void KvsStore::_do_truncate(TransContext *txc, CollectionRef &c, OnodeRef o,
     dout(15) << __func__  << " " << o->oid << " 0x"
              << std::hex << offset << std::dec << dendl;
 
-    const uint64_t chunksize = KVS_OBJECT_SPLIT_SIZE;
+    const uint64_t chunksize = 1ull << get_chunk_shift(o->onode);
 
     if (offset == o->onode.size)
         return;
 
-    if (offset < o->onode.size) {
-        uint64_t start_c_off = p2align(offset, chunksize);
-        uint64_t end_c_off   = p2align(o->onode.size, chunksize);
+    if (_can_inline(o, std::max(offset, o->onode.size))) {
+        bufferlist data;
+        data.substr_of(o->onode.inline_data, 0, std::min(offset, o->onode.size));
+        data.append_zero(offset - data.length());
+        o->onode.inline_data.swap(data);
+        o->onode.inlined = true;
+        o->onode.size = offset;
+        txc->write_onode(o);
+        return;
+    }
+    if (o->onode.inlined) {
+        _do_promote_inline(txc, c, o);
+    }
 
-        if (start_c_off != offset) {
-            start_c_off++;
+    if (offset > o->onode.size) {
+        int r = _do_extend(txc, c, o, offset);
+        if (r != 0) {
+            derr << __func__ << " failed to clear the end of " << o->oid << ": ret = " << r << dendl;
         }
+    } else {
+        // chunks that lie entirely beyond the new size; a partial one is kept
+        uint64_t start_c_off = p2roundup(offset, chunksize);
+        uint64_t end_c_off   = o->onode.size;
 
-        uint16_t chunkid = p2align(start_c_off, chunksize);
-        for (uint32_t c_off = start_c_off; c_off <= end_c_off; c_off += chunksize, ++chunkid) {
+        const std::string key = _get_chunk_key(o);
+        uint16_t chunkid = start_c_off / chunksize;
+        for (uint64_t c_off = start_c_off; c_off < end_c_off; c_off += chunksize, ++chunkid) {
             // remove from a cache
             o->bc.discard(c->cache, c_off, chunksize);
-            db.aio_remove_chunk(o->oid, chunkid, txc->ioc);
+            if (o->onode.is_hole(chunkid)) continue;
+            if (o->onode.get_shared(chunkid)) {
+                _unshare_chunk(txc, o, chunkid);
+            } else {
+                txc->wb_chunks.emplace_back(key, chunkid, true);
+            }
         }
+        o->onode.trim_holes(start_c_off / chunksize);
+        o->onode.trim_compressed(start_c_off / chunksize);
     }
 
     o->onode.size = offset;
@@ -1605,15 +2544,64 @@ int KvsStore::_clone(TransContext *txc, CollectionRef &c, OnodeRef &oldo, OnodeR
 
     _do_truncate(txc, c, newo, 0);
 
-    bufferlist bl;
+    if (oldo->onode.inlined) {
+        newo->onode.inlined = true;
+        newo->onode.inline_data = oldo->onode.inline_data;
+        newo->onode.size = oldo->onode.size;
+    } else if (oldo->onode.size > 0) {
+        newo->onode.inlined = false;
+        // share the chunks instead of copying them
+        const uint32_t shift = get_chunk_shift(oldo->onode);
+        const uint32_t nchunks = p2roundup<uint64_t>(oldo->onode.size, 1ull << shift) >> shift;
+
+        // chunks the source owns are frozen into a new blob under their current keys
+        kvsstore_blob_t blob;
+        uint32_t start = 0;
+        for (uint32_t chunkid = 0; chunkid <= nchunks; chunkid++) {
+            if (chunkid < nchunks && !oldo->onode.get_shared(chunkid) && !oldo->onode.is_hole(chunkid)) continue;
+            if (chunkid > start) blob.chunks[start] = chunkid - start;
+            start = chunkid + 1;
+        }
+        if (!blob.chunks.empty()) {
+            const uint64_t sid = ++nid_last;
+            blob.refs = 1;
+            blob.key = _get_chunk_key(oldo);
+            for (const auto &p : blob.chunks) {
+                oldo->onode.shared[p.first] = { p.second, sid };
+                logger->inc(l_kvsstore_clone_shared, p.second);
+            }
+            oldo->onode.blobs[sid] = blob.key;
+            {
+                std::lock_guard<std::mutex> l(blob_lock);
+                SharedBlob &sb = blob_map[sid];
+                sb.blob = std::move(blob);
+                sb.lru = blob_lru.end();
+                _blob_pin(txc, sid);
+            }
 
-    r = _do_read(c.get(), oldo, 0, oldo->onode.size, bl, 0);
-    if (r < 0) return r;
+            // later writes of the source go to new keys
+            oldo->onode.data_ver = ++nid_last;
+            txc->write_onode(oldo);
+        }
 
-    bufferlist::iterator blp = bl.begin();
+        newo->onode.chunk_shift = oldo->onode.chunk_shift;
+        newo->onode.size = oldo->onode.size;
+        newo->onode.shared = oldo->onode.shared;
+        newo->onode.blobs = oldo->onode.blobs;
+        newo->onode.holes = oldo->onode.holes;
+        newo->onode.compressed = oldo->onode.compressed;
+        for (const auto &p : newo->onode.blobs) {
+            _blob_ref(txc, p.first);
+        }
 
-    r = _do_write(txc, c, newo, 0, oldo->onode.size, &blp);
-    if (r < 0) return r;
+        // data of the source that is not stored yet is read from the clone's cache
+        ready_regions_t cached;
+        interval_set<uint32_t> cached_intervals;
+        oldo->bc.read(c->cache, 0, oldo->onode.size, cached, cached_intervals);
+        for (auto &p : cached) {
+            newo->bc.write(c->cache, txc->seq, p.first, p.second, 0);
+        }
+    }
 
     newo->onode.attrs = oldo->onode.attrs;
 
@@ -1625,8 +2613,10 @@ int KvsStore::_clone(TransContext *txc, CollectionRef &c, OnodeRef &oldo, OnodeR
     }
 
     // clone omap
+    std::set<std::string> old_keys;
     kvsstore_omap_list omap_list(&oldo->onode, cp);
-    omap_list.load_omap(cct, db.omap_readfunc);
+    r = omap_list.list(cct, &old_keys, db.omap_readfunc);
+    if (r < 0) return r;
 
     // clone attrs, omap , omap header
     //newo->onode.omaps = oldo->onode.omaps;
@@ -1635,18 +2625,18 @@ int KvsStore::_clone(TransContext *txc, CollectionRef &c, OnodeRef &oldo, OnodeR
     // copy omap data
     {
         std::vector<bufferlist*> old_omap_values;
-        old_omap_values.reserve(oldo->onode.omaps.size());
+        old_omap_values.reserve(old_keys.size());
         //txc->omap_data.reserve(oldomap->size());
         {
             IoContext ioc(0, __func__);
             kvsstore_omap_list new_omap_list(&newo->onode, cp);
 
-            for (const std::string &name : oldo->onode.omaps) {
+            for (const std::string &name : old_keys) {
                 new_omap_list.insert(cct, name, db.omap_readfunc);
                 TRU << "onode = " << newo->oid << ", insert " << name ;
                 bufferlist *bl = new bufferlist();
                 old_omap_values.push_back(bl);
-                db.aio_read_omap(oldo->onode.nid, name, *bl, &ioc);
+                db.aio_read_omap(oldo->onode.nid, name, *bl, &ioc, oldo->omap_value_hint);
             }
             int r = ioc.aio_submit_and_wait(&db.kadi, __func__);
             if (r != 0) {
@@ -1655,10 +2645,11 @@ int KvsStore::_clone(TransContext *txc, CollectionRef &c, OnodeRef &oldo, OnodeR
             }
 
             int i = 0;
-            for (const std::string &name : oldo->onode.omaps) {
+            for (const std::string &name : old_keys) {
                 bufferlist *bl = old_omap_values[i++];
                 txc->omap_data.push_back(bl);
                 db.aio_write_omap(newo->onode.nid, name, *bl, txc->ioc);
+                newo->omap_value_hint = std::max(newo->omap_value_hint, bl->length());
             }
         }
     }
@@ -1669,6 +2660,130 @@ int KvsStore::_clone(TransContext *txc, CollectionRef &c, OnodeRef &oldo, OnodeR
 }
 
 
+/// data key of chunk 0 of the chunks the object owns
+std::string KvsStore::_get_chunk_key(OnodeRef &o)
+{
+    return db.get_chunk_key(o->oid, o->onode.data_ver);
+}
+
+/// returns the cached blob, reading it if needed, and pins it for the
+/// transaction that changes it; called with blob_lock held
+kvsstore_blob_t &KvsStore::_blob_get(TransContext *txc, uint64_t sid)
+{
+    FTRACE
+    auto it = blob_map.find(sid);
+    if (it == blob_map.end()) {
+        it = blob_map.emplace(sid, SharedBlob()).first;
+        it->second.lru = blob_lru.end();
+        bufferlist bl;
+        int r = db.read_blob(sid, bl);
+        if (r != 0) {
+            derr << __func__ << " failed to read shared blob " << sid << ": ret = " << r << dendl;
+            ceph_abort_msg("missing shared blob");
+        }
+        auto p = bl.cbegin();
+        decode(it->second.blob, p);
+    }
+    _blob_pin(txc, sid);
+    return it->second.blob;
+}
+
+/// keeps the blob cached until the transaction is finished, as the device
+/// holds its old reference count until then; called with blob_lock held
+void KvsStore::_blob_pin(TransContext *txc, uint64_t sid)
+{
+    if (!txc->blobs_dirty.insert(sid).second) return;
+
+    SharedBlob &sb = blob_map[sid];
+    if (sb.pins++ == 0 && sb.lru != blob_lru.end()) {
+        blob_lru.erase(sb.lru);
+        sb.lru = blob_lru.end();
+    }
+}
+
+void KvsStore::_blob_ref(TransContext *txc, uint64_t sid)
+{
+    FTRACE
+    std::lock_guard<std::mutex> l(blob_lock);
+    _blob_get(txc, sid).refs++;
+}
+
+/// drops a reference to the blob; the last one removes its chunks
+void KvsStore::_blob_put(TransContext *txc, uint64_t sid)
+{
+    FTRACE
+    std::lock_guard<std::mutex> l(blob_lock);
+    kvsstore_blob_t &blob = _blob_get(txc, sid);
+    ceph_assert(blob.refs > 0);
+    if (--blob.refs == 0) {
+        // removed through the write-back buffer, after any store of the same chunks
+        for (const auto &p : blob.chunks) {
+            for (uint16_t chunkid = p.first; chunkid < p.first + p.second; chunkid++) {
+                txc->wb_chunks.emplace_back(blob.key, chunkid, true);
+            }
+        }
+    }
+}
+
+void KvsStore::_unshare_chunk(TransContext *txc, OnodeRef &o, uint16_t chunkid)
+{
+    FTRACE
+    const uint64_t sid = o->onode.unshare(chunkid);
+    if (sid == 0) return;
+
+    logger->inc(l_kvsstore_clone_unshared);
+    if (!o->onode.references(sid)) {
+        o->onode.blobs.erase(sid);
+        _blob_put(txc, sid);
+    }
+}
+
+/// stores the reference counts of the blobs the transaction changed
+void KvsStore::_txc_write_blobs(TransContext *txc, IoContext *ioc, std::vector<bufferlist*> &bls)
+{
+    FTRACE
+    std::lock_guard<std::mutex> l(blob_lock);
+    for (const uint64_t sid : txc->blobs_dirty) {
+        auto it = blob_map.find(sid);
+        if (it == blob_map.end()) continue;
+
+        if (it->second.blob.refs == 0) {
+            db.aio_remove_blob(sid, ioc);
+            blob_map.erase(it);
+            continue;
+        }
+        bufferlist *bl = new bufferlist();
+        encode(it->second.blob, *bl);
+        bls.push_back(bl);
+        db.aio_write_blob(sid, *bl, ioc);
+    }
+}
+
+/// unpins the blobs of a finished transaction and trims the unpinned ones
+/// to kvsstore_blob_cache_size
+void KvsStore::_txc_release_blobs(TransContext *txc)
+{
+    FTRACE
+    std::lock_guard<std::mutex> l(blob_lock);
+    for (const uint64_t sid : txc->blobs_dirty) {
+        auto it = blob_map.find(sid);
+        if (it == blob_map.end()) continue;    // removed with its last reference
+
+        SharedBlob &sb = it->second;
+        ceph_assert(sb.pins > 0);
+        if (--sb.pins == 0) {
+            blob_lru.push_front(sid);
+            sb.lru = blob_lru.begin();
+        }
+    }
+
+    const uint64_t max = cct->_conf->kvsstore_blob_cache_size;
+    while (blob_map.size() > max && !blob_lru.empty()) {
+        blob_map.erase(blob_lru.back());
+        blob_lru.pop_back();
+    }
+}
+
 int KvsStore::_clone_range(TransContext *txc, CollectionRef &c,
                            OnodeRef &oldo, OnodeRef &newo, uint64_t srcoff, uint64_t length,
                            uint64_t dstoff) {
@@ -1913,13 +3028,14 @@ int KvsStore::getattrs(CollectionHandle &c_, const ghobject_t &oid,
 
 void KvsStore::_do_omap_clear(TransContext *txc, OnodeRef &o) {
     FTRACE
+    std::set<std::string> keys;
     kvsstore_omap_list omap_list(&o->onode, cp);
-    omap_list.load_omap(cct, db.omap_readfunc);
+    omap_list.list(cct, &keys, db.omap_readfunc);
 
-    for (const std::string &user_key: o->onode.omaps) {
+    for (const std::string &user_key: keys) {
         db.aio_remove_omap(o->onode.nid, user_key, txc->ioc);
     }
-    omap_list.clear(*txc->ioc, db.omap_removefunc);
+    omap_list.clear(*txc->ioc, db.omap_removefunc, db.omap_readfunc);
     o->onode.omap_header.clear();
 }
 
@@ -1951,7 +3067,7 @@ int KvsStore::_omap_setkeys(TransContext *txc, CollectionRef &c,
 
     kvsstore_omap_list omap_list(&o->onode, cp);
 
-    TR2 << "oid = " << o->oid << ", omap_setkeys , num = " << num << ", total pages = " << (int)o->onode.num_omap_extents;
+    TR2 << "oid = " << o->oid << ", omap_setkeys , num = " << num << ", delta = " << o->onode.omap_delta.length();
 
     while (num > 0) {
         string key;
@@ -1966,6 +3082,7 @@ int KvsStore::_omap_setkeys(TransContext *txc, CollectionRef &c,
 
         if (list->length() > 0)
             db.aio_write_omap(o->onode.nid, key, *list, txc->ioc);
+        o->omap_value_hint = std::max(o->omap_value_hint, list->length());
         // value
 
         num--;
@@ -1997,7 +3114,7 @@ int KvsStore::_omap_rmkeys(TransContext *txc, CollectionRef &c, OnodeRef &o,
 
     txc->write_onode(o);
 
-    TR2 << "oid = " << o->oid << ", omap removekeys, deleting num = " << num << ", num extents = " << (int)o->onode.num_omap_extents << ", num keys = " << o->onode.omaps.size();
+    TR2 << "oid = " << o->oid << ", omap removekeys, deleting num = " << num << ", delta = " << o->onode.omap_delta.length();
 
     kvsstore_omap_list omap_list(&o->onode, cp);
 
@@ -2029,6 +3146,8 @@ int KvsStore::_omap_rmkey_range(TransContext *txc, CollectionRef &c,
     });
 
     TR2 << "oid = " << o->oid << ", omap remove keys = " << removed;
+    if (removed > 0)
+        txc->write_onode(o);
 
     return 0;
 }
@@ -2154,7 +3273,7 @@ int KvsStore::omap_get_values(CollectionHandle &c_, const ghobject_t &oid,
 
     for (const std::string &p : existing_keys) {
         bufferlist &bl = (*out)[p];
-        db.aio_read_omap(o->onode.nid, p, bl, &ioc);
+        db.aio_read_omap(o->onode.nid, p, bl, &ioc, o->omap_value_hint);
     }
 
     return ioc.aio_submit_and_wait(&db.kadi, __func__);;
@@ -2185,126 +3304,189 @@ int KvsStore::omap_get_impl(Collection *c, const ghobject_t &oid,
 
     *header = o->onode.omap_header;
 
-    IoContext ioc (0,__func__);
-
-    std::set<std::string> existing_keys;
+    // list the keys a batch at a time while the values of the previous batch are read
+    const uint32_t batch_size = std::max<uint64_t>(1, cct->_conf->kvsstore_omap_iterator_batch);
     kvsstore_omap_list omap_list(&o->onode, cp);
-    omap_list.list(cct, &existing_keys, db.omap_readfunc);
-    TRU << "omap list oid = " << o->oid << ", output = " << existing_keys.size();
-    for (const std::string &p : existing_keys) {
-        bufferlist &bl = (*out)[p];
-        db.aio_read_omap(o->onode.nid, p, bl, &ioc);
+    std::unique_ptr<IoContext> inflight;
+    std::vector<std::string> keys;
+    std::string from;
+    bool inclusive = true;
+    int r = 0;
+
+    while (true) {
+        keys.clear();
+        r = omap_list.list_range(cct, from, inclusive, batch_size, &keys, db.omap_readfunc);
+        if (r < 0) break;
+
+        std::unique_ptr<IoContext> ioc;
+        if (!keys.empty()) {
+            ioc.reset(new IoContext(0, __func__));
+            for (const std::string &p : keys) {
+                bufferlist &bl = (*out)[p];
+                db.aio_read_omap(o->onode.nid, p, bl, ioc.get(), o->omap_value_hint);
+            }
+            ioc->aio_submit(&db.kadi, true);
+        }
+
+        if (inflight) {
+            inflight->aio_wait();
+            r = inflight->get_return_value();
+        }
+        inflight = std::move(ioc);
+        if (r != 0 || keys.size() < batch_size) break;
+
+        from = keys.back();
+        inclusive = false;
     }
 
-    return ioc.aio_submit_and_wait(&db.kadi, __func__);;
+    if (inflight) {
+        inflight->aio_wait();
+        if (r == 0) r = inflight->get_return_value();
+    }
+    TRU << "omap get oid = " << o->oid << ", output = " << out->size() << ", r = " << r;
+    return r;
 }
 
 
 
 class KvsStore::OmapIteratorImpl : public ObjectMap::ObjectMapIteratorImpl {
+    // a run of consecutive keys and the reads of their values
+    struct Batch {
+        std::vector<std::string> keys;
+        std::vector<bufferlist> values;
+        std::unique_ptr<IoContext> ioc;     ///< value reads in flight
+        bool last = true;                   ///< no keys follow this batch
+        int r = 0;
+    };
+
     KvsStore *store;
     CollectionRef c;
     OnodeRef o;
-    //map<string,bufferlist> omap;
-    set<std::string> omaps;
-    set<std::string>::iterator it;
+    const uint32_t batch_size;
+    Batch cur;          ///< batch the iterator is in
+    Batch ahead;        ///< batch that follows cur, read while cur is consumed
+    size_t pos = 0;
+    int r = 0;
+
+    void _wait(Batch &b) {
+        if (b.ioc) {
+            b.ioc->aio_wait();
+            b.r = b.ioc->get_return_value();
+            b.ioc.reset();
+        }
+    }
+
+    // fetch the keys after (or from) the given key and start reading their values
+    void _fill(Batch &b, const string &from, bool inclusive) {
+        _wait(b);
+        b.keys.clear();
+        b.values.clear();
+        b.last = true;
+        b.r = 0;
+        if (!o->onode.has_omap()) return;
+
+        kvsstore_omap_list omap_list(&o->onode, store->cp);
+        int ret = omap_list.list_range(store->cct, from, inclusive, batch_size, &b.keys, store->db.omap_readfunc);
+        if (ret < 0) {
+            r = ret;
+            b.keys.clear();
+            return;
+        }
+        b.last = (b.keys.size() < batch_size);
+        if (b.keys.empty()) return;
+
+        b.values.resize(b.keys.size());
+        b.ioc.reset(new IoContext(0, __func__));
+        b.ioc->qid = c->osr->get_sequencer_id();
+        for (size_t i = 0; i < b.keys.size(); i++) {
+            store->db.aio_read_omap(o->onode.nid, b.keys[i], b.values[i], b.ioc.get(), o->omap_value_hint);
+        }
+        b.ioc->aio_submit(&store->db.kadi, true);
+    }
+
+    void _read_ahead() {
+        if (!cur.last) {
+            _fill(ahead, cur.keys.back(), false);
+            return;
+        }
+        _wait(ahead);
+        ahead.keys.clear();
+        ahead.values.clear();
+        ahead.last = true;
+    }
+
+    int _seek(const string &from, bool inclusive) {
+        r = 0;
+        _fill(cur, from, inclusive);
+        pos = 0;
+        _read_ahead();
+        return r;
+    }
+
 public:
     OmapIteratorImpl(KvsStore *store_, CollectionRef c, OnodeRef o)
-            : store(store_), c(c), o(o) {
+            : store(store_), c(c), o(o),
+              batch_size(std::max<uint64_t>(1, store_->cct->_conf->kvsstore_omap_iterator_batch)) {
+        _seek(string(), true);
+    }
 
-        kvsstore_omap_list omap_list(&o->onode, store->cp);
-        omap_list.list(store->cct, &omaps, store->db.omap_readfunc);
-        TRU << "omap list oid = " << o->oid << ", output = " << omaps.size();
-        seek_to_first();
+    ~OmapIteratorImpl() override {
+        _wait(cur);
+        _wait(ahead);
     }
 
     int seek_to_first() override {
         FTRACE
         std::shared_lock l(c->lock);
-        
-        if (o->onode.has_omap()) {
-            it = omaps.begin();
-        } else {
-            it = set<std::string>::iterator();
-        }
-        
-        return 0;
+        return _seek(string(), true);
     }
     int upper_bound(const string &after) override {
         FTRACE
         std::shared_lock l(c->lock);
-        
-        if (o->onode.has_omap()) {
-            it = omaps.upper_bound(after);
-        } else {
-            it = set<std::string>::iterator();
-        }
-        
-        return 0;
+        return _seek(after, false);
     }
     int lower_bound(const string &to) override {
         FTRACE
         std::shared_lock l(c->lock);
-        
-        if (o->onode.has_omap()) {
-            it = omaps.lower_bound(to);
-        } else {
-            it = set<std::string>::iterator();
-        }
-        
-        return 0;
+        return _seek(to, true);
     }
     bool valid() override {
         FTRACE
-        std::shared_lock l(c->lock);
-        
-        
-        return o->onode.has_omap() && it != omaps.end();
+        return pos < cur.keys.size();
     }
 
     int next() override {
         FTRACE
-        int r = -1;
-        
-        std::shared_lock l(c->lock);
-        
-        if (o->onode.has_omap()) {
-            ++it;
-            r = 0;
+        if (!valid()) return -1;
+
+        if (++pos == cur.keys.size() && !cur.last) {
+            std::shared_lock l(c->lock);
+            _wait(cur);
+            std::swap(cur, ahead);
+            pos = 0;
+            _read_ahead();
         }
-        
-        return r;
+        return 0;
     }
     string key() override {
         FTRACE
-        std::shared_lock l(c->lock);
-        
         ceph_assert(valid());
-        
-        return *it;
+        return cur.keys[pos];
     }
 
     bufferlist value() override {
         FTRACE
-        std::shared_lock l(c->lock);
-        
-        bufferlist bl;
-
-        IoContext ioc ( 0,__func__);
-
-        const std::string &key = *it;
-
-        store->db.aio_read_omap(o->onode.nid, key, bl, &ioc);
-
-
-        int r = ioc.aio_submit_and_wait(&store->db.kadi, __func__);
-        ceph_assert(r == 0);
-        
-        return bl;
+        ceph_assert(valid());
+        _wait(cur);
+        // keys set with an empty value have no value stored
+        if (cur.r != 0 && cur.r != KV_ERR_KEY_NOT_EXIST) {
+            r = -EIO;
+        }
+        return cur.values[pos];
     }
 
     int status() override {
-        return 0;
+        return r;
     }
 };
 
@@ -2444,6 +3626,13 @@ int KvsStore::_do_remove_collection(TransContext *txc, CollectionRef *c)
     (*c)->exists = false;
     _osr_register_zombie((*c)->osr.get());
     db.aio_remove_coll((*c)->cid, txc->ioc);
+
+    // the last collection of a pool shard takes its onode index with it, once the txc
+    // has committed and the oplog is indexed (_kv_index_thread)
+    const uint32_t tree = db.get_onode_tree((*c)->cid);
+    if (tree != GROUP_PREFIX_ONODE && !_has_onode_tree(tree)) {
+        txc->dropped_onode_trees.push_back(tree);
+    }
     c->reset();
     return 0;
 }
@@ -2639,6 +3828,7 @@ int KvsStore::_collection_list(Collection *c, const ghobject_t &start,
     kv_key temp_start_key = {buf1, 17}, temp_end_key = {buf2, 17};
     kv_key start_key= {buf3, 17}, end_key= {buf4, 17};
     KvsIterator *it = 0;
+    utime_t istart;
     ghobject_t static_next;
     if (!pnext)
         pnext = &static_next;
@@ -2663,7 +3853,8 @@ int KvsStore::_collection_list(Collection *c, const ghobject_t &start,
            << print_kvssd_key(start_key.key, start_key.length) << " to "
            << print_kvssd_key(end_key.key, end_key.length) << " start " << start;
 
-        it = db.get_iterator(GROUP_PREFIX_ONODE);
+        istart = ceph_clock_now();
+        it = db.get_onode_iterator(c->cid);
 
         if (start == ghobject_t() || start == c->cid.get_min_hobj()) {
             it->upper_bound(temp_start_key);
@@ -2744,7 +3935,10 @@ out:
     if (!set_next) {
         *pnext = ghobject_t::get_max();
     }
-    if (it) delete it;
+    if (it) {
+        _log_latency(l_kvsstore_dev_iterate_lat, l_kvsstore_dev_iterate_lat_hist, ceph_clock_now() - istart, ls->size());
+        delete it;
+    }
     return r;
 }
 
@@ -2753,9 +3947,41 @@ out:
 /// ------------------------------------------------------------------------------------------------
 
 void KvsStore::txc_aio_finish(TransContext *txc) {
+    if (--txc->io_parts > 0) {
+        return;     // the other part is still in flight
+    }
     _txc_state_proc(txc);
 }
 
+void KvsStore::_txc_log_state_latency(TransContext *txc, int idx) {
+    const utime_t now = ceph_clock_now();
+    _log_latency(idx, idx - l_kvsstore_state_prepare_lat + l_kvsstore_state_prepare_lat_hist,
+                 now - txc->last_stamp, txc->bytes);
+    txc->last_stamp = now;
+}
+
+void KvsStore::_log_device_command(int opcode, int spaceid, uint32_t bytes, const ceph::timespan &lat) {
+    const int ks = (spaceid == db.keyspace_sorted)? 0 : 1;
+    int idx;
+    switch (opcode) {
+        case nvme_cmd_kv_store:
+            idx = l_kvsstore_dev_store_sorted_lat + ks;
+            logger->inc(l_kvsstore_dev_store_sorted_bytes + ks, bytes);
+            break;
+        case nvme_cmd_kv_retrieve:
+            idx = l_kvsstore_dev_retrieve_sorted_lat + ks;
+            logger->inc(l_kvsstore_dev_retrieve_sorted_bytes + ks, bytes);
+            break;
+        case nvme_cmd_kv_delete:
+            idx = l_kvsstore_dev_delete_sorted_lat + ks;
+            break;
+        default:
+            return;
+    }
+    _log_latency(idx, idx - l_kvsstore_dev_store_sorted_lat + l_kvsstore_dev_store_sorted_lat_hist,
+                 utime_t(lat), bytes);
+}
+
 void KvsStore::_txc_state_proc(TransContext *txc) {
     FTRACE
     int r = 0;
@@ -2764,13 +3990,30 @@ void KvsStore::_txc_state_proc(TransContext *txc) {
         switch (txc->state) {
             case TransContext::STATE_PREPARE:
                 //TR << "TXC 1 " << (void*) txc << ", STATE: PREPARE";
-                r = txc->ioc->aio_submit(&db.kadi);
-                if (r == 0) {
-                    txc->state = TransContext::STATE_AIO_SUBMITTED;
+                txc->state = TransContext::STATE_AIO_SUBMITTED;
+                txc->io_parts = 1;  // dropped below once everything is submitted
+
+                if (!txc->wb_chunks.empty()) {
+                    if (cct->_conf->kvsstore_wb_max_bytes > 0) {
+                        txc->io_parts++;
+                        _osr_wb_queue(txc);
+                    } else {
+                        _txc_add_chunk_ios(txc);
+                    }
+                }
+                if (txc->ioc->has_pending_aios()) {
+                    txc->io_parts++;
+                    r = txc->ioc->aio_submit(&db.kadi);
+                    if (r != 0) {
+                        --txc->io_parts;
+                    }
+                }
+                _txc_log_state_latency(txc, l_kvsstore_state_submit_lat);   // the txc can't move on before io_parts drops
+                if (--txc->io_parts > 0) {
                     return;
                 }
 
-                // ** fall-thru if no IOs are added to this TR **
+                // ** fall-thru if the IOs are done already or no IOs are added to this TR **
 
             case TransContext::STATE_AIO_SUBMITTED:
                 //TR << "TXC 2 " << (void*) txc <<  "_txc_finish_io start";
@@ -2780,6 +4023,7 @@ void KvsStore::_txc_state_proc(TransContext *txc) {
             case TransContext::STATE_AIO_DONE:
                 //TR << "TXC 3 " << (void*) txc <<  " STATE AIO DONE start";
                 txc->state = TransContext::STATE_FINALIZE;
+                _txc_log_state_latency(txc, l_kvsstore_state_io_done_lat);
                 {
                     std::lock_guard l(kv_finalize_lock);
                     kv_finalize_queue.push_back(txc);
@@ -2806,6 +4050,25 @@ void KvsStore::_txc_state_proc(TransContext *txc) {
     }
 }
 
+/// stores the chunks of a transaction without the write-back buffer
+void KvsStore::_txc_add_chunk_ios(TransContext *txc)
+{
+    FTRACE
+    // only the last write of a chunk is stored
+    std::map<std::pair<std::string, uint16_t>, WriteBackChunk*> chunks;
+    for (WriteBackChunk &wc : txc->wb_chunks) {
+        chunks[std::make_pair(wc.key, wc.chunkid)] = &wc;
+    }
+    for (auto &p : chunks) {
+        WriteBackChunk *wc = p.second;
+        if (wc->remove) {
+            db.aio_remove_chunk(wc->key, wc->chunkid, txc->ioc);
+        } else {
+            db.aio_write_chunk(wc->key, wc->chunkid, wc->data.c_str(), wc->data.length(), txc->ioc);
+        }
+    }
+}
+
 void KvsStore::_txc_finish_io(TransContext *txc)
 {
     FTRACE
@@ -2813,6 +4076,7 @@ void KvsStore::_txc_finish_io(TransContext *txc)
     std::lock_guard l(osr->qlock);
 
     txc->state = TransContext::STATE_AIO_DONE;
+    _txc_log_state_latency(txc, l_kvsstore_state_aio_wait_lat);
 
     OpSequencer::q_list_t::iterator p = osr->q.iterator_to(*txc);
     while (p != osr->q.begin()) {
@@ -2841,6 +4105,7 @@ void KvsStore::_txc_committed_kv(TransContext *txc) {
 
     std::lock_guard l(txc->osr->qlock);
     txc->state = TransContext::STATE_FINISHING;
+    _txc_log_state_latency(txc, l_kvsstore_state_finalize_lat);
     if (txc->ch->commit_queue) {
         txc->ch->commit_queue->queue(txc->oncommits);
     } else {
@@ -2934,6 +4199,13 @@ void KvsStore::_txc_finish(TransContext *txc) {
         _queue_reap_collection(txc->removed_collections.front());
         txc->removed_collections.pop_front();
     }
+    if (!txc->blobs_dirty.empty()) {
+        _txc_release_blobs(txc);
+    }
+    if (!txc->dropped_onode_trees.empty()) {
+        std::lock_guard l(kv_lock);
+        onode_tree_drops.insert(txc->dropped_onode_trees.begin(), txc->dropped_onode_trees.end());
+    }
 
     OpSequencerRef osr = txc->osr;
     bool empty = false;
@@ -2942,6 +4214,8 @@ void KvsStore::_txc_finish(TransContext *txc) {
 
         std::lock_guard l(osr->qlock);
         txc->state = TransContext::STATE_DONE;
+        _txc_log_state_latency(txc, l_kvsstore_state_finishing_lat);
+        _log_latency(l_kvsstore_commit_lat, l_kvsstore_commit_lat_hist, txc->last_stamp - txc->start, txc->bytes);
         bool notify = false;
         while (!osr->q.empty()) {
             TransContext *txc = &osr->q.front();
@@ -2974,6 +4248,7 @@ void KvsStore::_txc_finish(TransContext *txc) {
         auto txc = &releasing_txc.front();
         txc->ioc->release_running_aios();
         releasing_txc.pop_front();
+        throttle_bytes.put(txc->bytes);
         delete txc;
     }
 
@@ -3044,31 +4319,251 @@ void KvsStore::_osr_drain_preceding(TransContext *txc)
 
 
 
+///--------------------------------------------------------
+/// Write-back Buffer
+///--------------------------------------------------------
+
+static void wb_flush_aio_callback(kv_io_context &op, void *post_data)
+{
+    FTRACE
+    kvaio_t *aio = static_cast<kvaio_t*>(post_data);
+    IoContext *ioc = aio->parent;
+
+    // removing a chunk that was never stored is fine
+    if (op.retcode != 0 && op.opcode == nvme_cmd_kv_store) {
+        ioc->set_return_value(op.retcode);
+    }
+
+    if (ioc->mark_io_complete()) {
+        KvsStore::WriteBackFlush *f = static_cast<KvsStore::WriteBackFlush*>(ioc->parent);
+        f->store->_osr_wb_finish(f);
+    }
+}
+
+/// adds the chunks of a transaction to the write-back buffer of its sequencer.
+/// The transaction completes when the flush that stores its chunks does.
+void KvsStore::_osr_wb_queue(TransContext *txc)
+{
+    FTRACE
+    OpSequencer *osr = txc->osr.get();
+    const uint64_t max_bytes = cct->_conf->kvsstore_wb_max_bytes;
+    WriteBackFlush *f = 0;
+    {
+        std::unique_lock<std::mutex> l(osr->wb_lock);
+        while (osr->wb_flushing && osr->wb_bytes >= max_bytes) {
+            osr->wb_cond.wait(l);
+        }
+
+        for (WriteBackChunk &wc : txc->wb_chunks) {
+            auto key = std::make_pair(wc.key, wc.chunkid);
+            auto it = osr->wb_dirty.find(key);
+            if (it != osr->wb_dirty.end()) {
+                // a later write of the chunk replaces the one not stored yet
+                osr->wb_bytes -= it->second.data.length();
+                it->second = std::move(wc);
+                logger->inc(l_kvsstore_wb_merged);
+            } else {
+                it = osr->wb_dirty.emplace(key, std::move(wc)).first;
+            }
+            osr->wb_bytes += it->second.data.length();
+        }
+        txc->wb_chunks.clear();
+        osr->wb_txcs.push_back(txc);
+
+        if (!osr->wb_flushing) {
+            f = _osr_wb_take(osr);
+        }
+    }
+
+    if (f) {
+        _osr_wb_submit(f);
+    }
+}
+
+/// moves the dirty chunks into a new flush; called with wb_lock held
+KvsStore::WriteBackFlush *KvsStore::_osr_wb_take(OpSequencer *osr)
+{
+    FTRACE
+    WriteBackFlush *f = new WriteBackFlush(this, osr);
+    f->ioc.qid = osr->get_sequencer_id();
+    f->ioc.batch_writes = cct->_conf->kvsstore_batch_data_ios;
+    f->ioc.aio_pool = &osr->aio_pool;
+    f->chunks.reserve(osr->wb_dirty.size());
+    for (auto &p : osr->wb_dirty) {
+        f->chunks.push_back(std::move(p.second));
+    }
+    f->txcs.swap(osr->wb_txcs);
+
+    osr->wb_dirty.clear();
+    osr->wb_bytes = 0;
+    osr->wb_flushing = true;
+    osr->wb_cond.notify_all();
+    return f;
+}
+
+void KvsStore::_osr_wb_submit(WriteBackFlush *f)
+{
+    FTRACE
+    for (WriteBackChunk &wc : f->chunks) {
+        if (wc.remove) {
+            db.aio_remove_chunk(wc.key, wc.chunkid, &f->ioc, wb_flush_aio_callback);
+        } else {
+            db.aio_write_chunk(wc.key, wc.chunkid, wc.data.c_str(), wc.data.length(), &f->ioc, wb_flush_aio_callback);
+        }
+    }
+
+    logger->inc(l_kvsstore_wb_flushes);
+    if (f->ioc.aio_submit(&db.kadi) != 0) {
+        // only when there is nothing to store: submission errors abort in _submit_aios
+        ceph_assert(f->chunks.empty());
+        _osr_wb_finish(f);
+    }
+}
+
+/// completes the transactions of a flush and starts the next one
+void KvsStore::_osr_wb_finish(WriteBackFlush *f)
+{
+    FTRACE
+    OpSequencerRef osr = f->osr;
+    std::vector<TransContext*> txcs;
+    txcs.swap(f->txcs);
+
+    // the transactions must not be acked, as with a failed txc write
+    if (f->ioc.get_return_value() != 0) {
+        derr << __func__ << " chunk store failed: ret = " << f->ioc.get_return_value() << dendl;
+        ceph_abort_msg("write-back chunk store failed");
+    }
+    delete f;
+
+    WriteBackFlush *next = 0;
+    {
+        std::lock_guard<std::mutex> l(osr->wb_lock);
+        osr->wb_flushing = false;
+        if (!osr->wb_dirty.empty()) {
+            next = _osr_wb_take(osr.get());
+        }
+        osr->wb_cond.notify_all();
+    }
+
+    for (TransContext *txc : txcs) {
+        txc_aio_finish(txc);
+    }
+
+    if (next) {
+        _osr_wb_submit(next);
+    }
+}
+
+
 ///--------------------------------------------------------
 /// Index Threads
 ///--------------------------------------------------------
 
 void KvsStore::_kv_index_thread() {
     FTRACE
-    // load pages from the AOL
-    static double index_interval_us = 1000000.0; // 1 second
-    while(true) {
-        //db.compact();
-
+    // apply the oplog pages to the onode and collection trees in batches of
+    // kvsstore_index_max_pages, so that inline compactions have little to do
+    const uint32_t max_pages = cct->_conf->kvsstore_index_max_pages;
+    const auto interval = std::chrono::milliseconds(cct->_conf->kvsstore_index_interval_ms);
+
+    bool warmed_up = false;
+
+    std::unique_lock l (kv_lock);
+    while (!kv_index_stop) {
+        // committed before the oplog pages are listed below
+        std::set<uint32_t> drops;
+        drops.swap(onode_tree_drops);
+        l.unlock();
+
+        const uint64_t applied = db.index_pages_applied;
+        const utime_t start = ceph_clock_now();
+        db.compact(max_pages);
+        const utime_t lat = ceph_clock_now() - start;
+        const uint64_t pages = db.index_pages_applied - applied;
+
+        // drop the onode indexes of the removed pool shards once their oplog is indexed,
+        // unless a collection of the shard was created since
+        if (!drops.empty() && db.index_pages_pending == 0) {
+            for (uint32_t tree : drops) {
+                bool in_use;
+                {
+                    std::shared_lock cl(coll_lock);
+                    in_use = _has_onode_tree(tree);
+                }
+                if (!in_use) {
+                    db.drop_onode_partition(tree);
+                }
+            }
+            drops.clear();
+        }
+        db.drop_partition_pages(KVS_INDEX_DROP_PAGES);
+
+        logger->set(l_kvsstore_index_lag, db.index_pages_pending);
+        logger->set(l_kvsstore_index_cache_bytes, db.index_cache.get_bytes());
+        logger->set(l_kvsstore_index_cache_hit, db.index_cache.hits);
+        logger->set(l_kvsstore_index_cache_miss, db.index_cache.misses);
+        logger->set(l_kvsstore_read_retries, db.read_retries);
+        logger->set(l_kvsstore_read_size_sorted, db.read_hints[0].get());
+        logger->set(l_kvsstore_read_size_notsorted, db.read_hints[1].get());
         {
-            std::unique_lock l (kv_lock );
-            if (kv_index_stop) break;
+            uint64_t ops, bytes, waiting, parked;
+            db.submit_queues.get_stats(&ops, &bytes, &waiting, &parked);
+            logger->set(l_kvsstore_queue_ops, ops);
+            logger->set(l_kvsstore_queue_bytes, bytes);
+            logger->set(l_kvsstore_queue_waiting, waiting);
+            logger->set(l_kvsstore_queue_parked, parked);
+        }
+        if (pages > 0) {
+            logger->inc(l_kvsstore_index_pages, pages);
+            logger->set(l_kvsstore_index_pages_per_sec, (uint64_t)(pages / std::max((double)lat, 1e-6)));
+            logger->tinc(l_kvsstore_index_lat, lat);
+        }
+
+        // once the oplog tail left by the last run is indexed
+        if (!warmed_up && db.index_pages_pending == 0) {
+            warmed_up = _warmup_index();
+        }
+
+        l.lock();
+        onode_tree_drops.insert(drops.begin(), drops.end());
+        // keep draining while behind, otherwise wait for the next interval
+        if (!kv_index_stop && db.index_pages_pending == 0 && db.partition_drops.empty()) {
+            kv_cond.wait_for(l, interval);
         }
+    }
+}
+
+// true if a collection, or a collection being created, uses the onode index. coll_lock must be held
+bool KvsStore::_has_onode_tree(uint32_t tree) {
+    auto uses = [&](const auto &p) { return db.get_onode_tree(p.first) == tree; };
+    return std::any_of(coll_map.begin(), coll_map.end(), uses) ||
+           std::any_of(new_coll_map.begin(), new_coll_map.end(), uses);
+}
 
-        usleep(index_interval_us);
+// reads the top of the collection tree and of the onode index of each collection into the
+// index cache, so that the first listings after mount do not start cold.
+// false if the collections are not open yet
+bool KvsStore::_warmup_index() {
+    FTRACE
+    std::set<uint32_t> trees;
+    {
+        std::shared_lock l(coll_lock);
+        if (coll_map.empty()) return false;
+        for (const auto &p : coll_map) {
+            trees.insert(db.get_onode_tree(p.first));
+        }
     }
+    trees.insert(GROUP_PREFIX_COLL);
+    db.warmup_index(trees);
+    dout(10) << __func__ << " " << trees.size() << " trees" << dendl;
+    return true;
 }
 
 ///--------------------------------------------------------------
 /// Callback Thread
 ///--------------------------------------------------------------
 
-void KvsStore::_kv_callback_thread() {
+void KvsStore::_kv_callback_thread(int qid) {
     FTRACE
     uint32_t toread = 10240;
     while (!kv_stop) {
@@ -3078,7 +4573,7 @@ void KvsStore::_kv_callback_thread() {
         }
 
         if (this->db.is_opened()) {
-            this->db.poll_completion(toread, 1000);
+            this->db.poll_completion(toread, 1000, qid);
         }
     }
 
@@ -5,6 +5,85 @@
 
 enum {
     l_kvsstore_first = 932430,
+    l_kvsstore_index_lag,
+    l_kvsstore_index_pages,
+    l_kvsstore_index_pages_per_sec,
+    l_kvsstore_index_lat,
+    l_kvsstore_index_cache_bytes,
+    l_kvsstore_index_cache_hit,
+    l_kvsstore_index_cache_miss,
+    l_kvsstore_prefetch_issued,
+    l_kvsstore_prefetch_hit,
+    l_kvsstore_prefetch_miss,
+    l_kvsstore_prefetch_waste,
+    l_kvsstore_wb_flushes,
+    l_kvsstore_wb_merged,
+    l_kvsstore_rmw_cached,
+    l_kvsstore_clone_shared,
+    l_kvsstore_clone_unshared,
+    l_kvsstore_inline_read,
+    l_kvsstore_inline_promoted,
+    l_kvsstore_read_retries,
+    l_kvsstore_read_size_sorted,
+    l_kvsstore_read_size_notsorted,
+    l_kvsstore_compress_success,
+    l_kvsstore_compress_rejected,
+    l_kvsstore_compressed_original,
+    l_kvsstore_compressed,
+    l_kvsstore_onode_prefetch_issued,
+    l_kvsstore_onode_prefetch_waste,
+    l_kvsstore_queue_ops,
+    l_kvsstore_queue_bytes,
+    l_kvsstore_queue_waiting,
+    l_kvsstore_queue_parked,
+
+    // transaction pipeline: time spent in each stage
+    l_kvsstore_throttle_lat,
+    l_kvsstore_state_prepare_lat,
+    l_kvsstore_state_write_nodes_lat,
+    l_kvsstore_state_submit_lat,
+    l_kvsstore_state_aio_wait_lat,
+    l_kvsstore_state_io_done_lat,
+    l_kvsstore_state_finalize_lat,
+    l_kvsstore_state_finishing_lat,
+    l_kvsstore_commit_lat,
+    // latency x transaction size histograms of the above, in the same order
+    l_kvsstore_throttle_lat_hist,
+    l_kvsstore_state_prepare_lat_hist,
+    l_kvsstore_state_write_nodes_lat_hist,
+    l_kvsstore_state_submit_lat_hist,
+    l_kvsstore_state_aio_wait_lat_hist,
+    l_kvsstore_state_io_done_lat_hist,
+    l_kvsstore_state_finalize_lat_hist,
+    l_kvsstore_state_finishing_lat_hist,
+    l_kvsstore_commit_lat_hist,
+
+    // device commands by operation and key space
+    l_kvsstore_dev_store_sorted_lat,
+    l_kvsstore_dev_store_notsorted_lat,
+    l_kvsstore_dev_retrieve_sorted_lat,
+    l_kvsstore_dev_retrieve_notsorted_lat,
+    l_kvsstore_dev_delete_sorted_lat,
+    l_kvsstore_dev_delete_notsorted_lat,
+    l_kvsstore_dev_iterate_lat,
+    // latency x value size (keys for iterate) histograms of the above, in the same order
+    l_kvsstore_dev_store_sorted_lat_hist,
+    l_kvsstore_dev_store_notsorted_lat_hist,
+    l_kvsstore_dev_retrieve_sorted_lat_hist,
+    l_kvsstore_dev_retrieve_notsorted_lat_hist,
+    l_kvsstore_dev_delete_sorted_lat_hist,
+    l_kvsstore_dev_delete_notsorted_lat_hist,
+    l_kvsstore_dev_iterate_lat_hist,
+    l_kvsstore_dev_store_sorted_bytes,
+    l_kvsstore_dev_store_notsorted_bytes,
+    l_kvsstore_dev_retrieve_sorted_bytes,
+    l_kvsstore_dev_retrieve_notsorted_bytes,
+
+    // read path caches
+    l_kvsstore_onode_hits,
+    l_kvsstore_onode_misses,
+    l_kvsstore_buffer_hit_bytes,
+    l_kvsstore_buffer_miss_bytes,
     l_kvsstore_last
 };
 
@@ -20,6 +99,18 @@ public:
 
     void _init_perf_logger(CephContext *cct);
 
+    bool perf_detail = false;   ///< kvsstore_perf_detail: histograms and device command counters
+
+    // adds a latency and, in detail, its histogram sample
+    void _log_latency(int idx, int hist_idx, const utime_t &lat, uint64_t size) {
+        logger->tinc(idx, lat);
+        if (perf_detail) {
+            logger->hinc(hist_idx, lat.to_nsec(), size);
+        }
+    }
+    void _txc_log_state_latency(TransContext *txc, int idx);
+    void _log_device_command(int opcode, int spaceid, uint32_t bytes, const ceph::timespan &lat);
+
 public: // inherited interfaces
 
     /// =========================================================
@@ -67,6 +158,7 @@ public: // inherited interfaces
 
     // read & write
     bool exists(CollectionHandle &c_, const ghobject_t& oid) override;
+    void prefetch_onode(CollectionHandle &c_, const ghobject_t& oid) override;
     int read(CollectionHandle &c,const ghobject_t& oid, uint64_t offset,size_t len,bufferlist& bl,uint32_t op_flags = 0) override;
     int queue_transactions(CollectionHandle& ch, vector<Transaction>& tls, TrackedOpRef op = TrackedOpRef(), ThreadPool::TPHandle *handle = NULL) override;
 
@@ -90,9 +182,45 @@ public:
 
     int _do_read(Collection *c,OnodeRef o,uint64_t offset,size_t length,bufferlist& bl,uint32_t op_flags = 0, uint64_t retry_count = 0);
     int _do_read_chunks_async(OnodeRef &o, ready_regions_t &ready_regions, chunk2read_t &chunk2read, BufferCacheShard *cache);
-    int _prepare_read_chunk_ioc(const ghobject_t &oid, ready_regions_t& ready_regions,chunk2read_t& chunk2read, IoContext *ioc);
+    int _prepare_read_chunk_ioc(OnodeRef &o, ready_regions_t& ready_regions,chunk2read_t& chunk2read, IoContext *ioc);
     int _generate_read_result_bl(OnodeRef o,uint64_t offset,size_t length, ready_regions_t& ready_regions, bufferlist& bl);
     void _read_cache(BufferCacheShard *cache, OnodeRef o, uint64_t offset , size_t length, int read_cache_policy,ready_regions_t& ready_regions,chunk2read_t& blobs2read);
+    void _merge_read_chunks(uint64_t offset, size_t length, ready_regions_t &chunks, ready_regions_t &ready_regions);
+
+    /// Read-ahead
+
+    struct PrefetchContext {
+        IoContext ioc;
+        KvsStore *store;
+        CollectionRef c;
+        OnodeRef o;
+        uint64_t gen;               ///< BufferSpace::gen when the prefetch was issued
+        ready_regions_t chunks;     ///< chunk offset -> data
+        std::set<uint64_t> compressed;  ///< offsets of the chunks stored compressed
+        CompressorRef compressor;
+
+        PrefetchContext(KvsStore *s, Collection *c_, OnodeRef &o_, uint64_t g):
+            ioc(this, "prefetch"), store(s), c(c_), o(o_), gen(g) {}
+    };
+
+    void _readahead(Collection *c, OnodeRef &o, uint64_t offset, size_t length, uint32_t op_flags, size_t chunks_missed);
+    void _prefetch_chunks(Collection *c, OnodeRef &o, uint64_t offset, uint64_t length);
+    void _prefetch_finish(PrefetchContext *ctx);
+
+    /// Onode prefetch
+
+    struct OnodePrefetchContext {
+        IoContext ioc;
+        KvsStore *store;
+        CollectionRef c;
+        ghobject_t oid;
+        bufferlist bl;
+
+        OnodePrefetchContext(KvsStore *s, Collection *c_, const ghobject_t &o):
+            ioc(this, "onode_prefetch"), store(s), c(c_), oid(o) {}
+    };
+
+    void _prefetch_onode_finish(OnodePrefetchContext *ctx);
 
 public:
 
@@ -122,6 +250,19 @@ public:
     void _do_write_pad_zeros(ready_regions_t &readyregions, zero_regions_t &zeroregions, const uint64_t chunksize);
 
     int _zero(TransContext *txc,  CollectionRef& c, OnodeRef& o, uint64_t offset, size_t length);
+    int _do_extend(TransContext *txc, CollectionRef& c, OnodeRef& o, uint64_t new_size);
+    bool _can_inline(OnodeRef& o, uint64_t end);
+    void _do_write_inline(OnodeRef& o, uint64_t offset, uint64_t length, bufferlist::iterator* blp);
+    void _do_promote_inline(TransContext *txc, CollectionRef& c, OnodeRef& o);
+    void _do_punch(TransContext *txc, CollectionRef& c, OnodeRef& o, uint32_t chunkid, uint32_t n);
+    void _do_write_chunk(TransContext *txc, CollectionRef& c, OnodeRef& o, const std::string &key, uint16_t chunkid, bufferlist &data);
+    int _set_alloc_hint(TransContext *txc, CollectionRef& c, OnodeRef& o, uint64_t expected_object_size, uint64_t expected_write_size, uint32_t flags);
+
+    /// Compression
+
+    void _set_compression(Collection *c, const pool_opts_t &opts);
+    bool _compress_chunk(Collection *c, OnodeRef& o, const bufferlist &data, bufferlist &out);
+    int _decompress_chunk(const CompressorRef &compressor, bufferlist &bl);
 
     /// Truncate Functions
 
@@ -136,6 +277,14 @@ public:
     /// Clone I/O Functions
 
     int _clone(TransContext *txc,CollectionRef& c, OnodeRef& oldo,OnodeRef& newo);
+    std::string _get_chunk_key(OnodeRef &o);
+    kvsstore_blob_t &_blob_get(TransContext *txc, uint64_t sid);
+    void _blob_pin(TransContext *txc, uint64_t sid);
+    void _blob_ref(TransContext *txc, uint64_t sid);
+    void _blob_put(TransContext *txc, uint64_t sid);
+    void _unshare_chunk(TransContext *txc, OnodeRef &o, uint16_t chunkid);
+    void _txc_write_blobs(TransContext *txc, IoContext *ioc, std::vector<bufferlist*> &bls);
+    void _txc_release_blobs(TransContext *txc);
     int _clone_range(TransContext *txc,CollectionRef& c,OnodeRef& oldo,OnodeRef& newo, uint64_t srcoff, uint64_t length, uint64_t dstoff);
     int _rename(TransContext *txc, CollectionRef& c, OnodeRef& oldo, OnodeRef& newo, const ghobject_t& new_oid);
 
@@ -173,6 +322,8 @@ public:
     void _txc_finish_writes(TransContext *txc);
     void _txc_finish(TransContext *txc);
     int _txc_write_nodes(TransContext *txc);
+    int _txc_group_commit(IoContext &ioc);
+    void _txc_add_chunk_ios(TransContext *txc);
 
 public:
     /// =========================================================
@@ -184,6 +335,26 @@ public:
     void _osr_drain(OpSequencer *osr);
     void _osr_drain_preceding(TransContext *txc);
 
+    /// Write-back of data chunks
+
+    struct WriteBackFlush {
+        IoContext ioc;
+        KvsStore *store;
+        OpSequencerRef osr;
+        std::vector<WriteBackChunk> chunks;
+        std::vector<TransContext*> txcs;    ///< completed by this flush
+
+        WriteBackFlush(KvsStore *s, OpSequencer *o): ioc(this, "wb_flush"), store(s), osr(o) {}
+        ~WriteBackFlush() {
+            ioc.release_running_aios();     // before osr, which owns the pool, is released
+        }
+    };
+
+    void _osr_wb_queue(TransContext *txc);
+    WriteBackFlush *_osr_wb_take(OpSequencer *osr);
+    void _osr_wb_submit(WriteBackFlush *f);
+    void _osr_wb_finish(WriteBackFlush *f);
+
 
 
 public:
@@ -194,14 +365,17 @@ public:
 
     //bool _check_db();
     bool _check_onode_validity(kvsstore_onode_t &ori_onode, bufferlist&bl);
-    void _kv_callback_thread();
+    void _kv_callback_thread(int qid);
     void _kv_finalize_thread();
     void _kv_index_thread();
+    bool _warmup_index();
+    bool _has_onode_tree(uint32_t tree);
 
     struct KVCallbackThread : public Thread {
         KvsStore *store;
-        explicit KVCallbackThread(KvsStore *s) : store(s) {}
-        void *entry() override { store->_kv_callback_thread(); return NULL; }
+        int qid;
+        explicit KVCallbackThread(KvsStore *s, int q = 0) : store(s), qid(q) {}
+        void *entry() override { store->_kv_callback_thread(qid); return NULL; }
     };
 
     struct KVFinalizeThread : public Thread {
@@ -224,6 +398,19 @@ public:
 	/// =========================================================
 
     std::atomic<uint64_t> nid_last  = {0};			//# Onode ID
+    std::atomic<uint32_t> onode_prefetches = {0};   ///< onode prefetches in flight
+    std::atomic<uint32_t> chunk_prefetches = {0};   ///< chunk read-aheads in flight
+
+    //# Shared blobs of cloned objects ----------------------------
+
+    struct SharedBlob {
+        kvsstore_blob_t blob;
+        uint32_t pins = 0;                  ///< unfinished transactions that changed the blob
+        std::list<uint64_t>::iterator lru;  ///< position in blob_lru, or its end while pinned
+    };
+    std::mutex blob_lock;   ///< protects blob_map and blob_lru
+    std::unordered_map<uint64_t, SharedBlob> blob_map;
+    std::list<uint64_t> blob_lru;   ///< unpinned blobs, most recently released first
 
     //# Collections -----------------------
 
@@ -247,8 +434,11 @@ public:
 
     Finisher finisher;
 
+    Throttle throttle_bytes;            ///< queue_transactions to txc finish
+
     std::mutex kv_lock;
-    std::condition_variable kv_cond;
+    std::condition_variable kv_cond;    ///< wakes up the index thread
+    std::set<uint32_t> onode_tree_drops;    ///< onode indexes of removed pool shards, dropped by the index thread (kv_lock)
 
     std::mutex kv_finalize_lock;
     std::condition_variable kv_finalize_cond;
@@ -260,12 +450,30 @@ public:
     bool kv_finalize_started = false;
     bool kv_finalize_stop = false;
 
-    KVCallbackThread kv_callback_thread;
+    std::vector<std::unique_ptr<KVCallbackThread>> kv_callback_threads;  ///< one per device queue pair
     KVFinalizeThread kv_finalize_thread;
     KVIndexThread    kv_index_thread;
 
     deque<TransContext*> kv_finalize_queue;   ///< pending finalization
 
+    //# Group commit of metadata writes ----------------------------
+
+    struct MetaCommitGroup {
+        IoContext ioc;
+        std::unordered_map<std::string, kvaio_t*> writes;  ///< the latest write to each key
+        unsigned num_txcs = 0;
+        bool done = false;
+        int r = 0;
+
+        MetaCommitGroup(): ioc(0, "MetaCommitGroup") { ioc.batch_writes = true; }
+        void join(IoContext &src);
+    };
+
+    std::mutex commit_lock;
+    std::condition_variable commit_cond;
+    std::shared_ptr<MetaCommitGroup> commit_open_group;  ///< gathers writes while another group is written
+    bool commit_inflight = false;
+
     kvsstore_sb_t kvsb;
     CompressorRef cp;
 };
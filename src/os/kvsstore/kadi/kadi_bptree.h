@@ -46,7 +46,8 @@ public:
     virtual void dump() {
         //TR << "bpmeta" ;
     }
-	const static int META_SIZE = 16;
+	const static int META_SIZE = 24;
+	const static int META_SIZE_V1 = 16;	// trees without key hints
     bool isnew;
 
     bptree_meta(const bp_addr_t &addr): kv_indexnode(addr), isnew(false) {
@@ -57,10 +58,11 @@ public:
     char *get_raw_buffer() { return buffer; }
 
 
-    void init(int treeid)
+    void init(uint32_t treeid)
 	{
         set_root_addr( create_metanode_addr(treeid) );
-        set_next_pgid(2);
+        set_next_pgid(bptree_first_pgid(treeid));
+        set_format(1);
         isnew = true;
         //TR << "  new meta: root addr = " << desc(get_root_addr())  ;
         //TR << "  new meta: last pgid = " << get_last_pgid() ;
@@ -82,6 +84,17 @@ public:
 		return values[1];
 	}
 
+	/// 0: tree nodes hold key addresses only, 1: with key hints
+	inline uint64_t get_format() {
+		uint64_t* values = (uint64_t*)buffer;
+		return values[2];
+	}
+
+	inline void set_format(uint64_t format) {
+		uint64_t* values = (uint64_t*)buffer;
+		values[2] = format;
+	}
+
 	inline void set_root_addr(bp_addr_t addr) {
 		bp_addr_t* values = (bp_addr_t*)buffer;
 		values[1] = addr;
@@ -199,9 +212,10 @@ public:
 class bptree_node: public kv_indexnode {
 	int max_order;
 	int max_entries;
+	int hint_size;
 public:
-	bptree_node(const bp_addr_t &addr, char *buffer, uint16_t buffer_size, bool isnew, bool leaf, int max_order_, int max_entries_):
-		kv_indexnode(addr, buffer, buffer_size), max_order(max_order_), max_entries(max_entries_) {
+	bptree_node(const bp_addr_t &addr, char *buffer, uint16_t buffer_size, bool isnew, bool leaf, int max_order_, int max_entries_, int hint_size_ = 0):
+		kv_indexnode(addr, buffer, buffer_size), max_order(max_order_), max_entries(max_entries_), hint_size(hint_size_) {
 
 		if (isnew) {
 			header()->type = (leaf)? BPLUS_TREE_LEAF:BPLUS_TREE_NON_LEAF;
@@ -227,6 +241,13 @@ public:
 	//inline char* data() { return node_buffer + (max_entries * sizeof(bp_addr_t)); }
 	inline bp_addr_t* sub()  { return (bp_addr_t*)(offset_ptr() + ((max_order -1) * sizeof(bp_addr_t))); }
 
+	/// first bytes of the i-th key, zero padded, after the key addresses (and the sub-nodes)
+	inline bool has_hints() { return hint_size > 0; }
+	inline char* hint(int i) {
+		const int base = (is_leaf())? max_entries : (2 * max_order - 1);
+		return offset_ptr() + base * sizeof(bp_addr_t) + i * hint_size;
+	}
+
 	void dump() {
         /*TR << "NODE ADDR = " << addr ;
         auto keys = key();
@@ -247,13 +268,14 @@ public:
 	int level;
     bool dirty;
 
-	bptree(KADI *adi, int ksid_skp, uint32_t prefix, int block_size = 28*1024):
-		param(block_size), pool(adi, ksid_skp, prefix, &param), level(0), dirty(false)
+	bptree(KADI *adi, int ksid_skp, uint32_t prefix, bptree_node_cache *cache = 0, bool snapshot = false, int block_size = 28*1024):
+		param(block_size), pool(adi, ksid_skp, prefix, &param, cache, snapshot), level(0), dirty(false)
 	{
 	    FTRACE
 
 		// create or fetch root node
 		meta = pool.get_meta();
+		param.set_hints(meta->get_format() >= 1);
 		if (meta->isnew) {
 			root = 0;
 		}
@@ -326,7 +348,7 @@ public:
 		}
 
 		root = pool.create_tree_node(true);
-		root->key()[0] = insert_key_to_datanode(userkey, keylength);
+		set_key(root, 0, insert_key_to_datanode(userkey, keylength));
 		root->set_children(1);
 		set_dirty(root);
 		this->level = 1;
@@ -339,6 +361,20 @@ public:
 	    pool.remove_all();
 	}
 
+	/// removes the meta of the tree, which is empty afterwards; returns the end of the
+	/// page ids the tree had allocated. the pages are removed with drop_pages()
+	uint64_t drop_meta() {
+		root = 0;
+		level = 0;
+		dirty = false;
+		return pool.drop_meta();
+	}
+
+	/// removes the pages [from, to) of a tree whose meta was dropped
+	void drop_pages(uint64_t from, uint64_t to) {
+		pool.drop_pages(from, to);
+	}
+
 	int remove(char *userkey, int keylength)
 	{
 		if (root == 0) return -1;
@@ -369,6 +405,44 @@ public:
         pool.flush((root == NULL)? invalid_key_addr:root->addr);
 	}
 private:
+	///
+	/// KEY SLOTS
+	///
+	/// Tree nodes of a tree with key hints keep the first bytes of each key next
+	/// to its address, so that most comparisons do not need the data node.
+	///
+
+	inline void make_hint(char *hint, const char *key, int length) {
+		const int n = std::min(length, param.hint_size);
+		memcpy(hint, key, n);
+		memset(hint + n, 0, param.hint_size - n);
+	}
+
+	// the key was just inserted or replicated, so its data node is in the pool
+	inline void set_key(bptree_node *node, int i, const bp_addr_t &key) {
+		node->key()[i] = key;
+		if (node->has_hints()) {
+			char *k = 0;
+			int length = 0;
+			pool.fetch_key(key, &k, length);
+			make_hint(node->hint(i), k, (k)? length : 0);
+		}
+	}
+
+	inline void copy_key(bptree_node *dst, int di, bptree_node *src, int si) {
+		dst->key()[di] = src->key()[si];
+		if (dst->has_hints()) {
+			memcpy(dst->hint(di), src->hint(si), param.hint_size);
+		}
+	}
+
+	inline void move_keys(bptree_node *dst, int di, bptree_node *src, int si, int n) {
+		memmove(&dst->key()[di], &src->key()[si], n * sizeof(bp_addr_t));
+		if (dst->has_hints()) {
+			memmove(dst->hint(di), src->hint(si), n * param.hint_size);
+		}
+	}
+
 	///
 	/// B+ TREE ALGORITHM - INSERT
 	///
@@ -468,7 +542,7 @@ private:
 			/* new parent */
 
 			bptree_node *parent = pool.create_tree_node(false);
-			parent->key()[0] = key;
+			set_key(parent, 0, key);
 			parent->sub()[0] = l_ch->header()->self;
 			parent->sub()[1] = r_ch->header()->self;
 			parent->set_children (2);
@@ -509,11 +583,11 @@ private:
 
 	        /* sum = left->children = pivot + (split - pivot - 1) + 1 */
 	        /* replicate from key[0] to key[insert] in original node */
-	        memmove(&left->key()[0], &node->key()[0], pivot * sizeof(bp_addr_t));
+	        move_keys(left, 0, node, 0, pivot);
 	        memmove(&left->sub()[0], &node->sub()[0], pivot * sizeof(bp_addr_t));
 
 	        /* replicate from key[insert] to key[split - 1] in original node */
-	        memmove(&left->key()[pivot + 1], &node->key()[pivot], (split - pivot - 1) * sizeof(bp_addr_t));
+	        move_keys(left, pivot + 1, node, pivot, split - pivot - 1);
 	        memmove(&left->sub()[pivot + 1], &node->sub()[pivot], (split - pivot - 1) * sizeof(bp_addr_t));
 
 	        /* flush sub-nodes of the new splitted left node */
@@ -524,7 +598,7 @@ private:
 	        }
 
 	        /* insert new key and sub-nodes and locate the split key */
-	        left->key()[pivot] = key;
+	        set_key(left, pivot, key);
 	        if (pivot == split - 1) {
 	                /* left child in split left node and right child in original right one */
 	                sub_node_update(left, pivot, l_ch);
@@ -540,7 +614,7 @@ private:
 
 	        /* sum = node->children = 1 + (node->get_children() - 1) */
 	        /* right node left shift from key[split - 1] to key[children - 2] */
-	        memmove(&node->key()[0], &node->key()[split - 1], (node->get_children() - 1) * sizeof(bp_addr_t));
+	        move_keys(node, 0, node, split - 1, node->get_children() - 1);
 	        memmove(&node->sub()[1], &node->sub()[split], (node->get_children()- 1) * sizeof(bp_addr_t));
 
 	        return split_key;
@@ -567,13 +641,13 @@ private:
 	        right->set_children(param.max_order - split + 1);
 
 	        /* insert new key and sub-nodes */
-	        right->key()[0] = key;
+	        set_key(right, 0, key);
 	        sub_node_update(right, pivot, l_ch);
 	        sub_node_update(right, pivot + 1, r_ch);
 
 	        /* sum = right->children = 2 + (right->get_children() - 2) */
 	        /* replicate from key[split] to key[param.max_order - 2] */
-	        memmove(&right->key()[pivot + 1], &node->key()[split], (right->get_children() - 2) * sizeof(bp_addr_t));
+	        move_keys(right, pivot + 1, node, split, right->get_children() - 2);
 	        memmove(&right->sub()[pivot + 2], &node->sub()[split + 1], (right->get_children() - 2) * sizeof(bp_addr_t));
 
 	        /* flush sub-nodes of the new splitted right node */
@@ -606,16 +680,16 @@ private:
 
 	        /* sum = right->children = pivot + 2 + (param.max_order - insert - 1) */
 	        /* replicate from key[split + 1] to key[insert] */
-	        memmove(&right->key()[0], &node->key()[split + 1], pivot * sizeof(bp_addr_t));
+	        move_keys(right, 0, node, split + 1, pivot);
 	        memmove(&right->sub()[0], &node->sub()[split + 1], pivot * sizeof(bp_addr_t));
 
 	        /* insert new key and sub-node */
-	        right->key()[pivot] = key;
+	        set_key(right, pivot, key);
 	        sub_node_update(right, pivot, l_ch);
 	        sub_node_update(right, pivot + 1, r_ch);
 
 	        /* replicate from key[insert] to key[order - 1] */
-	        memmove(&right->key()[pivot + 1], &node->key()[insert], (param.max_order - insert - 1) * sizeof(bp_addr_t));
+	        move_keys(right, pivot + 1, node, insert, param.max_order - insert - 1);
 	        memmove(&right->sub()[pivot + 2], &node->sub()[insert + 1], (param.max_order - insert - 1) * sizeof(bp_addr_t));
 
 	        /* flush sub-nodes of the new splitted right node */
@@ -632,10 +706,10 @@ private:
 	                        	   bptree_node *l_ch, bptree_node *r_ch,
 	                        	   bp_addr_t key, int insert)
 	{
-	        memmove(&node->key()[insert + 1], &node->key()[insert], (node->get_children() - 1 - insert) * sizeof(bp_addr_t));
+	        move_keys(node, insert + 1, node, insert, node->get_children() - 1 - insert);
 	        memmove(&node->sub()[insert + 2], &node->sub()[insert + 1], (node->get_children() - 1 - insert) * sizeof(bp_addr_t));
 	        /* insert new key and sub-nodes */
-	        node->key()[insert] = key;
+	        set_key(node, insert, key);
 	        sub_node_update(node, insert, l_ch);
 	        sub_node_update(node, insert + 1, r_ch);
 	        node->inc_children(1);
@@ -695,19 +769,19 @@ private:
 
 	        /* sum = left->children = pivot + 1 + (split - pivot - 1) */
 	        /* replicate from key[0] to key[insert] */
-	        memmove(&left->key()[0], &leaf->key()[0], pivot * sizeof(bp_addr_t));
+	        move_keys(left, 0, leaf, 0, pivot);
 	        //memmove(&data(left)[0], &data(leaf)[0], pivot * sizeof(long));
 
 	        /* insert new key and data */
-	        left->key()[pivot] = key;
+	        set_key(left, pivot, key);
 	        //data(left)[pivot] = data;
 
 	        /* replicate from key[insert] to key[split - 1] */
-	        memmove(&left->key()[pivot + 1], &leaf->key()[pivot], (split - pivot - 1) * sizeof(bp_addr_t));
+	        move_keys(left, pivot + 1, leaf, pivot, split - pivot - 1);
 	        //memmove(&data(left)[pivot + 1], &data(leaf)[pivot], (split - pivot - 1) * sizeof(long));
 
 	        /* original leaf left shift */
-	        memmove(&leaf->key()[0], &leaf->key()[split - 1], leaf->get_children() * sizeof(bp_addr_t));
+	        move_keys(leaf, 0, leaf, split - 1, leaf->get_children());
 	        //memmove(&data(leaf)[0], &data(leaf)[split - 1], leaf->get_children() * sizeof(long));
 
 	        return leaf->key()[0];
@@ -734,15 +808,15 @@ private:
 
 	        /* sum = right->children = pivot + 1 + (param.max_entries - pivot - split) */
 	        /* replicate from key[split] to key[children - 1] in original leaf */
-	        memmove(&right->key()[0], &leaf->key()[split], pivot * sizeof(bp_addr_t));
+	        move_keys(right, 0, leaf, split, pivot);
 	        //memmove(&data(right)[0], &data(leaf)[split], pivot * sizeof(long));
 
 	        /* insert new key and data */
-	        right->key()[pivot] = key;
+	        set_key(right, pivot, key);
 	        //data(right)[pivot] = data;
 
 	        /* replicate from key[insert] to key[children - 1] in original leaf */
-	        memmove(&right->key()[pivot + 1], &leaf->key()[insert], (param.max_entries - insert) * sizeof(bp_addr_t));
+	        move_keys(right, pivot + 1, leaf, insert, param.max_entries - insert);
 	        //memmove(&data(right)[pivot + 1], &data(leaf)[insert], (param.max_entries - insert) * sizeof(long));
 
 	        //std::cout << "right's first key = " << right->key()[0] << ", right addr = " << right->addr <<std::endl;
@@ -753,9 +827,9 @@ private:
 	void leaf_simple_insert(bptree_node *leaf,
 	                	       bp_addr_t key, int insert)
 	{
-	        memmove(&leaf->key()[insert + 1], &leaf->key()[insert], (leaf->get_children() - insert) * sizeof(bp_addr_t));
+	        move_keys(leaf, insert + 1, leaf, insert, leaf->get_children() - insert);
 	        //memmove(&data(leaf)[insert + 1], &data(leaf)[insert], (leaf->get_children() - insert) * sizeof(long));
-	        leaf->key()[insert] = key;
+	        set_key(leaf, insert, key);
 	        //data(leaf)[insert] = data;
 	        leaf->inc_children(1);
 	}
@@ -801,12 +875,12 @@ private:
 	                        	     int parent_key_index, int remove)
 	{
 	        /* node's elements right shift */
-	        memmove(&node->key()[1], &node->key()[0], remove * sizeof(bp_addr_t));
+	        move_keys(node, 1, node, 0, remove);
 	        memmove(&node->sub()[1], &node->sub()[0], (remove + 1) * sizeof(off_t));
 
 	        /* parent key right rotation */
-	        node->key()[0] = parent->key()[parent_key_index];
-	        parent->key()[parent_key_index] = left->key()[left->get_children() - 2];
+	        copy_key(node, 0, parent, parent_key_index);
+	        copy_key(parent, parent_key_index, left, left->get_children() - 2);
 
 	        /* borrow the last sub-node from left sibling */
 	        node->sub()[0] = left->sub()[left->get_children() - 1];
@@ -820,15 +894,15 @@ private:
 	                        	     int parent_key_index, int remove)
 	{
 	        /* move parent key down */
-	        left->key()[left->get_children() - 1] = parent->key()[parent_key_index];
+	        copy_key(left, left->get_children() - 1, parent, parent_key_index);
 
 	        /* merge into left sibling */
 	        /* key sum = node->get_children() - 2 */
-	        memmove(&left->key()[left->get_children()], &node->key()[0], remove * sizeof(bp_addr_t));
+	        move_keys(left, left->get_children(), node, 0, remove);
 	        memmove(&left->sub()[left->get_children()], &node->sub()[0], (remove + 1) * sizeof(off_t));
 
 	        /* sub-node sum = node->get_children() - 1 */
-	        memmove(&left->key()[left->get_children() + remove], &node->key()[remove + 1], (node->get_children() - remove - 2) * sizeof(bp_addr_t));
+	        move_keys(left, left->get_children() + remove, node, remove + 1, node->get_children() - remove - 2);
 	        memmove(&left->sub()[left->get_children() + remove + 1], &node->sub()[remove + 2], (node->get_children() - remove - 2) * sizeof(off_t));
 
 	        /* flush sub-nodes of the new merged left node */
@@ -845,8 +919,8 @@ private:
 	                        	      int parent_key_index)
 	{
 	        /* parent key left rotation */
-	        node->key()[node->get_children() - 1] = parent->key()[parent_key_index];
-	        parent->key()[parent_key_index] = right->key()[0];
+	        copy_key(node, node->get_children() - 1, parent, parent_key_index);
+	        copy_key(parent, parent_key_index, right, 0);
 
 	        /* borrow the frist sub-node from right sibling */
 	        node->sub()[node->get_children()] = right->sub()[0];
@@ -854,7 +928,7 @@ private:
 	        node->inc_children(1);
 
 	        /* right sibling left shift*/
-	        memmove(&right->key()[0], &right->key()[1], (right->get_children() - 2) * sizeof(bp_addr_t));
+	        move_keys(right, 0, right, 1, right->get_children() - 2);
 	        memmove(&right->sub()[0], &right->sub()[1], (right->get_children() - 1) * sizeof(off_t));
 
 	        right->inc_children(-1);
@@ -865,11 +939,11 @@ private:
 	                        	      int parent_key_index)
 	{
 	        /* move parent key down */
-	        node->key()[node->get_children() - 1] = parent->key()[parent_key_index];
+	        copy_key(node, node->get_children() - 1, parent, parent_key_index);
 	        node->inc_children(1);
 
 	        /* merge from right sibling */
-	        memmove(&node->key()[node->get_children() - 1], &right->key()[0], (right->get_children() - 1) * sizeof(bp_addr_t));
+	        move_keys(node, node->get_children() - 1, right, 0, right->get_children() - 1);
 	        memmove(&node->sub()[node->get_children() - 1], &right->sub()[0], right->get_children() * sizeof(off_t));
 
 	        /* flush sub-nodes of the new merged node */
@@ -881,10 +955,10 @@ private:
 	        node->inc_children(right->get_children() - 1);
 	}
 
-	static inline void non_leaf_simple_remove(bptree_node *node, int remove)
+	inline void non_leaf_simple_remove(bptree_node *node, int remove)
 	{
 	        assert(node->get_children() >= 2);
-	        memmove(&node->key()[remove], &node->key()[remove + 1], (node->get_children() - remove - 2) * sizeof(bp_addr_t));
+	        move_keys(node, remove, node, remove + 1, node->get_children() - remove - 2);
 	        memmove(&node->sub()[remove + 1], &node->sub()[remove + 2], (node->get_children() - remove - 2) * sizeof(off_t));
 	        node->inc_children(-1);
 	}
@@ -960,25 +1034,25 @@ private:
 	                		 int parent_key_index, int remove)
 	{
 	        /* right shift in leaf node */
-	        memmove(&leaf->key()[1], &leaf->key()[0], remove * sizeof(bp_addr_t));
+	        move_keys(leaf, 1, leaf, 0, remove);
 	        //memmove(&data(leaf)[1], &data(leaf)[0], remove * sizeof(off_t));
 
 	        /* borrow the last element from left sibling */
-	        leaf->key()[0] = left->key()[left->get_children() - 1];
+	        copy_key(leaf, 0, left, left->get_children() - 1);
 	        //data(leaf)[0] = data(left)[left->get_children() - 1];
 	        left->inc_children(-1);
 
 	        /* update parent key */
-	        parent->key()[parent_key_index] = leaf->key()[0];
+	        copy_key(parent, parent_key_index, leaf, 0);
 	}
 
 	void leaf_merge_into_left(bptree_node *leaf,
 	                		 bptree_node *left, int parent_key_index, int remove)
 	{
 	        /* merge into left sibling, sum = leaf->get_children() - 1*/
-	        memmove(&left->key()[left->get_children()], &leaf->key()[0], remove * sizeof(bp_addr_t));
+	        move_keys(left, left->get_children(), leaf, 0, remove);
 	        //memmove(&data(left)[left->get_children()], &data(leaf)[0], remove * sizeof(off_t));
-	        memmove(&left->key()[left->get_children() + remove], &leaf->key()[remove + 1], (leaf->get_children() - remove - 1) * sizeof(bp_addr_t));
+	        move_keys(left, left->get_children() + remove, leaf, remove + 1, leaf->get_children() - remove - 1);
 	        //memmove(&data(left)[left->get_children() + remove], &data(leaf)[remove + 1], (leaf->get_children() - remove - 1) * sizeof(off_t));
 	        left->inc_children(leaf->get_children() - 1);
 	}
@@ -988,23 +1062,23 @@ private:
 	                                  int parent_key_index)
 	{
 	        /* borrow the first element from right sibling */
-	        leaf->key()[leaf->get_children()] = right->key()[0];
+	        copy_key(leaf, leaf->get_children(), right, 0);
 	        //data(leaf)[leaf->get_children()] = data(right)[0];
 	        leaf->inc_children(1);
 
 	        /* left shift in right sibling */
-	        memmove(&right->key()[0], &right->key()[1], (right->get_children() - 1) * sizeof(bp_addr_t));
+	        move_keys(right, 0, right, 1, right->get_children() - 1);
 	        //memmove(&data(right)[0], &data(right)[1], (right->get_children() - 1) * sizeof(off_t));
 	        right->inc_children(-1);
 
 	        /* update parent key */
-	        parent->key()[parent_key_index] = right->key()[0];
+	        copy_key(parent, parent_key_index, right, 0);
 	}
 
 	inline void leaf_merge_from_right(bptree_node *leaf,
 	                                         bptree_node *right)
 	{
-	        memmove(&leaf->key()[leaf->get_children()], &right->key()[0], right->get_children() * sizeof(bp_addr_t));
+	        move_keys(leaf, leaf->get_children(), right, 0, right->get_children());
 	        //memmove(&data(leaf)[leaf->get_children()], &data(right)[0], right->get_children() * sizeof(off_t));
 	        leaf->inc_children(right->get_children());
 	}
@@ -1013,8 +1087,7 @@ private:
 	{
 
         remove_key_from_datanode(leaf->key()[remove]);
-        memmove(&leaf->key()[remove], &leaf->key()[remove + 1],
-                (leaf->get_children() - remove - 1) * sizeof(bp_addr_t));
+        move_keys(leaf, remove, leaf, remove + 1, leaf->get_children() - remove - 1);
         //memmove(&data(leaf)[remove], &data(leaf)[remove + 1], (leaf->get_children() - remove - 1) * sizeof(off_t));
         leaf->inc_children(-1);
 
@@ -1195,8 +1268,23 @@ public:
 		same = false;
 		//std::cout << "children = " << node->get_children()  << ", low = " << low << ", high = " << high << std::endl;
 
+		// keys are fetched only when their hints are the same
+		char hint[bptree_param::key_hint_size];
+		const bool hints = node->has_hints();
+		if (hints) {
+			make_hint(hint, userkey, keylength);
+		}
+
 		while (low + 1 < high) {
 			int mid = low + (high - low) / 2;
+			const int c = (hints)? memcmp(hint, node->hint(mid), param.hint_size) : 0;
+			if (c > 0) {
+				low = mid;
+				continue;
+			} else if (c < 0) {
+				high = mid;
+				continue;
+			}
 			if (!pool.fetch_key(arr[mid], &key, length)) {
 			    return INT32_MAX;
 			}
@@ -1207,7 +1295,7 @@ public:
 			}
 		}
 
-		if (high < len) {
+		if (high < len && (!hints || memcmp(hint, node->hint(high), param.hint_size) == 0)) {
 			same = is_same(userkey, keylength, arr[high]);
 		}
 
@@ -22,6 +22,7 @@
 #include <time.h>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 
 #include <unordered_map>
 #include "../kvsstore_debug.h"
@@ -46,7 +47,8 @@ using namespace std;
 #define OPTION_NOLOGGING (OPTION_DISABLE_ITERATOR|OPTION_DISABLE_AOL)
 
 int KADI::kv_delete_aio(uint8_t space_id, void *key, kv_key_t keylength, const kv_cb& cb) {
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
@@ -61,16 +63,16 @@ int KADI::kv_delete_aio(uint8_t space_id, void *key, kv_key_t keylength, const k
     }
     ioctx->cmd.key_length = keylength;
     ioctx->cmd.reqid = ioctx->index;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->key.key = key;
     ioctx->key.length = keylength;
     ioctx->value.value = 0;
     ioctx->value.length = 0;
     ioctx->value.offset = 0;
 
-    int ret = ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+    int ret = _ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd);
     if (ret  < 0) {
-        cmd_ctx_mgr.release_cmd_ctx(ioctx);
+        q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -79,7 +81,8 @@ int KADI::kv_delete_aio(uint8_t space_id, void *key, kv_key_t keylength, const k
 
 
 int KADI::kv_retrieve_aio(uint8_t space_id, void *key, kv_key_t keylength, void *value, int valoff, int vallength, const kv_cb& cb) {
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
     //TR << "ASYNC READ TRACE: key = " << print_kvssd_key(key->key, key->length) << ", value offset = " << value->offset ;
@@ -93,7 +96,7 @@ int KADI::kv_retrieve_aio(uint8_t space_id, void *key, kv_key_t keylength, void
     ioctx->cmd.data_length = vallength;
     ioctx->cmd.key_length = keylength;
     ioctx->cmd.reqid = ioctx->index;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->key.key = key;
     ioctx->key.length = keylength;
     ioctx->value.value = value;
@@ -106,8 +109,8 @@ int KADI::kv_retrieve_aio(uint8_t space_id, void *key, kv_key_t keylength, void
         ioctx->cmd.key_addr = (__u64)key;
     }
 
-    if (ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
-        cmd_ctx_mgr.release_cmd_ctx(ioctx);
+    if (_ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
+        q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -115,7 +118,8 @@ int KADI::kv_retrieve_aio(uint8_t space_id, void *key, kv_key_t keylength, void
 }
 
 int KADI::kv_store_aio(uint8_t space_id, void *key, kv_key_t keylength, void *value, int valoff, int vallength, const kv_cb& cb) {
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
 
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
@@ -129,7 +133,7 @@ int KADI::kv_store_aio(uint8_t space_id, void *key, kv_key_t keylength, void *va
     ioctx->cmd.data_addr = (__u64)value;
     ioctx->cmd.data_length = vallength;
     ioctx->cmd.cdw10 = (vallength >>  2);
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->cmd.reqid = ioctx->index;
     ioctx->key.key = key;
     ioctx->key.length = keylength;
@@ -145,8 +149,8 @@ int KADI::kv_store_aio(uint8_t space_id, void *key, kv_key_t keylength, void *va
         memcpy((void*)ioctx->cmd.key, (void*)key, keylength);
     }
 
-    if (ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
-        cmd_ctx_mgr.release_cmd_ctx(ioctx);
+    if (_ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
+        q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -161,7 +165,16 @@ int KADI::open(const std::string &devpath, int keyspace_sorted_) {
 
     int ret = 0;
 
-    this->fd = ::open(devpath.c_str(), O_RDWR);
+    if (kadi_emul::is_emul_path(devpath)) {
+        emul = new kadi_emul(emul_param);
+        this->fd = emul->open(devpath, keyspace_sorted_);
+        if (this->fd < 0) {
+            delete emul;
+            emul = nullptr;
+        }
+    } else {
+        this->fd = ::open(devpath.c_str(), O_RDWR);
+    }
     if (this->fd < 0) {
     	std::cout << devpath << std::endl;
         derr <<  "can't open a device : " << devpath << dendl;
@@ -169,7 +182,7 @@ int KADI::open(const std::string &devpath, int keyspace_sorted_) {
     }
 
     this->keyspace_sorted = keyspace_sorted_;
-    this->nsid = ioctl(fd, NVME_IOCTL_ID);
+    this->nsid = _ioctl(NVME_IOCTL_ID, nullptr);
     if (this->nsid == (unsigned) -1) {
         derr <<  "can't get an ID" << dendl;
         return -1;
@@ -177,17 +190,30 @@ int KADI::open(const std::string &devpath, int keyspace_sorted_) {
 
 //    cmd_ctx_mgr.init(this->qdepth);
 
-    aioctx_ctxid   = ioevent_mgr.init(this->fd);
-    if (aioctx_ctxid == -1) return aioctx_ctxid;
+    nqueues = std::min(std::max(num_queues, 1u), (unsigned)KADI_MAX_QUEUES);
+    for (unsigned i = 0; i < nqueues; i++) {
+        queues[i].ctxid = queues[i].ioevent_mgr.init(this->fd, emul);
+        if (queues[i].ctxid == -1) return -1;
+    }
 
-    derr << ">> KVSSD is opened: " << devpath.c_str() << ", ctx id = " << aioctx_ctxid << dendl;
+    derr << ">> KVSSD is opened: " << devpath.c_str() << ", queues = " << nqueues << ", ctx id = " << queues[0].ctxid << dendl;
     return ret;
 }
 
 int KADI::close() {
     if (this->fd > 0) {
-    	ioevent_mgr.close(this->fd);
-        ::close(fd);
+        for (unsigned i = 0; i < nqueues; i++) {
+            if (queues[i].ctxid != -1) queues[i].ioevent_mgr.close(this->fd, emul);
+            queues[i].ctxid = -1;
+        }
+        nqueues = 0;
+        if (emul) {
+            emul->close();
+            delete emul;
+            emul = nullptr;
+        } else {
+            ::close(fd);
+        }
 
         //cmd_ctx_mgr.close();
         derr << ">> KV device is closed: fd " << fd << dendl;
@@ -224,7 +250,7 @@ int KADI::kv_store_sync(uint8_t space_id, kv_key *key, kv_value *value) {
         memcpy((void*)cmd.key, (void*)key->key, key->length);
     }
 
-    int ret =ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret =_ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 
     if (ret < 0) {
         return -1;
@@ -252,7 +278,7 @@ int KADI::kv_store_sync(uint8_t space_id, kv_value *value, const std::function<
     cmd.cdw10 = (value->length >>  2);
 
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 #ifdef ENABLE_IOTRACE
     void *keyptr = 0;
     if (cmd.key_length <= KVCMD_INLINE_KEY_MAX) {
@@ -279,7 +305,8 @@ int KADI::kv_store_sync(uint8_t space_id, kv_value *value, const std::function<
 }
 int KADI::kv_store_aio(uint8_t space_id, kv_value *value, const kv_cb& cb, const std::function< void (struct nvme_passthru_kv_cmd&)> &fill)
 {
-	aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+	kadi_queue &q = get_queue(cb.qid);
+	aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
 	memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
     ioctx->cmd.opcode = nvme_cmd_kv_store;
@@ -294,7 +321,7 @@ int KADI::kv_store_aio(uint8_t space_id, kv_value *value, const kv_cb& cb, const
     ioctx->cmd.data_addr = (__u64)value->value;
     ioctx->cmd.data_length = value->length;
     ioctx->cmd.cdw10 = (value->length >>  2);
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->cmd.reqid = ioctx->index;
     ioctx->key.length = ioctx->cmd.key_length;
 	ioctx->key.key = (ioctx->cmd.key_length <= KVCMD_INLINE_KEY_MAX)? (void*)ioctx->cmd.key:(void*)ioctx->cmd.key_addr;
@@ -303,8 +330,8 @@ int KADI::kv_store_aio(uint8_t space_id, kv_value *value, const kv_cb& cb, const
 	ioctx->value.offset = value->offset;
 
 
-    if (ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
-    	cmd_ctx_mgr.release_cmd_ctx(ioctx);
+    if (_ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
+    	q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -328,7 +355,8 @@ int KADI::kv_store_aio(uint8_t space_id, kv_value *value, const kv_cb& cb, const
 /// -----------------------------------------------------------------------
 
 int KADI::kv_retrieve_aio(uint8_t space_id, kv_key *key, kv_value *value, const kv_cb& cb) {
-	aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+	kadi_queue &q = get_queue(cb.qid);
+	aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 	memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
 	//TR << "ASYNC READ TRACE: key = " << print_kvssd_key(key->key, key->length) << ", value offset = " << value->offset ;
@@ -342,7 +370,7 @@ int KADI::kv_retrieve_aio(uint8_t space_id, kv_key *key, kv_value *value, const
     ioctx->cmd.data_length = value->length;
     ioctx->cmd.key_length = key->length;
     ioctx->cmd.reqid = ioctx->index;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
 	ioctx->key.key = key->key;
 	ioctx->key.length = key->length;
 	ioctx->value.value = value->value;
@@ -355,8 +383,8 @@ int KADI::kv_retrieve_aio(uint8_t space_id, kv_key *key, kv_value *value, const
         ioctx->cmd.key_addr = (__u64)key->key;
     }
     //ioctx->t1 = std::chrono::high_resolution_clock::now();
-    if (ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
-    	cmd_ctx_mgr.release_cmd_ctx(ioctx);
+    if (_ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd) < 0) {
+    	q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -394,7 +422,7 @@ int KADI::kv_retrieve_sync(uint8_t space_id, kv_key *key, kv_value *value) {
         cmd.key_addr = (__u64)key->key;
     }
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 
 #ifdef ENABLE_IOTRACE
     if (ret == 0) {
@@ -431,7 +459,7 @@ int KADI::kv_retrieve_sync(uint8_t space_id, kv_value *value, const std::functio
 
     fill(cmd);
 
-    int ret= ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret= _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
     if (ret == 0) {
         value->actual_value_size = cmd.result;
         value->length = std::min(cmd.result, value->length);
@@ -478,7 +506,7 @@ int KADI::kv_retrieve_sync(uint8_t space_id, kv_key *key, kv_value *value,
     }
 
 retry:
-	int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+	int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 #ifdef ENABLE_IOTRACE
     if (ret == 0) {
         TRIO << "<kv_retrieve_sync> " << print_kvssd_key(std::string((const char*)key->key, key->length))
@@ -519,7 +547,7 @@ int KADI::kv_delete_sync(uint8_t space_id, const std::function< void (struct nvm
 
 	fill(cmd);
 
-	int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+	int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 #ifdef ENABLE_IOTRACE
     void *keyptr = 0;
     if (cmd.key_length <= KVCMD_INLINE_KEY_MAX) {
@@ -541,7 +569,8 @@ int KADI::kv_delete_sync(uint8_t space_id, const std::function< void (struct nvm
 }
 
 int KADI::kv_delete_aio(uint8_t space_id, const kv_cb& cb, const std::function< void (struct nvme_passthru_kv_cmd&)> &fill) {
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
@@ -553,7 +582,7 @@ int KADI::kv_delete_aio(uint8_t space_id, const kv_cb& cb, const std::function<
     fill(ioctx->cmd);
 
     ioctx->cmd.reqid = ioctx->index;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->key.length = ioctx->cmd.key_length;
     if (ioctx->cmd.key_length <= KVCMD_INLINE_KEY_MAX) {
     	ioctx->key.key = (void*)ioctx->cmd.key;
@@ -566,9 +595,9 @@ int KADI::kv_delete_aio(uint8_t space_id, const kv_cb& cb, const std::function<
 
     //ioctx->t1 = std::chrono::high_resolution_clock::now();
 
-    int ret = ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+    int ret = _ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd);
     if (ret < 0) {
-        cmd_ctx_mgr.release_cmd_ctx(ioctx);
+        q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -604,7 +633,7 @@ int KADI::kv_delete_sync(uint8_t space_id, kv_key *key) {
         cmd.key_addr = (__u64)key->key;
     }
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 #ifdef ENABLE_IOTRACE
     if (ret == 0) {
         TRIO << "<kv_delete_sync> " << print_kvssd_key(std::string((const char*)key->key, key->length))
@@ -622,7 +651,8 @@ int KADI::kv_delete_sync(uint8_t space_id, kv_key *key) {
 }
 
 int KADI::kv_delete_aio(uint8_t space_id, kv_key *key, const kv_cb& cb) {
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
@@ -637,7 +667,7 @@ int KADI::kv_delete_aio(uint8_t space_id, kv_key *key, const kv_cb& cb) {
     }
     ioctx->cmd.key_length = key->length;
     ioctx->cmd.reqid = ioctx->index;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
 	ioctx->key.key = key->key;
 	ioctx->key.length = key->length;
 	ioctx->value.value = 0;
@@ -646,9 +676,9 @@ int KADI::kv_delete_aio(uint8_t space_id, kv_key *key, const kv_cb& cb) {
 
     ioctx->t1 = std::chrono::high_resolution_clock::now();
 
-    int ret = ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+    int ret = _ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd);
     if (ret  < 0) {
-        cmd_ctx_mgr.release_cmd_ctx(ioctx);
+        q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
         return -1;
     }
 
@@ -683,7 +713,7 @@ int KADI::iter_open(kv_iter_context *iter_handle, int space_id)
     cmd.cdw12 = iter_handle->prefix;
     cmd.cdw13 = iter_handle->bitmask;
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 
     if (ret < 0) {
     	std::cout << "iter open failed: " << ret << endl;
@@ -704,7 +734,7 @@ int KADI::iter_close(kv_iter_context *iter_handle, int space_id) {
     cmd.cdw4 = ITER_OPTION_CLOSE;
     cmd.cdw5 = iter_handle->handle;
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 #ifdef ENABLE_IOTRACE
     if (ret == 0) {
         TRIO << "<ITER_CLOSE>  OK" ;
@@ -728,7 +758,7 @@ int KADI::iter_read(int space_id, unsigned char handle, void *buf, uint32_t bufl
     cmd.data_addr = (__u64)buf;
     cmd.data_length = buflen;
 
-    int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+    int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 
     if (ret < 0) { return -1; }
 
@@ -749,7 +779,8 @@ int KADI::iter_read(int space_id, unsigned char handle, void *buf, uint32_t bufl
 
 int KADI::iter_read_aio(int space_id, unsigned char handle, void *buf, uint32_t buflen, const kv_cb& cb) {
 
-    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+    kadi_queue &q = get_queue(cb.qid);
+    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
     memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 
@@ -759,7 +790,7 @@ int KADI::iter_read_aio(int space_id, unsigned char handle, void *buf, uint32_t
     ioctx->cmd.cdw5 = handle;
     ioctx->cmd.data_addr = (__u64)buf;
     ioctx->cmd.data_length = buflen;
-    ioctx->cmd.ctxid = aioctx_ctxid;
+    ioctx->cmd.ctxid = q.ctxid;
     ioctx->cmd.reqid = ioctx->index;
 	ioctx->key.key = 0;
 	ioctx->key.length = 0;
@@ -767,7 +798,7 @@ int KADI::iter_read_aio(int space_id, unsigned char handle, void *buf, uint32_t
 	ioctx->value.length = 0;
 	ioctx->value.offset = 0;
 
-    int ret = ioctl(fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+    int ret = _ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd);
     if (ret < 0) {
         derr << "fail to send aio command ret = " << ret << dendl;
         return -1;
@@ -962,10 +993,10 @@ int KADI::read_oplogpages(struct oplog_info &info)
                     //TR << "oplog read: id = " << oplog->id;
                     if (oplog->byteswritten > 0) {
                         info.oplog_list[oplog->groupid].insert(std::make_pair(oplog->sequence, std::make_pair(oplog->buf, oplog->byteswritten)));
+                        if (oplog->sequence > info.last_sequence) info.last_sequence = oplog->sequence;
+                        oplog->buf = 0;     // owned by info.oplog_list
                     }
-                    else {
-                        delete oplog;
-                    }
+                    delete oplog;
                 }
             }
         }
@@ -1017,6 +1048,18 @@ int KADI::delete_oplogpages(struct oplog_info &info)
 
 
 uint64_t KADI::list_oplog(const uint8_t spaceid, const uint32_t prefix, const std::function< void (int, int, uint64_t, const char*, int) > &key_listener)
+{
+    FTRACE
+    struct oplog_info info (spaceid, prefix);
+
+    const uint64_t total_keys = list_oplog(info, key_listener);
+    if (info.oplogpage_keys.size() > 0)
+        delete_oplogpages(info);
+
+    return total_keys;
+}
+
+uint64_t KADI::list_oplog(struct oplog_info &info, const std::function< void (int, int, uint64_t, const char*, int) > &key_listener)
 {
     FTRACE
     int r = 0;
@@ -1024,37 +1067,47 @@ uint64_t KADI::list_oplog(const uint8_t spaceid, const uint32_t prefix, const st
 	void *key;
 	int length;
     uint64_t total_keys = 0;
-    //static const int oplog_pagesize = 28*1024;
-
-    struct oplog_info info (spaceid, prefix);
 
     // step 1. read oplog page list
     r = read_oplogpage_dir(info);
     TRI << "oplog dir pages = " << info.oplogpage_dir.size() << ", r = " << r;
-    if (r != 0) return 0;
+    if (r != 0) { info.oplogpage_keys.clear(); return 0; }
+
+    info.pages_found = info.oplogpage_keys.size();
+
+    // keep the oldest pages only, the rest is picked up by the next call
+    if (info.max_pages > 0 && info.oplogpage_keys.size() > info.max_pages) {
+        auto older = [] (const std::pair<void *, int> &a, const std::pair<void *, int> &b) {
+            const struct oplog_key *ka = (const struct oplog_key *)a.first;
+            const struct oplog_key *kb = (const struct oplog_key *)b.first;
+            if (ka->sequenceid != kb->sequenceid) return ka->sequenceid < kb->sequenceid;
+            return ka->groupid < kb->groupid;
+        };
+        std::partial_sort(info.oplogpage_keys.begin(), info.oplogpage_keys.begin() + info.max_pages, info.oplogpage_keys.end(), older);
+        info.oplogpage_keys.resize(info.max_pages);
+    }
+
+    if (info.oplogpage_keys.empty()) return 0;
 
     // step 2. read oplog pages
     r = read_oplogpages(info);
-    if (r != 0) return 0;
+    if (r != 0) { info.oplogpage_keys.clear(); return 0; }
 
     TRI << "read is done, updating the index structure, pages read = " << info.oplog_list.size();
 
+    // step 3. replay the pages; the caller deletes them with delete_oplogpages()
     for (const auto &groups: info.oplog_list) {
         const int groupid = groups.first;
         for (const auto &sequences : groups.second) {
-            int cur = 0;
             opbuf_reader reader(nullptr, groupid, sequences.second.first, sequences.second.second);
             while (reader.nextkey(&opcode, &key, &length)) {
                 TRI << "oplog key " << print_kvssd_key(key, length) ;
                 key_listener(opcode, groupid, sequences.first, (const char*)key, length);
-                cur++;
             }
             total_keys += reader.numkeys_ret();
         }
     }
 
-    delete_oplogpages(info);
-
     return total_keys;
 }
 
@@ -1109,7 +1162,7 @@ int KADI::batch_submit(kv_batch_context *batch_handle, int space_id) {
 	    cmd.data_length = payload_size;
 	    cmd.cdw10 = (payload_size >> 2); // Payload size in dword
 	    cmd.cdw11 = ((0x00 << 8) | batchcmd->get_cmdcnts()) & 0xFFFF;
-		ret = ioctl(this->fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+		ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 	}
 	return ret;
 }
@@ -1119,7 +1172,8 @@ int KADI::batch_submit_aio(kv_batch_context *batch_handle, int space_id, const k
 
 	for (auto it = batch_handle->begin(); it != batch_handle->end(); it++) {
 		KvBatchCmd *batchcmd = *it;
-	    aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_cmd_ctx(cb);
+	    kadi_queue &q = get_queue(cb.qid);
+	    aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_cmd_ctx(cb);
 
 	    memset((void*)&ioctx->cmd, 0, sizeof(struct nvme_passthru_kv_cmd));
 	    const int payload_size = batchcmd->payload_size();
@@ -1129,7 +1183,7 @@ int KADI::batch_submit_aio(kv_batch_context *batch_handle, int space_id, const k
 	    ioctx->cmd.data_length = payload_size;
 	    ioctx->cmd.cdw10 = (payload_size >> 2); // Payload size in dword
 	    ioctx->cmd.cdw11 = ((0x00 << 8) | batchcmd->get_cmdcnts()) & 0xFFFF;
-	    ioctx->cmd.ctxid = aioctx_ctxid;
+	    ioctx->cmd.ctxid = q.ctxid;
 		ioctx->cmd.reqid = ioctx->index;
 		ioctx->key.key = 0;
 		ioctx->key.length = 0;
@@ -1139,11 +1193,19 @@ int KADI::batch_submit_aio(kv_batch_context *batch_handle, int space_id, const k
 
 	    ioctx->t1 = std::chrono::high_resolution_clock::now();
 
-	    ret = ioctl(this->fd, NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+	    ret = _ioctl(NVME_IOCTL_AIO_CMD, &ioctx->cmd);
+	    if (ret < 0) {
+	    	q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
+	    	return -1;
+	    }
 	}
 	return ret;
 }
 
+int KADI::get_store_option(uint8_t space_id) const {
+	return (space_id == this->keyspace_sorted)? OPTION_LOGGING:OPTION_NOLOGGING;
+}
+
 
 /// Misc
 /// -----------------------------------------------------------------------
@@ -1159,7 +1221,7 @@ int KADI::get_freespace(uint64_t &bytesused, uint64_t &capacity, double &utiliza
     cmd.data_len = 4096;
     cmd.cdw10 = 0;
 
-    if (ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd) < 0)
+    if (_ioctl(NVME_IOCTL_ADMIN_CMD, &cmd) < 0)
     {
         return -1;
     }
@@ -1188,11 +1250,13 @@ bool KADI::exist(void *key, int length, int spaceid)
 			memcpy(cmd.key, key, length);
 	}
 
-	int ret = ioctl(fd, NVME_IOCTL_IO_KV_CMD, &cmd);
+	int ret = _ioctl(NVME_IOCTL_IO_KV_CMD, &cmd);
 	return (ret == 0);
 }
 
-int KADI::poll_completion(uint32_t &num_events, uint32_t timeout_us) {
+int KADI::poll_completion(uint32_t &num_events, uint32_t timeout_us, int qid) {
+    if (nqueues == 0) { num_events = 0; return -1; }
+    kadi_queue &q = get_queue(qid);
 
 	//int num_finished_ios = std::min(ioevent_mgr.poll(timeout_us), MAX_AIO_EVENTS);
 	int ret = 0;
@@ -1202,9 +1266,9 @@ int KADI::poll_completion(uint32_t &num_events, uint32_t timeout_us) {
     while (num_finished_ios) {
         struct nvme_aioevents aioevents;
         aioevents.nr = num_finished_ios;
-        aioevents.ctxid = aioctx_ctxid;
+        aioevents.ctxid = q.ctxid;
 
-        if (ioctl(fd, NVME_IOCTL_GET_AIOEVENT, &aioevents) < 0) {
+        if (_ioctl(NVME_IOCTL_GET_AIOEVENT, &aioevents) < 0) {
             fprintf(stderr, "fail to read IOEVETS \n");
             ret = -1; goto exit;
         }
@@ -1214,7 +1278,7 @@ int KADI::poll_completion(uint32_t &num_events, uint32_t timeout_us) {
         //TRI << "completed " << aioevents.nr << " IOs, total " << completed_ios.load() << "/" << submitted_ios.load();
         for (int i = 0; i < aioevents.nr; i++) {
             const struct nvme_aioevent &event  = aioevents.events[i];
-            aio_cmd_ctx *ioctx = cmd_ctx_mgr.get_pending_cmdctx(event.reqid);
+            aio_cmd_ctx *ioctx = q.cmd_ctx_mgr.get_pending_cmdctx(event.reqid);
             if (ioctx == 0) {
                 exit(1);
             	ret = KVS_ERR_INDEX; goto exit;
@@ -1223,8 +1287,12 @@ int KADI::poll_completion(uint32_t &num_events, uint32_t timeout_us) {
 			kv_io_context ioresult;
 			fill_ioresult(*ioctx, event, ioresult);
 
-			ioctx->call_post_fn(ioresult);
-			cmd_ctx_mgr.release_cmd_ctx(ioctx);
+			// return the slot first so that the callback can submit again
+			void (*post_fn)(kv_io_context &, void *) = ioctx->post_fn;
+			void *post_data = ioctx->post_data;
+			q.cmd_ctx_mgr.release_cmd_ctx(ioctx);
+
+			if (post_fn != NULL) post_fn(ioresult, post_data);
 			events++;
         }
 
@@ -1241,6 +1309,11 @@ kv_result KADI::fill_ioresult(const aio_cmd_ctx &ioctx, const struct nvme_aioeve
     ioresult.opcode = ioctx.cmd.opcode;
     ioresult.retcode = event.status;
     memcpy(&ioresult.key, &ioctx.key, sizeof(ioctx.key));
+    if (ioctx.key.key == (void*)ioctx.cmd.key) {
+        // the slot is released before the callback runs, keep the inline key with the result
+        memcpy(ioresult.inline_key, ioctx.cmd.key, ioctx.key.length);
+        ioresult.key.key = ioresult.inline_key;
+    }
     memcpy(&ioresult.value, &ioctx.value, sizeof(ioctx.value));
 
 
@@ -1352,6 +1425,26 @@ bool KvBatchCmd::add_store_cmd(int nsid, int option, const char *key, uint8_t ke
 }
 
 
+// a delete sub-command carries only its key
+bool KvBatchCmd::add_delete_cmd(int nsid, const char *key, uint8_t key_length)
+{
+	if (isfull()) return false;
+
+	batch_cmd_head* batch_head = (batch_cmd_head*)payload;
+	batch_head->attr[subcmd_index].opcode = nvme_cmd_kv_delete;
+	batch_head->attr[subcmd_index].keySize = key_length;
+	batch_head->attr[subcmd_index].valuseSize = 0;
+	batch_head->attr[subcmd_index].nsid = nsid;
+	batch_head->attr[subcmd_index].option = 0;
+
+	char *body = payload + sizeof(batch_cmd_head);
+	subcmd_offset += SUBCMD_HEAD_SIZE;
+	memcpy(body + subcmd_offset, key, key_length); subcmd_offset += align_64(key_length);
+
+	subcmd_index++;
+	return true;
+}
+
 bool KvBatchCmd::add_store_cmd(int nsid, int option, const char *value, uint32_t value_length, const std::function< uint8_t (char*) > &construct_key)
 {
 	if (isfull()) return false;
@@ -1466,6 +1559,21 @@ int kv_batch_context::batch_store(int nsid, int option, const void *value, uint3
 
 	return 0;
 }
+
+int kv_batch_context::batch_delete(int nsid, const void *key, uint8_t key_length)
+{
+	if (batch == 0) batch = new KvBatchCmd();
+	do {
+		if (!batch->add_delete_cmd(nsid, (const char*)key, key_length)) {
+			batchcmds.push_back(batch);
+			batch = new KvBatchCmd;
+		} else {
+			break;
+		}
+	} while(true);
+
+	return 0;
+}
 /*
 int kv_batch_context::batch_store(int nsid, int option, const std::function< uint8_t (char*) > &construct_key, const std::function< uint32_t (char*) > &construct_value)
 {
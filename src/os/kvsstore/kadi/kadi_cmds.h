@@ -10,12 +10,22 @@
 
 #include "kadi_helpers.h"
 #include "kadi_types.h"
+#include "kadi_emul.h"
 #include <unordered_map>
 #include <map>
 #include <atomic>
 
 
+#define KADI_MAX_QUEUES 16
 
+// a submission/completion queue pair: commands submitted with kv_cb::qid
+// complete on the aio context of that queue and are reaped by
+// poll_completion(.., qid), so several threads can poll without contention
+struct kadi_queue {
+	int ctxid = -1;
+	ioevent_listener ioevent_mgr;
+	cmd_ctx_manager cmd_ctx_mgr;
+};
 
 class KADI {
 	int fd = -1;		// device file descriptor
@@ -24,7 +34,6 @@ class KADI {
     unsigned nsid;		// namespace id
     const int qdepth = MAX_AIO_EVENTS;		// io queue depth
 	//std::mutex aioevent_lock;
-	int aioctx_ctxid;
 	int ksid_oplog;
     int keyspace_sorted;
 
@@ -34,13 +43,28 @@ public:
 
     typedef std::list<std::pair<kv_key *, kv_value *> >::iterator aio_iter;
 
-    KADI(void *c): cct(c),nsid(0), aioctx_ctxid(0), ksid_oplog(7) { }
+    // latency model used when the device path selects the emulator
+    kadi_emul_param emul_param;
+
+    // number of queue pairs to create at open (1 - KADI_MAX_QUEUES)
+    unsigned num_queues = 1;
+
+    KADI(void *c): cct(c),nsid(0), ksid_oplog(7) { }
     ~KADI() { close(); }
 
 private:
     // helpers
-    cmd_ctx_manager cmd_ctx_mgr;
-    ioevent_listener ioevent_mgr;
+    kadi_queue queues[KADI_MAX_QUEUES];
+    unsigned nqueues = 0;
+    kadi_emul *emul = nullptr;
+
+    inline kadi_queue &get_queue(int qid) {
+        return queues[(unsigned)qid % nqueues];
+    }
+
+    inline int _ioctl(unsigned long request, void *arg) {
+        return (emul)? emul->ioctl(request, arg) : ioctl(fd, request, arg);
+    }
     kv_result fill_ioresult(const aio_cmd_ctx &ioctx,
     			const struct nvme_aioevent &event, kv_io_context &ioresult);
 public:
@@ -77,6 +101,9 @@ public:
     //int iter_readall(kv_iter_context *iter_ctx, buflist_t &buflist, int space_id);
 
 
+    // store option (oplog on/off) used for the keyspace, e.g. for batch sub-commands
+    int get_store_option(uint8_t space_id) const;
+
     int batch_submit(kv_batch_context *batch_handle, int space_id);
     int batch_submit_aio(kv_batch_context *batch_handle, int space_id, const kv_cb& cb);
 
@@ -87,8 +114,10 @@ public:
     int delete_oplogpages(struct oplog_info &info);
 
    	uint64_t list_oplog(const uint8_t spaceid, const uint32_t prefix, const std::function< void (int, int, uint64_t, const char*, int) > &key_listener);
+   	uint64_t list_oplog(struct oplog_info &info, const std::function< void (int, int, uint64_t, const char*, int) > &key_listener);
 
-    int poll_completion(uint32_t &num_events, uint32_t timeout_us);
+    int poll_completion(uint32_t &num_events, uint32_t timeout_us, int qid = 0);
+    unsigned get_num_queues() const { return nqueues; }
     int get_freespace(uint64_t &bytesused, uint64_t &capacity, double &utilization);
 
     bool exist(void *key, int length, int spaceid);
@@ -0,0 +1,592 @@
+/*
+ * kadi_emul.cc
+ *
+ *  In-process KV-SSD emulator (see kadi_emul.h)
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <thread>
+#include "kadi_emul.h"
+#include "kadi_helpers.h"
+
+using namespace std;
+
+#ifndef derr
+#define derr std::cerr
+#endif
+
+#ifndef dendl
+#define dendl std::endl
+#endif
+
+// store options used by KADI (see kadi_cmds.cc)
+#define OPTION_DISABLE_AOL      0x20
+
+#define KADI_EMUL_MAGIC "KADIEMU1"
+
+// oplog page signature; iterbuf_reader treats a page starting with a zero word as empty
+#define KADI_EMUL_OPLOG_SIGNATURE 0x4c4f
+
+// status codes returned by the device
+#define EMUL_STATUS_ITER_END		0x393
+#define EMUL_STATUS_INVALID_HANDLE	0x394
+#define EMUL_STATUS_BATCH_PARTIAL	0x3A1
+
+static inline uint32_t align_up(uint32_t length, uint32_t align) {
+	return ((length + align - 1) / align) * align;
+}
+
+static inline std::string cmd_key(const struct nvme_passthru_kv_cmd &cmd) {
+	const char *key = (cmd.key_length <= KVCMD_INLINE_KEY_MAX)? (const char*)cmd.key:(const char*)cmd.key_addr;
+	return std::string(key, cmd.key_length);
+}
+
+kadi_emul::kadi_emul(const kadi_emul_param &p): param(p)
+{
+	channels.resize(std::max(1u, param.queue_depth));
+}
+
+kadi_emul::~kadi_emul()
+{
+	close();
+}
+
+int kadi_emul::open(const std::string &devpath, int keyspace_sorted_)
+{
+	keyspace_sorted = keyspace_sorted_;
+	backing_file = devpath.substr(sizeof(KADI_EMUL_SCHEME) - 1);
+
+	if (!backing_file.empty() && _load(backing_file) != 0) {
+		derr << "emul: can't load the device image: " << backing_file << dendl;
+		return -1;
+	}
+
+	// a real descriptor is handed out so that KADI::is_opened() keeps working
+	handle_fd = eventfd(0, 0);
+	if (handle_fd < 0) {
+		derr << "emul: fail to create a device handle" << dendl;
+		return -1;
+	}
+
+	derr << ">> KVSSD emulator is opened: " << ((backing_file.empty())? "(memory)":backing_file)
+		 << ", queue depth = " << param.queue_depth << dendl;
+	return handle_fd;
+}
+
+void kadi_emul::close()
+{
+	if (handle_fd < 0) return;
+
+	if (!backing_file.empty()) {
+		std::unique_lock<std::mutex> l(lock);
+		_seal_oplog_page();
+		if (_save(backing_file) != 0) {
+			derr << "emul: fail to save the device image: " << backing_file << dendl;
+		}
+	}
+	::close(handle_fd);
+	handle_fd = -1;
+}
+
+int kadi_emul::ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case NVME_IOCTL_ID:
+		return 1;
+	case NVME_IOCTL_IO_KV_CMD:
+		return submit_sync(*(struct nvme_passthru_kv_cmd *)arg);
+	case NVME_IOCTL_AIO_CMD:
+		return submit_aio(*(struct nvme_passthru_kv_cmd *)arg);
+	case NVME_IOCTL_GET_AIOEVENT:
+		return get_aioevents(*(struct nvme_aioevents *)arg);
+	case NVME_IOCTL_SET_AIOCTX:
+	{
+		struct nvme_aioctx *ctx = (struct nvme_aioctx *)arg;
+		std::unique_lock<std::mutex> l(lock);
+		ctx->ctxid = next_ctxid++;
+		cqs[ctx->ctxid].eventfd = ctx->eventfd;
+		return 0;
+	}
+	case NVME_IOCTL_DEL_AIOCTX:
+	{
+		struct nvme_aioctx *ctx = (struct nvme_aioctx *)arg;
+		std::unique_lock<std::mutex> l(lock);
+		cqs.erase(ctx->ctxid);
+		return 0;
+	}
+	case NVME_IOCTL_ADMIN_CMD:
+		return identify(*(struct nvme_passthru_cmd *)arg);
+	};
+
+	errno = ENOTTY;
+	return -1;
+}
+
+///
+/// Submission and completion
+///
+
+int kadi_emul::submit_sync(struct nvme_passthru_kv_cmd &cmd)
+{
+	uint32_t result = 0, bytes = 0;
+	uint16_t status;
+	emul_clock::time_point due;
+	{
+		std::unique_lock<std::mutex> l(lock);
+		status = _execute(cmd, result, bytes);
+		due = _schedule(cmd.opcode, bytes);
+	}
+	std::this_thread::sleep_until(due);
+
+	cmd.result = result;
+	cmd.status = status;
+	return status;
+}
+
+int kadi_emul::submit_aio(struct nvme_passthru_kv_cmd &cmd)
+{
+	struct nvme_aioevent event;
+	uint32_t bytes = 0;
+	{
+		std::unique_lock<std::mutex> l(lock);
+		auto cq = cqs.find(cmd.ctxid);
+		if (cq == cqs.end()) {
+			errno = EINVAL;
+			return -1;
+		}
+		event.reqid  = cmd.reqid;
+		event.ctxid  = cmd.ctxid;
+		event.result = 0;
+		event.status = _execute(cmd, event.result, bytes);
+		cq->second.events.emplace(_schedule(cmd.opcode, bytes), event);
+	}
+	cq_cond.notify_all();
+	return 0;
+}
+
+int kadi_emul::get_aioevents(struct nvme_aioevents &events)
+{
+	static const auto max_wait = std::chrono::milliseconds(1);
+	const int nr = std::min<int>(events.nr, MAX_AIO_EVENTS);
+
+	std::unique_lock<std::mutex> l(lock);
+	auto cqit = cqs.find(events.ctxid);
+	if (cqit == cqs.end()) {
+		errno = EINVAL;
+		return -1;
+	}
+	auto &cq = cqit->second.events;
+
+	auto now = emul_clock::now();
+	if (cq.empty() || cq.begin()->first > now) {
+		// nothing has completed yet: wait for the next completion instead of spinning
+		auto until = now + max_wait;
+		if (!cq.empty()) until = std::min(until, cq.begin()->first);
+		cq_cond.wait_until(l, until);
+		now = emul_clock::now();
+
+		// the context may have been deleted while waiting
+		cqit = cqs.find(events.ctxid);
+		if (cqit == cqs.end()) {
+			events.nr = 0;
+			return 0;
+		}
+	}
+
+	auto &ready = cqit->second.events;
+	int i = 0;
+	auto it = ready.begin();
+	while (i < nr && it != ready.end() && it->first <= now) {
+		events.events[i++] = it->second;
+		it = ready.erase(it);
+	}
+	events.nr = i;
+	return 0;
+}
+
+int kadi_emul::identify(struct nvme_passthru_cmd &cmd)
+{
+	if (cmd.opcode != nvme_cmd_admin_identify || cmd.data_len < 24) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char *data = (char*)cmd.addr;
+	memset(data, 0, cmd.data_len);
+
+	std::unique_lock<std::mutex> l(lock);
+	*((__u64 *)data)       = param.capacity / 512;
+	*((__u64 *)&data[16])  = bytes_used / 512;
+	return 0;
+}
+
+kadi_emul::emul_clock::time_point kadi_emul::_schedule(uint8_t opcode, uint32_t bytes)
+{
+	uint32_t base_us = 0;
+	switch (opcode) {
+	case nvme_cmd_kv_retrieve:
+	case nvme_cmd_kv_exist:
+		base_us = param.read_lat_us;
+		break;
+	case nvme_cmd_kv_store:
+	case nvme_cmd_kv_batch:
+		base_us = param.write_lat_us;
+		break;
+	case nvme_cmd_kv_delete:
+		base_us = param.delete_lat_us;
+		break;
+	case nvme_cmd_kv_iter_req:
+	case nvme_cmd_kv_iter_read:
+		base_us = param.iter_lat_us;
+		break;
+	};
+
+	const auto now = emul_clock::now();
+	const double service_us = base_us + param.xfer_us_per_kb * bytes / 1024.0;
+	if (service_us <= 0) return now;
+
+	// the command is serviced by the channel that becomes idle first;
+	// it waits in the device queue while all channels are busy
+	auto ch = std::min_element(channels.begin(), channels.end());
+	*ch = std::max(now, *ch) + std::chrono::nanoseconds((uint64_t)(service_us * 1000));
+	return *ch;
+}
+
+///
+/// Commands
+///
+
+uint16_t kadi_emul::_execute(struct nvme_passthru_kv_cmd &cmd, uint32_t &result, uint32_t &bytes)
+{
+	const int ksid = cmd.cdw3;
+
+	result = 0;
+	bytes  = 0;
+
+	switch (cmd.opcode) {
+	case nvme_cmd_kv_store:
+		bytes = cmd.data_length;
+		return _store(ksid, cmd_key(cmd), (const char*)cmd.data_addr, cmd.data_length, cmd.cdw5,
+					  (ksid == keyspace_sorted && (cmd.cdw4 & OPTION_DISABLE_AOL) == 0));
+	case nvme_cmd_kv_retrieve:
+	{
+		uint16_t status = _retrieve(ksid, cmd_key(cmd), (char*)cmd.data_addr, cmd.data_length, cmd.cdw5, result);
+		bytes = std::min(result, cmd.data_length);
+		return status;
+	}
+	case nvme_cmd_kv_delete:
+		return _remove(ksid, cmd_key(cmd), (cmd.cdw4 & DELETE_OPTION_CHECK_KEY_EXIST) != 0);
+	case nvme_cmd_kv_exist:
+	{
+		auto &ks = keyspaces[ksid];
+		return (ks.find(cmd_key(cmd)) != ks.end())? KV_SUCCESS:KV_ERR_KEY_NOT_EXIST;
+	}
+	case nvme_cmd_kv_iter_req:
+		return _iter_open(cmd, result);
+	case nvme_cmd_kv_iter_read:
+	{
+		uint16_t status = _iter_read(cmd, result);
+		bytes = result & 0xffff;
+		return status;
+	}
+	case nvme_cmd_kv_batch:
+		bytes = cmd.data_length;
+		return _batch(cmd, result);
+	};
+
+	return nvme_cmd_kv_invalid_opcode;
+}
+
+uint16_t kadi_emul::_store(int ksid, const std::string &key, const char *value, uint32_t length, uint32_t offset, bool logging)
+{
+	std::string &v = keyspaces[ksid][key];
+	const uint64_t oldsize = v.size();
+
+	if (offset == 0) {
+		v.assign(value, length);
+	} else {
+		if (v.size() < offset + length) v.resize(offset + length);
+		v.replace(offset, length, value, length);
+	}
+	bytes_used = bytes_used - oldsize + v.size();
+
+	if (logging) _log(nvme_cmd_kv_store, ksid, key);
+	return KV_SUCCESS;
+}
+
+uint16_t kadi_emul::_retrieve(int ksid, const std::string &key, char *buf, uint32_t buflen, uint32_t offset, uint32_t &result)
+{
+	auto &ks = keyspaces[ksid];
+	auto it = ks.find(key);
+	if (it == ks.end()) return KV_ERR_KEY_NOT_EXIST;
+
+	const std::string &v = it->second;
+	if (offset > v.size()) return KV_ERR_KEY_NOT_EXIST;
+
+	// result holds the size of the stored value so that callers can detect a short buffer
+	result = v.size() - offset;
+	memcpy(buf, v.data() + offset, std::min(result, buflen));
+	return KV_SUCCESS;
+}
+
+uint16_t kadi_emul::_remove(int ksid, const std::string &key, bool check_exist)
+{
+	auto &ks = keyspaces[ksid];
+	auto it = ks.find(key);
+	if (it == ks.end()) {
+		return (check_exist)? KV_ERR_KEY_NOT_EXIST:KV_SUCCESS;
+	}
+
+	bytes_used -= it->second.size();
+	ks.erase(it);
+
+	if (ksid == keyspace_sorted) _log(nvme_cmd_kv_delete, ksid, key);
+	return KV_SUCCESS;
+}
+
+uint16_t kadi_emul::_iter_open(struct nvme_passthru_kv_cmd &cmd, uint32_t &result)
+{
+	const int ksid = cmd.cdw3;
+
+	if (cmd.cdw4 & ITER_OPTION_CLOSE) {
+		return (iterators.erase(cmd.cdw5 & 0xff) == 1)? KV_SUCCESS:EMUL_STATUS_INVALID_HANDLE;
+	}
+
+	if ((cmd.cdw4 & ITER_OPTION_OPEN) == 0) return nvme_cmd_kv_invalid_option;
+
+	const int handle = next_iter_handle;
+	next_iter_handle = (next_iter_handle % 255) + 1;
+
+	iter_state &iter = iterators[handle];
+	iter.keys.clear();
+	iter.pos = 0;
+
+	if (cmd.cdw4 & ITER_OPTION_LOG_KEY_SPACE) {
+		// list the oplog pages written for the keyspace
+		_seal_oplog_page();
+		for (const auto &p : keyspaces[OPLOG_KEYSPACE]) {
+			const struct oplog_key *k = (const struct oplog_key *)p.first.data();
+			if (p.first.size() == sizeof(struct oplog_key) && (int)k->groupid == ksid) {
+				iter.keys.push_back(p.first);
+			}
+		}
+	} else {
+		const uint32_t prefix  = cmd.cdw12;
+		const uint32_t bitmask = cmd.cdw13;
+		for (const auto &p : keyspaces[ksid]) {
+			uint32_t keyprefix = 0;
+			memcpy(&keyprefix, p.first.data(), std::min<size_t>(4, p.first.size()));
+			if ((keyprefix & bitmask) == (prefix & bitmask)) {
+				iter.keys.push_back(p.first);
+			}
+		}
+	}
+
+	result = handle;
+	return KV_SUCCESS;
+}
+
+uint16_t kadi_emul::_iter_read(struct nvme_passthru_kv_cmd &cmd, uint32_t &result)
+{
+	auto it = iterators.find(cmd.cdw5 & 0xff);
+	if (it == iterators.end()) return EMUL_STATUS_INVALID_HANDLE;
+
+	iter_state &iter = it->second;
+	char *buf = (char*)cmd.data_addr;
+	const uint32_t buflen = std::min<uint32_t>(cmd.data_length, 0xffff);
+	if (buflen < 4) return nvme_cmd_kv_invalid_option;
+
+	// [number of keys] followed by [key length][key, 4B aligned]
+	uint32_t offset = 4, numkeys = 0;
+	while (iter.pos < iter.keys.size()) {
+		const std::string &key = iter.keys[iter.pos];
+		const uint32_t len = key.size();
+		if (offset + 4 + align_up(len, 4) > buflen) break;
+
+		memcpy(buf + offset, &len, 4);
+		memcpy(buf + offset + 4, key.data(), len);
+		offset += 4 + align_up(len, 4);
+		numkeys++;
+		iter.pos++;
+	}
+	memcpy(buf, &numkeys, 4);
+
+	result = (numkeys > 0)? offset:0;
+	return (iter.pos == iter.keys.size())? EMUL_STATUS_ITER_END:KV_SUCCESS;
+}
+
+uint16_t kadi_emul::_batch(struct nvme_passthru_kv_cmd &cmd, uint32_t &result)
+{
+	static const uint32_t SUBCMD_HEAD_SIZE = 64;
+
+	const char *payload = (const char*)cmd.data_addr;
+	const int cmdcnt = std::min<int>(cmd.cdw11 & 0xff, MAX_SUB_CMD);
+	const batch_cmd_head *head = (const batch_cmd_head *)payload;
+	const char *body = payload + sizeof(batch_cmd_head);
+	uint32_t offset = 0;
+	bool failed = false;
+
+	for (int i = 0; i < cmdcnt; i++) {
+		const sub_cmd_attribute &attr = head->attr[i];
+		offset += SUBCMD_HEAD_SIZE;
+		const char *key = body + offset;     offset += align_up(attr.keySize, 64);
+		const char *value = body + offset;   offset += align_up(attr.valuseSize, 64);
+
+		uint16_t status = KV_BATCH_SUB_UNSUPPORT_OPCODE;
+		if (attr.opcode == nvme_cmd_kv_store) {
+			status = _store(attr.nsid, std::string(key, attr.keySize), value, attr.valuseSize, 0,
+							(attr.nsid == keyspace_sorted && (attr.option & OPTION_DISABLE_AOL) == 0));
+		} else if (attr.opcode == nvme_cmd_kv_delete) {
+			status = _remove(attr.nsid, std::string(key, attr.keySize), false);
+		}
+		if (status != KV_SUCCESS) {
+			result |= (status & 0xF) << (i * 4);
+			failed = true;
+		}
+	}
+
+	return (failed)? EMUL_STATUS_BATCH_PARTIAL:KV_SUCCESS;
+}
+
+///
+/// Oplog
+///
+
+void kadi_emul::_log(int optype, int ksid, const std::string &key)
+{
+	const uint32_t entry_size = sizeof(struct oplog_entry) + align_up(key.size(), 16);
+
+	if (oplog_page.size() + entry_size > ITER_BUFSIZE) {
+		_seal_oplog_page();
+	}
+
+	if (oplog_page.empty()) {
+		oplog_page.resize(sizeof(struct oplog_header), 0);
+	}
+
+	struct oplog_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.optype     = optype;
+	entry.keyspaceid = ksid;
+	entry.keysize    = key.size();
+
+	const size_t pos = oplog_page.size();
+	oplog_page.resize(pos + entry_size, 0);
+	memcpy(&oplog_page[pos], &entry, sizeof(entry));
+	memcpy(&oplog_page[pos + sizeof(entry)], key.data(), key.size());
+	oplog_count++;
+}
+
+void kadi_emul::_seal_oplog_page()
+{
+	if (oplog_count == 0) return;
+
+	struct oplog_header *hdr = (struct oplog_header *)&oplog_page[0];
+	hdr->signature  = KADI_EMUL_OPLOG_SIGNATURE;
+	hdr->keyspaceid = keyspace_sorted;
+	hdr->seqeunce   = oplog_seq;
+	hdr->logcount   = oplog_count;
+	hdr->size       = oplog_page.size();
+
+	struct oplog_key pagekey;
+	memcpy(pagekey.prefix, "LOG_", 4);
+	pagekey.sequenceid = oplog_seq++;
+	pagekey.groupid    = keyspace_sorted;
+
+	std::string &v = keyspaces[OPLOG_KEYSPACE][std::string((const char*)&pagekey, sizeof(pagekey))];
+	bytes_used += oplog_page.size();
+	v.swap(oplog_page);
+
+	oplog_page.clear();
+	oplog_count = 0;
+}
+
+///
+/// Device image
+///   [magic][next oplog sequence] followed by [ksid][key length][value length][key][value]
+///
+
+int kadi_emul::_load(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		// a new image is created when the device is closed
+		return (errno == ENOENT)? 0:-1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) { ::close(fd); return -1; }
+	if (st.st_size == 0)     { ::close(fd); return 0; }
+
+	void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (addr == MAP_FAILED) return -1;
+
+	const char *p   = (const char*)addr;
+	const char *end = p + st.st_size;
+	int r = 0;
+
+	if (st.st_size < (off_t)(8 + sizeof(uint64_t)) || memcmp(p, KADI_EMUL_MAGIC, 8) != 0) {
+		r = -1; goto out;
+	}
+	p += 8;
+	memcpy(&oplog_seq, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+
+	while (p < end) {
+		uint8_t ksid, keylength;
+		uint32_t vallength;
+		if (p + 6 > end) { r = -1; goto out; }
+		ksid = *(const uint8_t*)p;       p += 1;
+		keylength = *(const uint8_t*)p;  p += 1;
+		memcpy(&vallength, p, 4);        p += 4;
+		if (p + keylength + vallength > end) { r = -1; goto out; }
+
+		std::string &v = keyspaces[ksid][std::string(p, keylength)];
+		v.assign(p + keylength, vallength);
+		bytes_used += vallength;
+		p += keylength + vallength;
+	}
+
+out:
+	munmap(addr, st.st_size);
+	return r;
+}
+
+int kadi_emul::_save(const std::string &path)
+{
+	const std::string tmppath = path + ".tmp";
+	FILE *fp = fopen(tmppath.c_str(), "w");
+	if (fp == 0) return -1;
+
+	bool ok = (fwrite(KADI_EMUL_MAGIC, 8, 1, fp) == 1) &&
+			  (fwrite(&oplog_seq, sizeof(uint64_t), 1, fp) == 1);
+
+	for (const auto &ks : keyspaces) {
+		for (const auto &p : ks.second) {
+			if (!ok) break;
+			const uint8_t ksid = ks.first;
+			const uint8_t keylength = p.first.size();
+			const uint32_t vallength = p.second.size();
+			ok = (fwrite(&ksid, 1, 1, fp) == 1) &&
+				 (fwrite(&keylength, 1, 1, fp) == 1) &&
+				 (fwrite(&vallength, 4, 1, fp) == 1) &&
+				 (fwrite(p.first.data(), keylength, 1, fp) == 1) &&
+				 (vallength == 0 || fwrite(p.second.data(), vallength, 1, fp) == 1);
+		}
+	}
+
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) {
+		unlink(tmppath.c_str());
+		return -1;
+	}
+	return 0;
+}
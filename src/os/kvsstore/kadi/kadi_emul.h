@@ -0,0 +1,118 @@
+/*
+ * kadi_emul.h
+ *
+ *  In-process KV-SSD emulator.
+ *
+ *  The emulator sits behind KADI at the ioctl boundary: every
+ *  nvme_passthru_kv_cmd that KADI would send to /dev/nvmeXnY is executed
+ *  against in-memory keyspaces instead, so the command formats, the oplog
+ *  page layout and the aio completion path (NVME_IOCTL_GET_AIOEVENT) are
+ *  exactly the ones used with a real device.
+ *
+ *  It is selected by a device path of the form
+ *      emul:              - volatile, memory only
+ *      emul:<file>        - memory, loaded from/saved to <file> at open/close
+ */
+
+#ifndef SRC_API_KADI_EMUL_H_
+#define SRC_API_KADI_EMUL_H_
+
+#include "kadi_types.h"
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define KADI_EMUL_SCHEME "emul:"
+
+struct kadi_emul_param {
+	uint32_t read_lat_us   = 0;		// base service time of a retrieve/exist
+	uint32_t write_lat_us  = 0;		// base service time of a store/batch
+	uint32_t delete_lat_us = 0;		// base service time of a delete
+	uint32_t iter_lat_us   = 0;		// base service time of an iterator command
+	double   xfer_us_per_kb = 0;	// transfer cost added per KB of value
+	uint32_t queue_depth   = MAX_AIO_EVENTS;	// number of commands serviced in parallel
+	uint64_t capacity      = (1ull << 40);		// reported namespace size in bytes
+};
+
+class kadi_emul {
+	typedef std::chrono::high_resolution_clock emul_clock;
+	typedef std::map<std::string, std::string> keyspace_t;
+
+	struct iter_state {
+		std::vector<std::string> keys;
+		size_t pos = 0;
+	};
+
+	static constexpr int OPLOG_KEYSPACE = 7;
+
+	const kadi_emul_param param;
+	int handle_fd = -1;
+	int keyspace_sorted = 0;
+	std::string backing_file;
+
+	std::mutex lock;
+	std::map<int, keyspace_t> keyspaces;
+	uint64_t bytes_used = 0;
+
+	// oplog page being filled for the sorted keyspace
+	std::string oplog_page;
+	uint32_t oplog_count = 0;
+	uint64_t oplog_seq = 0;
+
+	std::map<int, iter_state> iterators;
+	int next_iter_handle = 1;
+
+	// latency model: completion time of the last command on each channel
+	std::vector<emul_clock::time_point> channels;
+	struct completion_queue {
+		int eventfd = -1;
+		std::multimap<emul_clock::time_point, struct nvme_aioevent> events;
+	};
+	std::map<int, completion_queue> cqs;	// by aio context id
+	int next_ctxid = 0;
+	std::condition_variable cq_cond;
+
+public:
+	explicit kadi_emul(const kadi_emul_param &p);
+	~kadi_emul();
+
+	static bool is_emul_path(const std::string &devpath) {
+		return devpath.compare(0, sizeof(KADI_EMUL_SCHEME) - 1, KADI_EMUL_SCHEME) == 0;
+	}
+
+	int open(const std::string &devpath, int keyspace_sorted_);
+	void close();
+
+	// a file descriptor that stands for the emulated device
+	int get_fd() const { return handle_fd; }
+
+	// executes an NVME_IOCTL_* request with the semantics of the KV-SSD driver
+	int ioctl(unsigned long request, void *arg);
+
+private:
+	int submit_sync(struct nvme_passthru_kv_cmd &cmd);
+	int submit_aio(struct nvme_passthru_kv_cmd &cmd);
+	int get_aioevents(struct nvme_aioevents &events);
+	int identify(struct nvme_passthru_cmd &cmd);
+
+	uint16_t _execute(struct nvme_passthru_kv_cmd &cmd, uint32_t &result, uint32_t &bytes);
+	uint16_t _store(int ksid, const std::string &key, const char *value, uint32_t length, uint32_t offset, bool logging);
+	uint16_t _retrieve(int ksid, const std::string &key, char *buf, uint32_t buflen, uint32_t offset, uint32_t &result);
+	uint16_t _remove(int ksid, const std::string &key, bool check_exist);
+	uint16_t _iter_open(struct nvme_passthru_kv_cmd &cmd, uint32_t &result);
+	uint16_t _iter_read(struct nvme_passthru_kv_cmd &cmd, uint32_t &result);
+	uint16_t _batch(struct nvme_passthru_kv_cmd &cmd, uint32_t &result);
+
+	void _log(int optype, int ksid, const std::string &key);
+	void _seal_oplog_page();
+
+	emul_clock::time_point _schedule(uint8_t opcode, uint32_t bytes);
+
+	int _load(const std::string &path);
+	int _save(const std::string &path);
+};
+
+#endif /* SRC_API_KADI_EMUL_H_ */
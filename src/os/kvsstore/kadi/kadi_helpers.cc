@@ -29,7 +29,7 @@ using namespace std;
 
 #define EPOLL_DEV 1
 
-int ioevent_listener::init(int fd) {
+int ioevent_listener::init(int fd, kadi_emul *emul) {
 	int efd = eventfd(0,0);
 	if (efd < 0) {
 		derr << "fail to create an event " << dendl;
@@ -54,7 +54,8 @@ int ioevent_listener::init(int fd) {
 	aioctx.ctxid   = 0;
 	aioctx.eventfd = efd;
 
-    if (ioctl(fd, NVME_IOCTL_SET_AIOCTX, &aioctx) < 0) {
+    int ret = (emul)? emul->ioctl(NVME_IOCTL_SET_AIOCTX, &aioctx) : ioctl(fd, NVME_IOCTL_SET_AIOCTX, &aioctx);
+    if (ret < 0) {
         derr <<  "fail to set_aioctx" << dendl;
         return -1;
     }
@@ -62,8 +63,11 @@ int ioevent_listener::init(int fd) {
 	return aioctx.ctxid;
 }
 
-void ioevent_listener::close(int fd) {
-    ioctl(fd, NVME_IOCTL_DEL_AIOCTX, &aioctx);
+void ioevent_listener::close(int fd, kadi_emul *emul) {
+    if (emul)
+        emul->ioctl(NVME_IOCTL_DEL_AIOCTX, &aioctx);
+    else
+        ioctl(fd, NVME_IOCTL_DEL_AIOCTX, &aioctx);
     ::close((int)aioctx.eventfd);
 
 	#ifdef EPOLL_DEV
@@ -223,16 +227,33 @@ bool iterbuf_reader::nextkey(int *optype, void **key, int *length)
     return true;
 }
 
+cmd_ctx_manager::cmd_ctx_manager() {
+    for (uint32_t i = 0; i < NUM_CTXS; i++) {
+        ctxs[i].index = i;
+        next_free[i].store((i + 1 < NUM_CTXS)? i + 1 : NIL, std::memory_order_relaxed);
+    }
+    free_head.store(0, std::memory_order_release);
+}
+
 aio_cmd_ctx* cmd_ctx_manager::get_cmd_ctx(const kv_cb& cb) {
-    aio_cmd_ctx *p = new aio_cmd_ctx();
-    p->post_fn   = cb.post_fn;
-    p->post_data = cb.private_data;
-    {
-        std::unique_lock<std::mutex> lock (cmdctx_lock);
-        p->index     = get_cmd_index();
-        pending_cmdctxs.insert(std::make_pair(p->index, p));
+    uint64_t head = free_head.load(std::memory_order_acquire);
+    while (true) {
+        const uint32_t slot = (uint32_t)head;
+        if (slot == NIL) {
+            // queue is full: wait for completions to return slots
+            std::this_thread::yield();
+            head = free_head.load(std::memory_order_acquire);
+            continue;
+        }
+        const uint32_t next = next_free[slot].load(std::memory_order_relaxed);
+        if (free_head.compare_exchange_weak(head, make_head(head, next),
+                    std::memory_order_acquire, std::memory_order_acquire)) {
+            aio_cmd_ctx *p = &ctxs[slot];
+            p->post_fn   = cb.post_fn;
+            p->post_data = cb.private_data;
+            return p;
+        }
     }
-	return p;
 }
 
 ///
@@ -17,8 +17,11 @@
 #include <sys/time.h>
 #include <chrono>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
 
 class KADI;
+class kadi_emul;
 
 class aio_cmd_ctx {
 public:
@@ -55,39 +58,39 @@ typedef struct {
     }
 } aio_cmd_ctx;
 */
+// a fixed slab of MAX_AIO_EVENTS command contexts. The slot number is the
+// request id of the command, so a completion finds its context without a lookup.
+// Free slots are kept in a lock-free stack; the head is tagged with a counter
+// to avoid ABA.
 class cmd_ctx_manager {
-	std::mutex cmdctx_lock;
-	std::condition_variable cmdctx_cond;
-	std::vector<aio_cmd_ctx *>   free_cmdctxs;
-	std::map<int, aio_cmd_ctx *> pending_cmdctxs;
-	uint64_t index;
-public:
-	cmd_ctx_manager(): index(0) {}
+	static constexpr uint32_t NUM_CTXS = MAX_AIO_EVENTS;
+	static constexpr uint32_t NIL = UINT32_MAX;
+
+	aio_cmd_ctx ctxs[NUM_CTXS];
+	std::atomic<uint32_t> next_free[NUM_CTXS];
+	std::atomic<uint64_t> free_head;	// [tag:32 | slot:32]
 
-	uint64_t get_cmd_index() {
-	    uint64_t r = index++;
-	    if (index == UINT64_MAX) { index = 0; }
-	    return r;
+	static inline uint64_t make_head(uint64_t head, uint32_t slot) {
+		return (((head >> 32) + 1) << 32) | slot;
 	}
+public:
+	cmd_ctx_manager();
 
+	// waits for a free slot if all commands are in flight
 	aio_cmd_ctx* get_cmd_ctx(const kv_cb& cb);
 
     inline aio_cmd_ctx* get_pending_cmdctx(uint64_t reqid) {
-        std::unique_lock<std::mutex> lock (cmdctx_lock);
-        auto p = pending_cmdctxs.find(reqid);
-        if (p == pending_cmdctxs.end()) {
-            return 0;
-        }
-        else {
-            aio_cmd_ctx* ctx = p->second;
-            pending_cmdctxs.erase(p);
-            return ctx;
-        }
+        return (reqid < NUM_CTXS)? &ctxs[reqid] : 0;
     }
 
-    void release_cmd_ctx(aio_cmd_ctx *p)
+    inline void release_cmd_ctx(aio_cmd_ctx *p)
     {
-        delete p;
+        const uint32_t slot = p->index;
+        uint64_t head = free_head.load(std::memory_order_relaxed);
+        do {
+            next_free[slot].store((uint32_t)head, std::memory_order_relaxed);
+        } while (!free_head.compare_exchange_weak(head, make_head(head, slot),
+                        std::memory_order_release, std::memory_order_relaxed));
     }
 };
 
@@ -98,8 +101,8 @@ class ioevent_listener
 	struct epoll_event watch_events;
 	struct epoll_event list_of_events[1];
 public:
-	int init(int fd);
-	void close(int fd);
+	int init(int fd, kadi_emul *emul = nullptr);
+	void close(int fd, kadi_emul *emul = nullptr);
 	int poll(uint32_t timeout_us);
 };
 
@@ -4,17 +4,181 @@
  *  Created on: Nov 9, 2019
  *      Author: root
  */
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "kadi_nodepool.h"
 #include "kadi_bptree.h"
 
-bptree_pool::bptree_pool(KADI *adi_, int ksid_skp_, uint32_t prefix_, bptree_param *param_):
-adi(adi_), ksid_skp(ksid_skp_), prefix(prefix_), param(param_)
+///
+/// Node cache
+///
+
+uint64_t bptree_node_cache::open_snapshot(uint32_t prefix) {
+	std::lock_guard<std::mutex> l(lock);
+	tree_state &t = trees[prefix];
+	t.snapshots.insert(t.gen);
+	return t.gen;
+}
+
+void bptree_node_cache::close_snapshot(uint32_t prefix, uint64_t gen) {
+	std::lock_guard<std::mutex> l(lock);
+	tree_state &t = trees[prefix];
+	auto it = t.snapshots.find(gen);
+	if (it != t.snapshots.end()) {
+		t.snapshots.erase(it);
+	}
+	_trim_retired(t);
+}
+
+bptree_page_ref bptree_node_cache::_find(entry &e, uint64_t gen) {
+	for (const bptree_page_ref &v : e.versions) {
+		if (v->from <= gen && gen < v->to) return v;
+	}
+	return 0;
+}
+
+bptree_page_ref bptree_node_cache::get(uint32_t prefix, const bp_addr_t &addr, uint64_t gen, bool &found) {
+	std::lock_guard<std::mutex> l(lock);
+	auto it = pages.find(page_key_t(prefix, addr));
+	if (it == pages.end()) {
+		found = false;
+		misses++;
+		return 0;
+	}
+	entry &e = it->second;
+	if (e.current) {
+		lru.splice(lru.begin(), lru, e.lru);
+	}
+	found = true;
+	hits++;
+	// no image in the generation: the node did not exist then
+	return _find(e, gen);
+}
+
+bptree_page_ref bptree_node_cache::add(uint32_t prefix, const bp_addr_t &addr, uint64_t gen, const char *data, int length) {
+	std::lock_guard<std::mutex> l(lock);
+	const page_key_t key(prefix, addr);
+	auto it = pages.find(key);
+	if (it != pages.end()) {
+		// published while it was being read: the device may already have the newer image
+		return _find(it->second, gen);
+	}
+	if (length <= 0) return 0;
+
+	// valid from the start: a node changed since the oldest snapshot would have a retired image
+	entry &e = pages[key];
+	e.versions.push_front(std::make_shared<bptree_cached_page>(0, data, length));
+	lru.push_front(key);
+	e.lru = lru.begin();
+	e.current = true;
+	bytes += length;
+	_trim();
+	return e.versions.front();
+}
+
+void bptree_node_cache::publish(uint32_t prefix, std::unordered_map<bp_addr_t, kv_indexnode*> &nodes,
+                                std::unordered_map<bp_addr_t, bptree_page_ref> &pinned) {
+	std::lock_guard<std::mutex> l(lock);
+	tree_state &t = trees[prefix];
+	const uint64_t gen = t.gen + 1;
+
+	for (auto &p : nodes) {
+		kv_indexnode *n = p.second;
+		if (n->op != NODE_OP_WRITE && n->op != NODE_OP_DELETE) continue;
+
+		const page_key_t key(prefix, n->addr);
+		entry &e = pages[key];
+		_retire(prefix, key, e, gen);
+		if (n->op == NODE_OP_WRITE) {
+			// pinned until the pool has stored it
+			bptree_page_ref v = std::make_shared<bptree_cached_page>(gen, n->buffer, n->size());
+			e.versions.push_front(v);
+			lru.push_front(key);
+			e.lru = lru.begin();
+			e.current = true;
+			bytes += v->data.size();
+			pinned[n->addr] = v;
+		} else if (e.versions.empty()) {
+			pages.erase(key);
+		}
+	}
+
+	t.gen = gen;
+	_trim_retired(t);
+	_trim();
+}
+
+// the current image of the node stops being valid at gen
+void bptree_node_cache::_retire(uint32_t prefix, const page_key_t &key, entry &e, uint64_t gen) {
+	if (!e.current) return;
+	lru.erase(e.lru);
+	e.current = false;
+
+	bptree_page_ref v = e.versions.front();
+	v->to = gen;
+	trees[prefix].retired.emplace_back(key, v);
+}
+
+// drops the retired images no open snapshot can see
+void bptree_node_cache::_trim_retired(tree_state &t) {
+	for (auto it = t.retired.begin(); it != t.retired.end(); ) {
+		const bptree_page_ref &v = it->second;
+		auto s = t.snapshots.lower_bound(v->from);
+		if (s != t.snapshots.end() && *s < v->to) {
+			++it;
+			continue;
+		}
+
+		auto pe = pages.find(it->first);
+		if (pe != pages.end()) {
+			pe->second.versions.remove(v);
+			if (pe->second.versions.empty()) {
+				pages.erase(pe);
+			}
+		}
+		bytes -= v->data.size();
+		it = t.retired.erase(it);
+	}
+}
+
+// evicts current images that no pool holds
+void bptree_node_cache::_trim() {
+	auto it = lru.end();
+	while (bytes > max_bytes && it != lru.begin()) {
+		--it;
+		entry &e = pages[*it];
+		const bptree_page_ref &v = e.versions.front();
+		if (v.use_count() > 1) continue;
+		// a snapshot still sees a retired image: without the current one the entry
+		// would tell the latest readers that the node was deleted
+		if (e.versions.size() > 1) continue;
+
+		bytes -= v->data.size();
+		e.versions.pop_front();
+		e.current = false;
+		if (e.versions.empty()) {
+			pages.erase(*it);
+		}
+		it = lru.erase(it);
+	}
+}
+
+///
+/// Node pool
+///
+
+bptree_pool::bptree_pool(KADI *adi_, int ksid_skp_, uint32_t prefix_, bptree_param *param_,
+                         bptree_node_cache *cache_, bool snapshot):
+cache(cache_), snap(BPTREE_LATEST), adi(adi_), ksid_skp(ksid_skp_), prefix(prefix_), param(param_)
 {
     FTRACE
+	if (cache && snapshot) {
+		snap = cache->open_snapshot(prefix);
+	}
 	meta = _fetch_meta();
     //TR << "meta = " << meta ;
-	//next_pgid = meta->get_last_pgid();
+	next_pgid = std::max(meta->get_last_pgid(), bptree_first_pgid(prefix));
 }
 void bptree_pool::remove_all() {
     for (const auto &pair : pool) {
@@ -24,10 +188,44 @@ void bptree_pool::remove_all() {
             cmd.key_length = fill_cmdkey_for_index_nodes(cmd.key, p->addr);
         });*/
     }
+    if (cache) {
+        cache->publish(prefix, pool, pinned);
+    }
 
     _flush_dirtylist();
 }
 
+// removes the meta: the tree is empty from now on. returns the end of the page ids it had
+// allocated, which drop_pages() removes
+uint64_t bptree_pool::drop_meta() {
+	const uint64_t end = next_pgid;
+	meta->set_invalid();
+	if (cache) {
+		cache->publish(prefix, pool, pinned);
+	}
+	_flush_dirtylist();
+	next_pgid = bptree_first_pgid(prefix);
+	return end;
+}
+
+// removes the pages [from, to) of a dropped tree, loaded or not
+void bptree_pool::drop_pages(uint64_t from, uint64_t to) {
+	for (uint64_t pgid = from; pgid < to; pgid++) {
+		for (const bp_addr_t addr : { create_treenode_addr(pgid), create_datanode_addr(pgid) }) {
+			auto it = pool.find(addr);
+			if (it == pool.end()) {
+				pool[addr] = new kv_deadnode(addr);
+			} else {
+				it->second->set_invalid();
+			}
+		}
+	}
+	if (cache) {
+		cache->publish(prefix, pool, pinned);
+	}
+	_flush_dirtylist();
+}
+
 void bptree_pool::remove_treenode(bptree_node *node) {
 	node->set_invalid();
 }
@@ -41,7 +239,7 @@ bptree_node *bptree_pool::create_tree_node(bool leaf) {
 	bptree_node *n = new bptree_node(addr,
 			(char*)malloc(param->treenode_block_size),
 			param->treenode_block_size, true, leaf,
-			param->max_order, param->max_entries);
+			param->max_order, param->max_entries, param->hint_size);
 
 	pool[addr] = n;
 	return n;
@@ -68,6 +266,26 @@ KvsSlottedPage *bptree_pool::create_data_node() {
 	return n;
 }
 
+// reads a node through the cache; returns the length of the node, 0 if it does not exist
+int bptree_pool::_read_node(const bp_addr_t &addr, void *buffer, uint32_t buffersize) {
+	if (cache == 0) {
+		return read_page(addr, buffer, buffersize);
+	}
+
+	bool found;
+	bptree_page_ref v = cache->get(prefix, addr, snap, found);
+	if (!found) {
+		const int nread = read_page(addr, buffer, buffersize);
+		v = cache->add(prefix, addr, snap, (const char*)buffer, nread);
+	}
+	if (!v) return 0;
+
+	const uint32_t length = std::min<uint32_t>(v->data.size(), buffersize);
+	memcpy(buffer, v->data.data(), length);
+	pinned[addr] = v;
+	return length;
+}
+
 void bptree_pool::flush(const bp_addr_t &newrootaddr) {
     //if (newrootaddr == invalid_key_addr) return;
 	meta->set_next_pgid(next_pgid);
@@ -76,6 +294,11 @@ void bptree_pool::flush(const bp_addr_t &newrootaddr) {
     meta->isnew = false;
 	meta->set_dirty();
 
+	// readers see the new nodes before the device has them
+	if (cache) {
+		cache->publish(prefix, pool, pinned);
+	}
+
     //TR << "Nodepool Flush - set meta - rootaddr = " << newrootaddr << ", get_root_addr = " << meta->get_root_addr() << ", meta addr = " << meta->addr;
 	_flush_dirtylist();
 }
@@ -92,7 +315,8 @@ bptree_meta *bptree_pool::_fetch_meta() {
 
     n = new bptree_meta(addr);
 
-	if (read_page(addr, n->get_raw_buffer(), bptree_meta::META_SIZE) != bptree_meta::META_SIZE){
+	const int nread = _read_node(addr, n->get_raw_buffer(), bptree_meta::META_SIZE);
+	if (nread != bptree_meta::META_SIZE && nread != bptree_meta::META_SIZE_V1) {
 		// new meta
         //TRI << "create new metadata " << desc(addr) ;
         n->init(prefix);
@@ -122,12 +346,12 @@ kv_indexnode *bptree_pool::_fetch_node(const bp_addr_t &addr) {
 	if (/*bpaddr_pageid(addr) <= meta->get_last_pgid() && */!meta->isnew) {
 
 		void *data = malloc(param->datanode_block_size);
-		int nread = read_page(addr, data, param->datanode_block_size);
+		int nread = _read_node(addr, data, param->datanode_block_size);
 		if (nread > 0) {
 			kv_indexnode *n;
 			const int off = bpaddr_slotid(addr);
 			if (off == NODE_TYPE_TREE) {
-				n = new bptree_node(addr, (char*)data, param->treenode_block_size, false, true, param->max_order, param->max_entries);
+				n = new bptree_node(addr, (char*)data, param->treenode_block_size, false, true, param->max_order, param->max_entries, param->hint_size);
             }
 			else if (off == NODE_TYPE_DATA){
                 n = new KvsSlottedPage(addr, (char *) data, param->datanode_block_size, false);
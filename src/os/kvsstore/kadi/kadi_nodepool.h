@@ -8,8 +8,16 @@
 #ifndef SRC_KADI_KADI_NODEPOOL_H_
 #define SRC_KADI_KADI_NODEPOOL_H_
 
+#include <algorithm>
 #include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
 #include <unordered_map>
+#include <vector>
 #include "kadi_cmds.h"
 #include "kadi_types.h"
 #include "../kvsstore_debug.h"
@@ -54,18 +62,26 @@ struct bptree_param
 	int datanode_block_size;
 	int max_order;
 	int max_entries;
+	int hint_size = 0;	// bytes of the key kept next to each key address in tree nodes
 
 	const static int fragment_size  = 64;
 	const static int fragment_shift = 6;
 	const static int datanode_header_size = sizeof(struct datanode_header);
+	const static int key_hint_size  = 16;
 
 	bptree_param(int block_size_):
 		treenode_block_size(block_size_),
 		datanode_block_size(block_size_)
 	{
+		set_hints(false);
+	}
+
+	// trees created before key hints have tree nodes without them
+	void set_hints(bool enabled) {
 		const int tree_node_body_size = (treenode_block_size - sizeof(bptree_node_header));
-		max_order   = tree_node_body_size / (sizeof(bp_addr_t) + sizeof(bp_addr_t));
-		max_entries = tree_node_body_size / (sizeof(bp_addr_t));	// no value
+		hint_size   = (enabled)? key_hint_size : 0;
+		max_order   = tree_node_body_size / (sizeof(bp_addr_t) + sizeof(bp_addr_t) + hint_size);
+		max_entries = tree_node_body_size / (sizeof(bp_addr_t) + hint_size);	// no value
 	}
 };
 
@@ -93,10 +109,15 @@ static inline bp_addr_t create_key_addr(const uint64_t pageid, const uint16_t sl
 
 
 
-static inline bp_addr_t create_metanode_addr(int treeindex)  {
+static inline bp_addr_t create_metanode_addr(uint32_t treeindex)  {
 	return create_key_addr(treeindex, NODE_TYPE_META);
 }
 
+/// trees sharing a key space number their pages from (tree index << 24)
+static inline uint64_t bptree_first_pgid(uint32_t treeindex) {
+	return std::max<uint64_t>(2, (uint64_t)(treeindex & 0xFFFFFF) << 24);
+}
+
 static inline bp_addr_t create_treenode_addr(const uint64_t pageid)  {
 	return create_key_addr(pageid,NODE_TYPE_TREE);
 }
@@ -177,6 +198,93 @@ public:
 	virtual void dump() = 0;
 };
 
+/// a page that is only removed from the device
+class kv_deadnode: public kv_indexnode {
+public:
+	kv_deadnode(const bp_addr_t &addr_): kv_indexnode(addr_) {
+		set_invalid();
+	}
+	void dump() override {}
+};
+
+/// an image of an index node, valid in the tree generations [from, to)
+struct bptree_cached_page {
+	uint64_t from;
+	uint64_t to;
+	std::string data;
+
+	bptree_cached_page(uint64_t from_, const char *data_, int length):
+		from(from_), to(UINT64_MAX), data(data_, length) {}
+};
+
+typedef std::shared_ptr<bptree_cached_page> bptree_page_ref;
+
+/// generation of the latest version of a tree, for its writer
+const static uint64_t BPTREE_LATEST = UINT64_MAX - 1;
+
+///
+/// Store-wide cache of index nodes, shared by the indexer and the iterators.
+///
+/// Each flush of a tree publishes the nodes it changed as a new generation.
+/// Readers open a snapshot of the current generation and keep seeing the node
+/// images of that generation: the images a flush replaces are retired, and kept
+/// until no open snapshot needs them. Current images are evicted in LRU order
+/// once the cache is over its size, unless a node pool still holds them.
+///
+class bptree_node_cache {
+	typedef std::pair<uint32_t, bp_addr_t> page_key_t;
+
+	struct entry {
+		std::list<bptree_page_ref> versions;    ///< newest first
+		std::list<page_key_t>::iterator lru;
+		bool current = false;                   ///< versions.front() is current and in the lru
+	};
+
+	struct tree_state {
+		uint64_t gen = 0;
+		std::multiset<uint64_t> snapshots;
+		std::list<std::pair<page_key_t, bptree_page_ref>> retired;
+	};
+
+	std::mutex lock;
+	uint64_t max_bytes;
+	uint64_t bytes = 0;
+	std::map<page_key_t, entry> pages;
+	std::list<page_key_t> lru;                  ///< current images, most recently used first
+	std::map<uint32_t, tree_state> trees;
+
+public:
+	std::atomic<uint64_t> hits = {0};
+	std::atomic<uint64_t> misses = {0};
+
+	explicit bptree_node_cache(uint64_t max_bytes_): max_bytes(max_bytes_) {}
+
+	uint64_t get_bytes() {
+		std::lock_guard<std::mutex> l(lock);
+		return bytes;
+	}
+
+	uint64_t open_snapshot(uint32_t prefix);
+	void close_snapshot(uint32_t prefix, uint64_t gen);
+
+	/// the image of the node in the generation; sets found to false if the cache does not know it
+	bptree_page_ref get(uint32_t prefix, const bp_addr_t &addr, uint64_t gen, bool &found);
+
+	/// caches an image read from the device and returns the image of the node in the
+	/// generation, which may be an older one if the node was changed in the meantime
+	bptree_page_ref add(uint32_t prefix, const bp_addr_t &addr, uint64_t gen, const char *data, int length);
+
+	/// makes the changed nodes of a pool the next generation of the tree
+	void publish(uint32_t prefix, std::unordered_map<bp_addr_t, kv_indexnode*> &nodes,
+	             std::unordered_map<bp_addr_t, bptree_page_ref> &pinned);
+
+private:
+	bptree_page_ref _find(entry &e, uint64_t gen);
+	void _retire(uint32_t prefix, const page_key_t &key, entry &e, uint64_t gen);
+	void _trim_retired(tree_state &t);
+	void _trim();
+};
+
 class bptree_meta;
 class bptree_node;
 class KvsSlottedPage;
@@ -184,6 +292,9 @@ class KvsSlottedPage;
 class bptree_pool {
 public:
 	std::unordered_map<bp_addr_t, kv_indexnode*> pool;
+	bptree_node_cache *cache;
+	uint64_t snap;      ///< generation the pool reads, BPTREE_LATEST for the writer
+	std::unordered_map<bp_addr_t, bptree_page_ref> pinned;   ///< cached images the pool was built from
 
 	KADI *adi;
 	int ksid_skp;
@@ -194,7 +305,8 @@ public:
 	uint64_t   next_pgid;	// NODE ID 0 is dedicated for meta
 
 public:
-	bptree_pool(KADI *adi_, int ksid_skp_, uint32_t prefix_, bptree_param *param_);
+	bptree_pool(KADI *adi_, int ksid_skp_, uint32_t prefix_, bptree_param *param_,
+	            bptree_node_cache *cache_ = 0, bool snapshot = false);
 
 
 
@@ -203,6 +315,10 @@ public:
 			delete p.second;
 		}
 		pool.clear();
+		pinned.clear();
+		if (cache && snap != BPTREE_LATEST) {
+			cache->close_snapshot(prefix, snap);
+		}
 	}
 
 	bptree_meta *get_meta() { return meta; }
@@ -219,6 +335,8 @@ public:
 	bool fetch_key(const bp_addr_t &addr, char **key, int &length);
 	void flush(const bp_addr_t &newrootaddr);
     void remove_all();
+	uint64_t drop_meta();
+	void drop_pages(uint64_t from, uint64_t to);
 
 private:
 
@@ -228,6 +346,7 @@ private:
 
 	bptree_meta *_fetch_meta();
 	kv_indexnode *_fetch_node(const bp_addr_t &addr);
+	int _read_node(const bp_addr_t &addr, void *buffer, uint32_t buffersize);
 
 
 
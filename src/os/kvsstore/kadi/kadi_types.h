@@ -187,6 +187,8 @@ typedef struct {
     kv_result batch_results[8];
     uint64_t latency;
 	uint64_t bytes_transferred;
+
+    char inline_key[KVCMD_INLINE_KEY_MAX];   ///< copy of an inline key, key.key points here
 } kv_io_context;
 
 
@@ -194,12 +196,13 @@ typedef struct {
 typedef struct {
     void (*post_fn)(kv_io_context &op, void *post_data);   ///< asynchronous notification callback (valid only for async I/O)
     void *private_data;       ///< private data address which can be used in callback (valid only for async I/O)
+    int qid = 0;              ///< queue pair the command is submitted to (valid only for async I/O)
 } kv_cb;
 
 
 struct sub_cmd_attribute
 {
-  __u8	opcode;          // DW0  support only 0x81 and 0xA0
+  __u8	opcode;          // DW0  support only 0x81 and 0xA1
   __u8	keySize;         // DW0 [15:08] Keys size
   __u8	reservedDw0[2];  // DW0 [31:16] Reserved
   __u32	valuseSize;      // DW1  Value size
@@ -242,6 +245,13 @@ public:
 
 	~KvBatchCmd() { free(payload);	}
 
+	// empties the command so that its payload buffer can be reused
+	inline void reset() {
+		subcmd_index = 0;
+		subcmd_offset = 0;
+		memset(payload, 0, sizeof(batch_cmd_head));
+	}
+
 	inline bool isempty() { return subcmd_index == 0;	}
 	inline bool isfull()  { return subcmd_index == MAX_SUBCOMMANDS;	}
 
@@ -255,6 +265,7 @@ public:
 	bool add_store_cmd(int nsid, int option,
 			const std::function< uint8_t (char*) > &construct_key,
 			const std::function< uint32_t (char*) > &construct_value);
+	bool add_delete_cmd(int nsid, const char *key, uint8_t key_length);
 	std::string dump();
 };
 
@@ -270,6 +281,19 @@ public:
 			delete cmd;
 		}
 	}
+	// keeps one command buffer for the next batch and frees the others
+	void reset() {
+		if (batch == 0 && !batchcmds.empty()) {
+			batch = batchcmds.front();
+			batchcmds.erase(batchcmds.begin());
+		}
+		for (KvBatchCmd *cmd : batchcmds) {
+			delete cmd;
+		}
+		batchcmds.clear();
+		if (batch) batch->reset();
+	}
+
 	size_t size() {
 		size_t s = batchcmds.size();
 		if (batch != 0) {
@@ -301,6 +325,7 @@ public:
 
 	int batch_store(int nsid, int option, const void *key, uint8_t key_length, const void *value, uint32_t value_length);
 	int batch_store(int nsid, int option, const void *value, uint32_t value_length, const std::function< uint8_t (char*) > &construct_key);
+	int batch_delete(int nsid, const void *key, uint8_t key_length);
 
 	//KeyFunc const std::function< uint8_t (char*) > ValueFunc const std::function< uint32_t (char*) >
 	template<typename KeyFunc, typename ValueFunc>
@@ -382,8 +407,18 @@ struct oplog_info {
 	std::vector<oplog_page*> oplogpage_dir;
 	std::vector<std::pair<void *, int>> oplogpage_keys;	// keys in the read buffers
 	oploglist_t oplog_list;
+	uint32_t max_pages = 0;			// in:  read at most max_pages oldest pages (0 = all)
+	uint32_t pages_found = 0;		// out: pages in the oplog directory
+	uint64_t last_sequence = 0;		// out: highest page sequence read
 	oplog_info(uint8_t spaceid_, uint32_t prefix_):
 		spaceid(spaceid_), prefix(prefix_) {}
+
+	~oplog_info() {
+		for (oplog_page *p : oplogpage_dir) delete p;
+		for (const auto &groups : oplog_list) {
+			for (const auto &page : groups.second) free(page.second.first);
+		}
+	}
 };
 
 template<typename T>
@@ -17,6 +17,7 @@
 #define GROUP_PREFIX_JOURNAL  0x3
 #define GROUP_PREFIX_OMAP     0x4
 #define GROUP_PREFIX_OMAPBLK  0x5
+#define GROUP_PREFIX_BLOB     0x6
 
 //# encoders & decoders
 //----------------------
@@ -67,6 +68,12 @@ struct __attribute__((__packed__)) kvs_object_key
     // followed by name
 };
 
+struct __attribute__((__packed__)) kvs_blob_key
+{
+    uint8_t          group;                        //1B
+    uint64_t         sid;                          //8B - 9 Bytes
+};
+
 struct __attribute__((__packed__)) kvs_journal_key
 {
     uint8_t          group;                        // 1B
@@ -133,6 +140,21 @@ inline uint8_t construct_kvsbkey_impl(void *buffer) {
 	return 4;
 }
 
+inline uint8_t construct_kvindexkey_impl(void *buffer) {
+	static const char ckptkey[5] = "kvix";
+	memcpy(buffer, ckptkey, 4);
+	return 4;
+}
+
+// Shared Blob Key
+// -------------------
+inline uint8_t construct_blobkey_impl(void *buffer, const uint64_t sid) {
+	kvs_blob_key* key = (kvs_blob_key*)buffer;
+	key->group = GROUP_PREFIX_BLOB;
+	key->sid = sid;
+	return sizeof(kvs_blob_key);
+}
+
 // Journal Key
 // -------------------
 inline uint8_t construct_journalkey_impl(void *buffer, const uint64_t index) {
@@ -235,7 +257,8 @@ inline bool construct_onode_ghobject_t(CephContext* cct, kv_key &key, ghobject_t
 }
 // ghobject -> key
 
-inline uint8_t construct_object_key(CephContext* cct, const ghobject_t& oid, void *keybuffer, uint16_t blockindex = 0) {
+// data keys of objects created with a data version carry it after the name
+inline uint8_t construct_object_key(CephContext* cct, const ghobject_t& oid, void *keybuffer, uint16_t blockindex = 0, uint64_t version = 0) {
     struct kvs_object_key* kvskey = (struct kvs_object_key*)keybuffer;
     char *name_loc = (char*)keybuffer + sizeof(kvs_object_key);
 
@@ -247,23 +270,47 @@ inline uint8_t construct_object_key(CephContext* cct, const ghobject_t& oid, voi
     kvskey->genid = (uint64_t)oid.generation;
     kvskey->blockid = blockindex;
 
-    const char *pos = encode_nspace_oid(oid.hobj.nspace, oid.hobj.get_key(), oid.hobj.oid.name, name_loc);
-    const int total_keylength = (pos - name_loc) + sizeof(kvs_object_key);
+    char *pos = encode_nspace_oid(oid.hobj.nspace, oid.hobj.get_key(), oid.hobj.oid.name, name_loc);
+    const int total_keylength = (pos - name_loc) + sizeof(kvs_object_key) + ((version)? sizeof(uint64_t):0);
 
     if (total_keylength > KVKEY_MAX_SIZE) {
     	std::cerr << "name is too long" << std::endl;
         ceph_abort();
     }
+    if (version) {
+        memcpy(pos, &version, sizeof(uint64_t));
+    }
 
     //TR << "construct object key: oid=" << oid << ", keybuffer = " << print_kvssd_key(keybuffer, total_keylength) ;
     return total_keylength;
 }
 
+// data key of a chunk, given the data key of chunk 0 of the same object
+inline uint8_t construct_chunk_key(void *keybuffer, const std::string &prefix, uint16_t blockindex) {
+    memcpy(keybuffer, prefix.data(), prefix.length());
+    ((struct kvs_object_key*)keybuffer)->blockid = blockindex;
+    return prefix.length();
+}
+
 inline uint32_t hash_object_group_id(const uint8_t  isonode,const int8_t shardid, const uint64_t poolid) {
 	struct kvs_key_header hdr = { GROUP_PREFIX_DATA, isonode, shardid, poolid };
 	return ceph_str_hash_linux((char*)&hdr, sizeof(struct kvs_key_header));
 }
 
+// onode index partition of a pool shard: temporary objects go with their pool, and pools
+// the partition id cannot hold stay in the global onode index (GROUP_PREFIX_ONODE)
+inline uint32_t get_onode_partition(uint8_t shardid, uint64_t poolid) {
+    int64_t pool = int64_t(poolid - 0x8000000000000000ull);
+    if (pool <= -2) pool = -2 - pool;
+    if (pool < 0 || pool >= 0xFFFF) return GROUP_PREFIX_ONODE;
+    return ((uint32_t)(pool + 1) << 8) | shardid;
+}
+
+inline uint32_t get_onode_partition(const char *onodekey) {
+    const struct kvs_onode_key* kvskey = (const struct kvs_onode_key*)onodekey;
+    return get_onode_partition(kvskey->shardid, kvskey->poolid);
+}
+
 inline uint8_t construct_onode_key(CephContext* cct, const ghobject_t& oid, void *keybuffer) {
     struct kvs_onode_key* kvskey = (struct kvs_onode_key*)keybuffer;
     char *name_loc = (char*)keybuffer + sizeof(kvs_onode_key);
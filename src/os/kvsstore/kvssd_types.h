@@ -5,6 +5,7 @@
 #ifndef CEPH_KVSSD_H
 #define CEPH_KVSSD_H
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <list>
@@ -14,9 +15,11 @@
 #include <string>
 #include <vector>
 #include <boost/container/small_vector.hpp>
+#include <boost/intrusive/list.hpp>
 #include "kadi/kadi_cmds.h"
 #include "kadi/kadi_types.h"
 #include "include/buffer.h"
+#include "common/ceph_time.h"
 #include "kvsstore_debug.h"
 
 
@@ -27,10 +30,27 @@
 
 typedef void (*aio_callback_t)(kv_io_context &op, void *post_data);
 
+/// told about every command a submission queue completes: opcode, key space, value size and latency
+typedef void (*kvcmd_observer_t)(void *arg, int opcode, int spaceid, uint32_t bytes, const ceph::timespan &lat);
+
 struct IoContext;
+struct kvaio_pool;
+struct kvsubmit_queue;
+
+/// a command sent to a device queue pair: a kvaio_t or a kvbatch_t
+struct kvcmd_t {
+    boost::intrusive::list_member_hook<> sq_item;   ///< parked in the submission queue
+    kvsubmit_queue *sq = nullptr;   ///< the submission queue the command went through
+    uint64_t cost = 0;              ///< bytes transferred
+    ceph::mono_time stamp;          ///< when the command was sent, if the queue is observed
+    const bool isbatch;
+
+    explicit kvcmd_t(bool b): isbatch(b) {}
+};
 
+typedef boost::intrusive::list<kvcmd_t, boost::intrusive::member_hook<kvcmd_t, boost::intrusive::list_member_hook<>, &kvcmd_t::sq_item> > kvcmd_list_t;
 
-struct kvaio_t {
+struct kvaio_t : public kvcmd_t {
     int opcode;
     int spaceid;
     kv_key_t keylength;
@@ -47,14 +67,285 @@ struct kvaio_t {
     bufferlist bl;  ///< write payload (so that it remains stable for duration)
     bufferlist *pbl; /// output bl - will contain bl
     uint64_t caller;
+    bool adaptive = false;  ///< sized by the read size hint of the key space, which learns from it
     std::string debug;
     boost::container::small_vector<iovec,4> iov;    // to retrieve an internal address from a bufferlist
 
-    kvaio_t(int opcode_, int spaceid_, aio_callback_t c, IoContext *p, void *db_):
-        opcode(opcode_), spaceid(spaceid_), keylength(0), value(0), vallength(0), valoffset(0), parent(p), cb_func(c), rval(-1000), db(db_)
+    kvaio_pool *pool;   ///< the pool the descriptor returns to
+    boost::intrusive::list_member_hook<> ioc_item;  ///< pending_aios or running_aios of the parent, or the free list of the pool
+
+    kvaio_t(int opcode_, int spaceid_, aio_callback_t c, IoContext *p, void *db_, kvaio_pool *pool_):
+        kvcmd_t(false), pool(pool_)
     {
+        init(opcode_, spaceid_, c, p, db_);
+    }
+
+    void init(int opcode_, int spaceid_, aio_callback_t c, IoContext *p, void *db_) {
+        opcode = opcode_; spaceid = spaceid_; keylength = 0;
+        value = 0; vallength = 0; valoffset = 0;
+        parent = p; cb_func = c; rval = -1000; db = db_;
+        pbl = 0; caller = 0; adaptive = false;
+    }
+};
+
+typedef boost::intrusive::list<kvaio_t, boost::intrusive::member_hook<kvaio_t, boost::intrusive::list_member_hook<>, &kvaio_t::ioc_item> > kvaio_list_t;
+
+/// a batch command carrying up to MAX_SUB_CMD small stores and deletes
+struct kvbatch_t : public kvcmd_t {
+    IoContext *parent;
+    KADI *kadi;
+    kv_batch_context batch;
+    std::vector<kvaio_t*> aios;
+    kvaio_pool *pool;
+
+    kvbatch_t(IoContext *p, KADI *k, kvaio_pool *pool_): kvcmd_t(true), parent(p), kadi(k), pool(pool_) {}
+};
+
+void batch_aio_callback(kv_io_context &op, void *post_data);
+void kvsubmit_callback(kv_io_context &op, void *post_data);
+
+/// admission control of a device queue pair: up to max_ops commands and max_bytes bytes
+/// are in flight. The commands beyond are parked in submission order and sent as the
+/// commands in flight complete, and so are the commands the device refuses while busy.
+struct kvsubmit_queue {
+    std::mutex lock;
+    kvcmd_list_t parked;            ///< waiting for room
+    KADI *kadi = 0;
+    int qid = 0;
+    uint32_t max_ops = MAX_AIO_EVENTS;
+    uint64_t max_bytes = 0;         ///< 0: no limit
+    uint32_t inflight_ops = 0;
+    uint64_t inflight_bytes = 0;
+    std::atomic<uint64_t> num_parked = {0};     ///< times a command was parked, since mount
+    kvcmd_observer_t observer = nullptr;
+    void *observer_arg = nullptr;
+
+    /// sends the command or parks it; fails only if the device refuses it with an empty queue
+    int submit(kvcmd_t *cmd) {
+        cmd->sq = this;
+        cmd->cost = _cost(cmd);
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (!parked.empty() || !_can_start(cmd)) {
+                _park(cmd, false);
+                return 0;
+            }
+            _start(cmd);
+        }
+        int r = _issue_or_park(cmd);
+        return (r < 0)? _fail(cmd, r) : 0;
+    }
+
+    /// after a command completed: sends the parked commands that fit
+    void kick() {
+        std::unique_lock<std::mutex> l(lock);
+        while (!parked.empty() && _can_start(&parked.front())) {
+            kvcmd_t *cmd = &parked.front();
+            parked.pop_front();
+            _start(cmd);
+            l.unlock();
+
+            int r = _issue_or_park(cmd);
+            if (r < 0 && _fail(cmd, r) != 0) {
+                ceph_abort_msg("IO error in aio_submit");
+            }
+            if (r > 0) return;      // the device is still busy
+
+            l.lock();
+        }
+    }
+
+    void finish(uint64_t cost) {
+        std::lock_guard<std::mutex> l(lock);
+        inflight_ops--;
+        inflight_bytes -= cost;
+    }
+
+    void get_stats(uint64_t *ops, uint64_t *bytes, uint64_t *waiting) {
+        std::lock_guard<std::mutex> l(lock);
+        *ops += inflight_ops;
+        *bytes += inflight_bytes;
+        *waiting += parked.size();
+    }
+
+private:
+    bool _can_start(const kvcmd_t *cmd) const {
+        // a command larger than max_bytes goes alone
+        return inflight_ops == 0 ||
+               (inflight_ops < max_ops && (max_bytes == 0 || inflight_bytes + cmd->cost <= max_bytes));
+    }
+
+    void _start(kvcmd_t *cmd) {
+        inflight_ops++;
+        inflight_bytes += cmd->cost;
+    }
+
+    void _park(kvcmd_t *cmd, bool front) {
+        if (front) {
+            parked.push_front(*cmd);
+        } else {
+            parked.push_back(*cmd);
+        }
+        num_parked++;
+    }
+
+    // 0: sent, 1: parked until a completion, < 0: refused with nothing else in flight
+    int _issue_or_park(kvcmd_t *cmd) {
+        bool retried = false;
+        while (_issue(cmd) != 0) {
+            std::lock_guard<std::mutex> l(lock);
+            inflight_ops--;
+            inflight_bytes -= cmd->cost;
+            if (inflight_ops > 0) {
+                _park(cmd, true);
+                return 1;
+            }
+            // the queue may have drained since the device refused the command
+            if (retried) return -EIO;
+            retried = true;
+            _start(cmd);
+        }
+        return 0;
+    }
+
+    inline uint64_t _cost(const kvcmd_t *cmd) const;
+    inline int _issue(kvcmd_t *cmd);
+    inline int _fail(kvcmd_t *cmd, int r);
+};
+
+/// the submission queues of the device queue pairs
+struct kvsubmit_queues {
+    KADI *kadi;
+    kvsubmit_queue queues[KADI_MAX_QUEUES];
+
+    explicit kvsubmit_queues(KADI *k): kadi(k) {
+        for (int i = 0; i < KADI_MAX_QUEUES; i++) {
+            queues[i].kadi = k;
+            queues[i].qid  = i;
+        }
+    }
+
+    void set_limits(uint32_t max_ops, uint64_t max_bytes) {
+        for (kvsubmit_queue &q : queues) {
+            q.max_ops   = std::max(1u, std::min(max_ops, (uint32_t)MAX_AIO_EVENTS));
+            q.max_bytes = max_bytes;
+        }
+    }
+
+    void set_observer(kvcmd_observer_t fn, void *arg) {
+        for (kvsubmit_queue &q : queues) {
+            q.observer = fn;
+            q.observer_arg = arg;
+        }
+    }
+
+    bool observed() const {
+        return queues[0].observer != nullptr;
+    }
+
+    /// reports a command sent without a queue
+    void observe(int opcode, int spaceid, uint32_t bytes, const ceph::mono_time &start) {
+        kvsubmit_queue &q = queues[0];
+        if (q.observer) {
+            q.observer(q.observer_arg, opcode, spaceid, bytes, ceph::mono_clock::now() - start);
+        }
+    }
+
+    kvsubmit_queue &get(int qid) {
+        return queues[(unsigned)qid % std::max(1u, kadi->get_num_queues())];
+    }
+
+    void get_stats(uint64_t *ops, uint64_t *bytes, uint64_t *waiting, uint64_t *parked) {
+        *ops = *bytes = *waiting = *parked = 0;
+        for (kvsubmit_queue &q : queues) {
+            q.get_stats(ops, bytes, waiting);
+            *parked += q.num_parked;
+        }
+    }
+};
+
+/// recycles the command descriptors of the submission path, so that a key read or written
+/// does not cost a heap allocation. Up to max_free descriptors and batches are kept.
+struct kvaio_pool {
+    std::mutex lock;
+    kvaio_list_t free_aios;
+    std::vector<kvbatch_t*> free_batches;
+    const size_t max_free;
+
+    explicit kvaio_pool(size_t max): max_free(max) {}
+
+    // no copying
+    kvaio_pool(const kvaio_pool& other) = delete;
+    kvaio_pool &operator=(const kvaio_pool& other) = delete;
+
+    ~kvaio_pool() {
+        free_aios.clear_and_dispose([] (kvaio_t *aio) { delete aio; });
+        for (kvbatch_t *b : free_batches) {
+            delete b;
+        }
     }
 
+    kvaio_t *get_aio(int opcode, int spaceid, aio_callback_t c, IoContext *p, void *db) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (!free_aios.empty()) {
+                kvaio_t *aio = &free_aios.front();
+                free_aios.pop_front();
+                l.unlock();
+                aio->init(opcode, spaceid, c, p, db);
+                return aio;
+            }
+        }
+        return new kvaio_t(opcode, spaceid, c, p, db, this);
+    }
+
+    void put_aio(kvaio_t *aio) {
+        // drop the payload references before the descriptor is parked
+        aio->bp = bufferptr();
+        aio->bl.clear();
+        aio->iov.clear();
+        aio->debug.clear();
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (free_aios.size() < max_free) {
+                free_aios.push_back(*aio);
+                return;
+            }
+        }
+        delete aio;
+    }
+
+    kvbatch_t *get_batch(IoContext *p, KADI *k) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (!free_batches.empty()) {
+                kvbatch_t *b = free_batches.back();
+                free_batches.pop_back();
+                l.unlock();
+                b->parent = p;
+                b->kadi = k;
+                return b;
+            }
+        }
+        return new kvbatch_t(p, k, this);
+    }
+
+    void put_batch(kvbatch_t *b) {
+        b->batch.reset();
+        b->aios.clear();
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (free_batches.size() < max_free / MAX_SUB_CMD) {
+                free_batches.push_back(b);
+                return;
+            }
+        }
+        delete b;
+    }
+
+    static void dispose(kvaio_t *aio) {
+        aio->pool->put_aio(aio);
+    }
 };
 
 struct IoContext {
@@ -66,7 +357,7 @@ private:
     int r = 0;
     int keyspace;
 
-    std::list<kvaio_t*> running_aios;    ///< submitting or submitted
+    kvaio_list_t running_aios;           ///< submitting or submitted
     int num_running = 0;
     int num_submitted = 0;
 
@@ -75,9 +366,13 @@ private:
 public:
     void *parent;
     std::string loc;
+    bool batch_writes = false;           ///< pack small stores and deletes into batch commands
+    int qid = 0;                         ///< device queue pair the aios are submitted to
+    kvaio_pool *aio_pool = nullptr;      ///< where the aios and batches come from; the store's pool if null
+    kvsubmit_queues *submit_queues = nullptr;   ///< admission to the device queue pairs
 
     //std::list<kvaio_t*> pending_syncios; ///< objects to be synchronously written (no lock contention)
-    std::list<kvaio_t*> pending_aios;    ///< not yet submitted
+    kvaio_list_t pending_aios;           ///< not yet submitted
 
 
 
@@ -89,6 +384,7 @@ public:
     IoContext &operator=(const IoContext& other) = delete;
     ~IoContext() {
         release_running_aios();
+        pending_aios.clear_and_dispose(kvaio_pool::dispose);
     }
 public:
 
@@ -114,52 +410,56 @@ public:
         return false;
     }
 
+    static bool _is_batchable(const kvaio_t *aio) {
+        if (aio->opcode == nvme_cmd_kv_delete) return true;
+        return aio->opcode == nvme_cmd_kv_store && aio->valoffset == 0 &&
+               aio->vallength > 0 && aio->vallength <= MAX_SUB_VALUESIZE;
+    }
+
+    // a batch of one command is sent as an individual command
+    int _submit_batch(kvsubmit_queue &sq, kvbatch_t *b) {
+        if (b->aios.size() > 1) {
+            return sq.submit(b);
+        }
+        int r = sq.submit(b->aios[0]);
+        b->pool->put_batch(b);
+        return r;
+    }
+
     int _submit_aios(KADI* kadi, bool debug) {
         int r = 0;
+        kvbatch_t *b = 0;
+        kvsubmit_queue &sq = submit_queues->get(qid);
         submitting = true;
-/*
-        for (kvaio_t *aio : running_aios) {
-            switch (aio->opcode) {
-                case nvme_cmd_kv_retrieve:
-                    break;
-                case nvme_cmd_kv_delete:
-                    //num_running--;
-                    break;
-                case nvme_cmd_kv_store:
-                    if (aio->vallength > 10000) {
-                        num_running--;
-                    }
-                    break;
-            };
-        }
-*/
-
-        for (kvaio_t *aio : running_aios) {
-            r = -1;
-            switch (aio->opcode) {
-                case nvme_cmd_kv_retrieve:
-                    //if (debug || 1) TRR << "submit ioc = " << (void*)this << ", op = " << aio->opcode << ", aio key addr = " << (void*)aio->key  << " ," << print_kvssd_key(aio->key, aio->keylength) << ", post data" << (void*)aio << ", ioc = " << (void*)aio->parent;
-                    r = kadi->kv_retrieve_aio(aio->spaceid, aio->key, aio->keylength, aio->value, aio->valoffset, aio->vallength, { aio->cb_func,  aio });
-                    break;
-                case nvme_cmd_kv_delete:
-                    //if (debug || 1) TRW << "submit ioc = " << (void*)this << ", op = " << aio->opcode << ", aio key addr = " << (void*)aio->key  << " ," << print_kvssd_key(aio->key, aio->keylength) << ", post data" << (void*)aio << ", ioc = " << (void*)aio->parent;
-                    r = kadi->kv_delete_aio(aio->spaceid, aio->key, aio->keylength, { aio->cb_func,  aio });
-                    //r = 0;
-                    break;
-                case nvme_cmd_kv_store:
-                    //if (debug || 1) TRW << "submit ioc = " << (void*)this << ", op = " << aio->opcode << ", aio key addr = " << (void*)aio->key  << " ," << print_kvssd_key(aio->key, aio->keylength) << ", post data" << (void*)aio << ", ioc = " << (void*)aio->parent;
-
-                    /*if (aio->vallength > 10000) {
-                        r = 0;
-                        TR << "large IO: space " << aio->spaceid << ", " << print_kvssd_key(aio->key, aio->keylength) << ", value length = " <<  aio->vallength;
 
+        for (kvaio_t &a : running_aios) {
+            kvaio_t *aio = &a;
+            if (batch_writes && _is_batchable(aio)) {
+                if (b == 0) b = aio_pool->get_batch(this, kadi);
+                if (aio->opcode == nvme_cmd_kv_delete) {
+                    b->batch.batch_delete(aio->spaceid, aio->key, aio->keylength);
+                } else {
+                    b->batch.batch_store(aio->spaceid, kadi->get_store_option(aio->spaceid), aio->key, aio->keylength, aio->value, aio->vallength);
+                }
+                b->aios.push_back(aio);
+                if (b->aios.size() == MAX_SUB_CMD) {
+                    r = _submit_batch(sq, b);
+                    b = 0;
+                    if (r != 0) {
+                        ceph_abort_msg("IO error in aio_submit");
                     }
-                    else*/
-                        r = kadi->kv_store_aio(aio->spaceid, aio->key, aio->keylength, aio->value, aio->valoffset, aio->vallength, { aio->cb_func,  aio});
+                }
+                continue;
+            }
 
-                    break;
-            };
+            r = sq.submit(aio);
+            if (r != 0) {
+                ceph_abort_msg("IO error in aio_submit");
+            }
+        }
 
+        if (b) {
+            r = _submit_batch(sq, b);
             if (r != 0) {
                 ceph_abort_msg("IO error in aio_submit");
             }
@@ -196,10 +496,7 @@ public:
         }
         {
             std::unique_lock<std::mutex> l(lock);
-            for (kvaio_t *p : running_aios) {
-                delete p;
-            }
-            running_aios.clear();
+            running_aios.clear_and_dispose(kvaio_pool::dispose);
         }
     }
 
@@ -232,6 +529,119 @@ public:
 };
 
 
+// called when a batch command finishes: completes each command in the batch,
+// resubmitting the ones the device did not apply as individual commands
+inline void batch_aio_callback(kv_io_context &op, void *post_data)
+{
+    kvbatch_t *b = static_cast<kvbatch_t*>(post_data);
+    const bool partial = (op.retcode == 0x3A1);
+
+    // the batch goes back to its pool first: completing the last command
+    // may release the sequencer that owns the pool
+    kvaio_t *aios[MAX_SUB_CMD];
+    const unsigned num_aios = b->aios.size();
+    std::copy(b->aios.begin(), b->aios.end(), aios);
+    kvsubmit_queue *sq = b->sq;
+    b->pool->put_batch(b);
+
+    for (unsigned i = 0; i < num_aios; i++) {
+        kvaio_t *aio = aios[i];
+        const bool failed = (op.retcode != 0) && (!partial || op.batch_results[i] != KV_BATCH_SUB_SUCCESS);
+
+        if (failed && sq->submit(aio) == 0) {
+            continue;
+        }
+
+        kv_io_context subop;
+        memset((void*)&subop, 0, sizeof(subop));
+        subop.opcode  = aio->opcode;
+        subop.retcode = (failed)? op.retcode:0;
+        subop.key.key = aio->key;
+        subop.key.length   = aio->keylength;
+        subop.value.value  = aio->value;
+        subop.value.length = aio->vallength;
+        aio->cb_func(subop, aio);
+    }
+}
+
+// called when a command sent through a submission queue finishes
+inline void kvsubmit_callback(kv_io_context &op, void *post_data)
+{
+    kvcmd_t *cmd = static_cast<kvcmd_t*>(post_data);
+    kvsubmit_queue *sq = cmd->sq;
+
+    // the command may be released when it completes
+    sq->finish(cmd->cost);
+    if (sq->observer) {
+        const ceph::timespan lat = ceph::mono_clock::now() - cmd->stamp;
+        if (cmd->isbatch) {
+            for (const kvaio_t *aio : static_cast<kvbatch_t*>(cmd)->aios) {
+                sq->observer(sq->observer_arg, aio->opcode, aio->spaceid, aio->vallength, lat);
+            }
+        } else {
+            const kvaio_t *aio = static_cast<kvaio_t*>(cmd);
+            const uint32_t bytes = (aio->opcode == nvme_cmd_kv_retrieve)? op.value.length : aio->vallength;
+            sq->observer(sq->observer_arg, aio->opcode, aio->spaceid, bytes, lat);
+        }
+    }
+    if (cmd->isbatch) {
+        batch_aio_callback(op, static_cast<kvbatch_t*>(cmd));
+    } else {
+        kvaio_t *aio = static_cast<kvaio_t*>(cmd);
+        aio->cb_func(op, aio);
+    }
+    sq->kick();
+}
+
+inline uint64_t kvsubmit_queue::_cost(const kvcmd_t *cmd) const
+{
+    if (!cmd->isbatch) {
+        return static_cast<const kvaio_t*>(cmd)->vallength;
+    }
+    uint64_t cost = 0;
+    for (const kvaio_t *aio : static_cast<const kvbatch_t*>(cmd)->aios) {
+        cost += aio->vallength;
+    }
+    return cost;
+}
+
+inline int kvsubmit_queue::_issue(kvcmd_t *cmd)
+{
+    if (observer) {
+        cmd->stamp = ceph::mono_clock::now();
+    }
+    if (cmd->isbatch) {
+        kvbatch_t *b = static_cast<kvbatch_t*>(cmd);
+        return kadi->batch_submit_aio(&b->batch, 0, { kvsubmit_callback, cmd, qid });
+    }
+
+    kvaio_t *aio = static_cast<kvaio_t*>(cmd);
+    switch (aio->opcode) {
+        case nvme_cmd_kv_retrieve:
+            return kadi->kv_retrieve_aio(aio->spaceid, aio->key, aio->keylength, aio->value, aio->valoffset, aio->vallength, { kvsubmit_callback, cmd, qid });
+        case nvme_cmd_kv_delete:
+            return kadi->kv_delete_aio(aio->spaceid, aio->key, aio->keylength, { kvsubmit_callback, cmd, qid });
+        case nvme_cmd_kv_store:
+            return kadi->kv_store_aio(aio->spaceid, aio->key, aio->keylength, aio->value, aio->valoffset, aio->vallength, { kvsubmit_callback, cmd, qid });
+    };
+    return -EINVAL;
+}
+
+// a batch the device refuses is sent as individual commands
+inline int kvsubmit_queue::_fail(kvcmd_t *cmd, int r)
+{
+    if (!cmd->isbatch) {
+        return r;
+    }
+    kvbatch_t *b = static_cast<kvbatch_t*>(cmd);
+    r = 0;
+    for (kvaio_t *aio : b->aios) {
+        r = submit(aio);
+        if (r != 0) break;
+    }
+    b->pool->put_batch(b);
+    return r;
+}
 
 #endif //CEPH_KVSSD_H
 
@@ -126,6 +126,149 @@ struct LruOnodeCacheShard: public KvsStoreTypes::OnodeCacheShard {
     }
 };
 
+/// ------------------------------------------------
+/// 2Q cache for Onode
+/// ------------------------------------------------
+//
+// New onodes enter warm_in (A1in) and leave it in FIFO order without being
+// promoted by hits, so a scan of a PG only recycles warm_in. The oids of the
+// onodes evicted from warm_in are remembered in warm_out (A1out); an onode
+// loaded again while its oid is there goes to hot (Am), which is an LRU.
+
+struct TwoQOnodeCacheShard: public KvsStoreTypes::OnodeCacheShard {
+    typedef boost::intrusive::list<
+            KvsStoreTypes::Onode,
+            boost::intrusive::member_hook<KvsStoreTypes::Onode,
+                    boost::intrusive::list_member_hook<>, &KvsStoreTypes::Onode::lru_item> > list_t;
+    typedef mempool::kvsstore_cache_other::list<ghobject_t> ghost_list_t;
+
+    enum {
+        ONODE_NEW = 0,
+        ONODE_WARM_IN,   ///< in warm_in
+        ONODE_HOT,       ///< in hot
+    };
+
+    list_t hot;          ///< "Am" hot onodes
+    list_t warm_in;      ///< "A1in" newly loaded onodes
+    ghost_list_t warm_out;   ///< "A1out" oids of the onodes evicted from warm_in
+    mempool::kvsstore_cache_other::unordered_map<ghobject_t, ghost_list_t::iterator> ghosts;
+
+    explicit TwoQOnodeCacheShard(CephContext *cct) :
+            OnodeCacheShard(cct) {
+    }
+
+    void _add(KvsStoreTypes::OnodeRef &o, int level) override
+    {
+        auto g = ghosts.find(o->oid);
+        if (g != ghosts.end()) {
+            // loaded again after it was evicted: it is hot
+            warm_out.erase(g->second);
+            ghosts.erase(g);
+            o->cache_private = ONODE_HOT;
+            hot.push_front(*o);
+        } else {
+            o->cache_private = ONODE_WARM_IN;
+            (level > 0) ? warm_in.push_front(*o) : warm_in.push_back(*o);
+        }
+        num = hot.size() + warm_in.size();
+    }
+    void _rm(KvsStoreTypes::OnodeRef &o) override
+    {
+        switch (o->cache_private) {
+            case ONODE_WARM_IN:
+                warm_in.erase(warm_in.iterator_to(*o));
+                break;
+            case ONODE_HOT:
+                hot.erase(hot.iterator_to(*o));
+                break;
+            default:
+                ceph_abort_msg("bad cache_private");
+        }
+        o->cache_private = ONODE_NEW;
+        num = hot.size() + warm_in.size();
+    }
+    void _touch(KvsStoreTypes::OnodeRef &o) override
+    {
+        // hits in warm_in do nothing, that is what keeps scans out of hot
+        if (o->cache_private == ONODE_HOT) {
+            hot.erase(hot.iterator_to(*o));
+            hot.push_front(*o);
+        }
+    }
+    void _trim_to(uint64_t max) override
+    {
+        if (hot.size() + warm_in.size() > max) {
+            uint64_t kin = max * cct->_conf->kvsstore_2q_cache_kin_ratio;
+            uint64_t khot = max - kin;
+            if (hot.size() < khot) {
+                // hot is small, give slack to warm_in
+                kin += khot - hot.size();
+            } else if (warm_in.size() < kin) {
+                // warm_in is small, give slack to hot
+                khot += kin - warm_in.size();
+            }
+            if (warm_in.size() > kin) {
+                _evict(warm_in, warm_in.size() - kin, true);
+            }
+            if (hot.size() > khot) {
+                _evict(hot, hot.size() - khot, false);
+            }
+        }
+
+        const uint64_t kout = max * cct->_conf->kvsstore_2q_cache_kout_ratio;
+        while (warm_out.size() > kout) {
+            ghosts.erase(warm_out.back());
+            warm_out.pop_back();
+        }
+        num = hot.size() + warm_in.size();
+    }
+
+    // evicts up to n unpinned onodes from the tail of the list
+    void _evict(list_t &lru, uint64_t n, bool remember)
+    {
+        auto p = lru.end();
+        ceph_assert(p != lru.begin());
+        --p;
+        int skipped = 0;
+        int max_skipped = ONODE_LRUCACHE_TRIM_MAX_SKIP_PINNED;
+        while (n > 0) {
+            KvsStoreTypes::Onode *o = &*p;
+            const bool last = (p == lru.begin());
+            int refs = o->nref.load();
+            if (refs > 1) {
+                if (++skipped >= max_skipped || last) {
+                    break;
+                }
+                p--;
+                n--;
+                continue;
+            }
+            if (!last) {
+                lru.erase(p--);
+            } else {
+                lru.erase(p);
+            }
+            if (remember && ghosts.find(o->oid) == ghosts.end()) {
+                warm_out.push_front(o->oid);
+                ghosts[o->oid] = warm_out.begin();
+            }
+            o->cache_private = ONODE_NEW;
+            o->get();  // paranoia
+            o->c->onode_map.remove(o->oid);
+            o->put();
+            --n;
+            if (last) {
+                break;
+            }
+        }
+    }
+
+    void add_stats(uint64_t *onodes) override
+    {
+        *onodes += num;
+    }
+};
+
 // OnodeCacheShard::create
 KvsStoreTypes::OnodeCacheShard *KvsStoreTypes::OnodeCacheShard::create(
         CephContext* cct,
@@ -133,8 +276,10 @@ KvsStoreTypes::OnodeCacheShard *KvsStoreTypes::OnodeCacheShard::create(
         PerfCounters *logger)
 {
     OnodeCacheShard *c = nullptr;
-    // Currently we only implement an LRU cache for onodes
-    c = new LruOnodeCacheShard(cct);
+    if (type == "2q")
+        c = new TwoQOnodeCacheShard(cct);
+    else
+        c = new LruOnodeCacheShard(cct);
     c->logger = logger;
     return c;
 }
@@ -229,13 +374,292 @@ struct LruBufferCacheShard : public KvsStoreTypes::BufferCacheShard {
 #endif
 };
 
+/// ------------------------------------------------
+/// 2Q cache for Buffer
+/// ------------------------------------------------
+//
+// Same queues as the onode cache, except that a buffer evicted from warm_in
+// stays in its BufferSpace as an empty buffer in warm_out. Reading or writing
+// that range again discards it and passes its cache_private to the new buffer,
+// which then goes to hot.
+
+struct TwoQBufferCacheShard : public KvsStoreTypes::BufferCacheShard {
+    typedef boost::intrusive::list<
+            KvsStoreTypes::Buffer,
+            boost::intrusive::member_hook<
+                    KvsStoreTypes::Buffer,
+                    boost::intrusive::list_member_hook<>,
+                    &KvsStoreTypes::Buffer::lru_item> > list_t;
+    list_t hot;       ///< "Am" hot buffers
+    list_t warm_in;   ///< "A1in" newly warm buffers
+    list_t warm_out;  ///< "A1out" empty buffers we've evicted
+
+    enum {
+        BUFFER_NEW = 0,
+        BUFFER_WARM_IN,   ///< in warm_in
+        BUFFER_WARM_OUT,  ///< in warm_out
+        BUFFER_HOT,       ///< in hot
+        BUFFER_TYPE_MAX
+    };
+
+    uint64_t list_bytes[BUFFER_TYPE_MAX] = {0}; ///< bytes per type
+
+    explicit TwoQBufferCacheShard(CephContext *cct) : BufferCacheShard(cct) {}
+
+    void _add(KvsStoreTypes::Buffer *b, int level, KvsStoreTypes::Buffer *near) override {
+        dout(20) << __func__ << " level " << level << " near " << near
+                 << " on " << *b
+                 << " which has cache_private " << b->cache_private << dendl;
+        if (near) {
+            b->cache_private = near->cache_private;
+            switch (b->cache_private) {
+                case BUFFER_WARM_IN:
+                    warm_in.insert(warm_in.iterator_to(*near), *b);
+                    break;
+                case BUFFER_WARM_OUT:
+                    ceph_assert(b->is_empty());
+                    warm_out.insert(warm_out.iterator_to(*near), *b);
+                    break;
+                case BUFFER_HOT:
+                    hot.insert(hot.iterator_to(*near), *b);
+                    break;
+                default:
+                    ceph_abort_msg("bad cache_private");
+            }
+        } else if (b->cache_private == BUFFER_NEW) {
+            b->cache_private = BUFFER_WARM_IN;
+            if (level > 0) {
+                warm_in.push_front(*b);
+            } else {
+                // take caller hint to start at the back of the warm queue
+                warm_in.push_back(*b);
+            }
+        } else {
+            // we got a hint from discard
+            switch (b->cache_private) {
+                case BUFFER_WARM_IN:
+                    // stay in warm_in.  move to front, even though 2Q doesn't actually
+                    // do this.
+                    dout(20) << __func__ << " move to front of warm " << *b << dendl;
+                    warm_in.push_front(*b);
+                    break;
+                case BUFFER_WARM_OUT:
+                    b->cache_private = BUFFER_HOT;
+                    // move to hot.  fall-thru
+                case BUFFER_HOT:
+                    dout(20) << __func__ << " move to front of hot " << *b << dendl;
+                    hot.push_front(*b);
+                    break;
+                default:
+                    ceph_abort_msg("bad cache_private");
+            }
+        }
+        if (!b->is_empty()) {
+            buffer_bytes += b->length;
+            list_bytes[b->cache_private] += b->length;
+        }
+        num = hot.size() + warm_in.size();
+    }
+    void _rm(KvsStoreTypes::Buffer *b) override {
+        dout(20) << __func__ << " " << *b << dendl;
+        if (!b->is_empty()) {
+            ceph_assert(buffer_bytes >= b->length);
+            buffer_bytes -= b->length;
+            ceph_assert(list_bytes[b->cache_private] >= b->length);
+            list_bytes[b->cache_private] -= b->length;
+        }
+        switch (b->cache_private) {
+            case BUFFER_WARM_IN:
+                warm_in.erase(warm_in.iterator_to(*b));
+                break;
+            case BUFFER_WARM_OUT:
+                warm_out.erase(warm_out.iterator_to(*b));
+                break;
+            case BUFFER_HOT:
+                hot.erase(hot.iterator_to(*b));
+                break;
+            default:
+                ceph_abort_msg("bad cache_private");
+        }
+        num = hot.size() + warm_in.size();
+    }
+    void _move(BufferCacheShard *srcc, KvsStoreTypes::Buffer *b) override {
+        TwoQBufferCacheShard *src = static_cast<TwoQBufferCacheShard*>(srcc);
+        src->_rm(b);
+
+        // preserve which list we're on (even if we can't preserve the order!)
+        switch (b->cache_private) {
+            case BUFFER_WARM_IN:
+                ceph_assert(!b->is_empty());
+                warm_in.push_back(*b);
+                break;
+            case BUFFER_WARM_OUT:
+                ceph_assert(b->is_empty());
+                warm_out.push_back(*b);
+                break;
+            case BUFFER_HOT:
+                ceph_assert(!b->is_empty());
+                hot.push_back(*b);
+                break;
+            default:
+                ceph_abort_msg("bad cache_private");
+        }
+        if (!b->is_empty()) {
+            buffer_bytes += b->length;
+            list_bytes[b->cache_private] += b->length;
+        }
+        num = hot.size() + warm_in.size();
+    }
+    void _adjust_size(KvsStoreTypes::Buffer *b, int64_t delta) override {
+        dout(20) << __func__ << " delta " << delta << " on " << *b << dendl;
+        if (!b->is_empty()) {
+            ceph_assert((int64_t)buffer_bytes + delta >= 0);
+            buffer_bytes += delta;
+            ceph_assert((int64_t)list_bytes[b->cache_private] + delta >= 0);
+            list_bytes[b->cache_private] += delta;
+        }
+    }
+    void _touch(KvsStoreTypes::Buffer *b) override {
+        switch (b->cache_private) {
+            case BUFFER_WARM_IN:
+                // do nothing (somewhat counter-intuitively!)
+                break;
+            case BUFFER_WARM_OUT:
+                // move from warm_out to hot LRU
+                ceph_abort_msg("this happens via discard hint");
+                break;
+            case BUFFER_HOT:
+                // move to front of hot LRU
+                hot.erase(hot.iterator_to(*b));
+                hot.push_front(*b);
+                break;
+        }
+        num = hot.size() + warm_in.size();
+        _audit("_touch_buffer end");
+    }
+
+    void _trim_to(uint64_t max) override
+    {
+        if (buffer_bytes > max) {
+            uint64_t kin = max * cct->_conf->kvsstore_2q_cache_kin_ratio;
+            uint64_t khot = max - kin;
+
+            // pre-calculate kout based on average buffer size too,
+            // which is typical(the warm_in and hot lists may change later)
+            uint64_t kout = 0;
+            uint64_t buffer_num = hot.size() + warm_in.size();
+            if (buffer_num) {
+                uint64_t avg_size = buffer_bytes / buffer_num;
+                ceph_assert(avg_size);
+                uint64_t calculated_num = max / avg_size;
+                kout = calculated_num * cct->_conf->kvsstore_2q_cache_kout_ratio;
+            }
+
+            if (list_bytes[BUFFER_HOT] < khot) {
+                // hot is small, give slack to warm_in
+                kin += khot - list_bytes[BUFFER_HOT];
+            } else if (list_bytes[BUFFER_WARM_IN] < kin) {
+                // warm_in is small, give slack to hot
+                khot += kin - list_bytes[BUFFER_WARM_IN];
+            }
+
+            // adjust warm_in list
+            int64_t to_evict_bytes = list_bytes[BUFFER_WARM_IN] - kin;
+            while (to_evict_bytes > 0) {
+                auto p = warm_in.rbegin();
+                if (p == warm_in.rend()) {
+                    // stop if warm_in list is now empty
+                    break;
+                }
+
+                KvsStoreTypes::Buffer *b = &*p;
+                ceph_assert(b->is_clean());
+                dout(20) << __func__ << " buffer_warm_in -> out " << *b << dendl;
+                ceph_assert(buffer_bytes >= b->length);
+                buffer_bytes -= b->length;
+                ceph_assert(list_bytes[BUFFER_WARM_IN] >= b->length);
+                list_bytes[BUFFER_WARM_IN] -= b->length;
+                to_evict_bytes -= b->length;
+                b->state = KvsStoreTypes::Buffer::STATE_EMPTY;
+                b->data.clear();
+                warm_in.erase(warm_in.iterator_to(*b));
+                warm_out.push_front(*b);
+                b->cache_private = BUFFER_WARM_OUT;
+            }
+
+            // adjust hot list
+            to_evict_bytes = list_bytes[BUFFER_HOT] - khot;
+            while (to_evict_bytes > 0) {
+                auto p = hot.rbegin();
+                if (p == hot.rend()) {
+                    // stop if hot list is now empty
+                    break;
+                }
+
+                KvsStoreTypes::Buffer *b = &*p;
+                dout(20) << __func__ << " buffer_hot rm " << *b << dendl;
+                ceph_assert(b->is_clean());
+                // adjust evict size before buffer goes invalid
+                to_evict_bytes -= b->length;
+                b->space->_rm_buffer(this, b);
+            }
+
+            // adjust warm out list too, if necessary
+            int64_t n = warm_out.size() - kout;
+            while (n-- > 0) {
+                KvsStoreTypes::Buffer *b = &*warm_out.rbegin();
+                ceph_assert(b->is_empty());
+                dout(20) << __func__ << " buffer_warm_out rm " << *b << dendl;
+                b->space->_rm_buffer(this, b);
+            }
+        } else if (max == 0) {
+            // flush: drop the history too
+            while (!warm_out.empty()) {
+                KvsStoreTypes::Buffer *b = &*warm_out.rbegin();
+                b->space->_rm_buffer(this, b);
+            }
+        }
+        num = hot.size() + warm_in.size();
+    }
+
+    void add_stats(uint64_t *buffers,
+                   uint64_t *bytes) override {
+        *buffers += num;
+        *bytes += buffer_bytes;
+    }
+#ifdef DEBUG_CACHE
+    void _audit(const char *when) override
+    {
+        dout(10) << __func__ << " " << when << " start" << dendl;
+        uint64_t s = 0;
+        for (auto i = hot.begin(); i != hot.end(); ++i) {
+            s += i->length;
+        }
+        for (auto i = warm_in.begin(); i != warm_in.end(); ++i) {
+            s += i->length;
+        }
+        if (s != buffer_bytes) {
+            derr << __func__ << " buffer_bytes " << buffer_bytes << " actual " << s
+                 << dendl;
+            ceph_assert(s == buffer_bytes);
+        }
+        dout(20) << __func__ << " " << when << " buffer_bytes " << buffer_bytes
+                 << " ok" << dendl;
+    }
+#endif
+};
+
 ///BufferCacheShard::create
 KvsStoreTypes::BufferCacheShard *KvsStoreTypes::BufferCacheShard::create(
         CephContext* cct,
         string type,
         PerfCounters *logger)
 {
-    BufferCacheShard *c = new LruBufferCacheShard(cct);
+    BufferCacheShard *c = nullptr;
+    if (type == "2q")
+        c = new TwoQBufferCacheShard(cct);
+    else
+        c = new LruBufferCacheShard(cct);
     c->logger = logger;
     return c;
 }
@@ -429,7 +853,7 @@ void KvsStoreTypes::BufferSpace::read(
                     res_intervals.insert(offset, l);
                     offset += l;
                     length -= l;
-                    if (!b->is_writing()) {
+                    if (!b->is_writing() && !(flags & NOCACHE_READ)) {
                         cache->_touch(b);
                     }
                     continue;
@@ -442,7 +866,7 @@ void KvsStoreTypes::BufferSpace::read(
                     offset += gap;
                     length -= gap;
                 }
-                if (!b->is_writing()) {
+                if (!b->is_writing() && !(flags & NOCACHE_READ)) {
                     cache->_touch(b);
                 }
                 if (b->length > length) {
@@ -537,6 +961,7 @@ int KvsStoreTypes::BufferSpace::_discard(KvsStoreTypes::BufferCacheShard* cache,
 
 void KvsStoreTypes::BufferSpace::_finish_write(KvsStoreTypes::BufferCacheShard* cache, uint64_t seq)
 {
+    gen++;  // the device has the new data now; prefetches issued before are stale
     auto i = writing.begin();
     while (i != writing.end()) {
         if (i->seq > seq) {
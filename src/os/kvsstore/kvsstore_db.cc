@@ -1,5 +1,6 @@
 
 #include <stdint.h>
+#include <thread>
 #include "kvsstore_db.h"
 #include "kvsstore_debug.h"
 #include "KvsStore.h"
@@ -30,20 +31,30 @@ void aio_callback(kv_io_context &op, void *post_data)
 
     int r = op.retcode;
 
-    if (op.opcode == nvme_cmd_kv_retrieve && r == 0 && op.value.actual_value_size > op.value.length) {
-        aio->pbl->clear();
-        aio->bp = buffer::create_small_page_aligned(op.value.actual_value_size);
-        aio->value     = aio->bp.c_str();
-        aio->vallength = aio->bp.length();
-        aio->valoffset = 0;
-
+    if (op.opcode == nvme_cmd_kv_retrieve && r == 0) {
         KvsStoreDB* db = static_cast<KvsStoreDB*>(aio->db);
+        if (aio->adaptive) {
+            db->get_read_hint(aio->spaceid).observe(op.value.actual_value_size);
+        }
 
-        db->kadi.kv_retrieve_aio(aio->spaceid, aio->key, aio->keylength, aio->value, aio->valoffset, aio->vallength, { aio->cb_func,  aio });
+        if (op.value.actual_value_size > op.value.length) {
+            // the value did not fit: read it again, the I/O completes with the second read
+            db->read_retries++;
+            aio->adaptive  = false;
+            aio->pbl->clear();
+            aio->bp = buffer::create_small_page_aligned(op.value.actual_value_size);
+            aio->value     = aio->bp.c_str();
+            aio->vallength = aio->bp.length();
+            aio->valoffset = 0;
+
+            r = db->submit_queues.get(ioc->qid).submit(aio);
+            if (r == 0) return;
+            TRERR << "failed to read " << op.value.actual_value_size << " bytes again, r = " << r;
+        }
     }
 
     if ( r != 0 ) {
-        ioc->set_return_value(op.retcode);
+        ioc->set_return_value(r);
     }
 
 
@@ -67,7 +78,9 @@ void aio_callback(kv_io_context &op, void *post_data)
 
 }
 
-KvsStoreDB::KvsStoreDB(CephContext *cct_): cct(cct_), kadi(cct), compaction_started(false) {
+KvsStoreDB::KvsStoreDB(CephContext *cct_): cct(cct_), kadi(cct), compaction_started(false),
+    index_cache(cct_ ? cct_->_conf->kvsstore_index_cache_bytes : 0),
+    aio_pool(cct_ ? cct_->_conf->kvsstore_aio_pool_size : 0), submit_queues(&kadi) {
     FTRACE
     if (cct) {
         keyspace_sorted = cct->_conf->kvsstore_keyspace_sorted;
@@ -107,7 +120,7 @@ int KvsStoreDB::aio_read_omap_keyblock(uint64_t nid,uint32_t start_id, uint32_t
     for (unsigned id = start_id; id < end_id; id++) {
         bufferlist *bl = new bufferlist();
         kvaio_t *aio = _aio_read(keyspace_notsorted, DEFAULT_OMAPBUF_SIZE, bl, &ioc);
-        aio->keylength = construct_omapblockkey_impl(aio->key, nid, start_id);
+        aio->keylength = construct_omapblockkey_impl(aio->key, nid, id);
 
         bls.push_back(bl);
     }
@@ -124,10 +137,10 @@ int KvsStoreDB::aio_read_omap_keyblock(uint64_t nid,uint32_t start_id, uint32_t
     return r;
 }
 
-void KvsStoreDB::aio_read_omap(const uint64_t index, const std::string &strkey, bufferlist &bl, IoContext *ioc)
+void KvsStoreDB::aio_read_omap(const uint64_t index, const std::string &strkey, bufferlist &bl, IoContext *ioc, uint32_t size_hint)
 {
     FTRACE
-    kvaio_t *aio = _aio_read(keyspace_notsorted, KVS_OBJECT_SPLIT_SIZE, &bl, ioc);
+    kvaio_t *aio = _aio_read(keyspace_notsorted, get_read_size(keyspace_notsorted, size_hint), &bl, ioc);
     aio->keylength = construct_omapkey_impl( aio->key, index, strkey.c_str(), strkey.length());
 }
 
@@ -156,12 +169,12 @@ kvaio_t* KvsStoreDB::_aio_write(int keyspaceid, bufferlist &bl, IoContext *ioc)
 }
 
 
-kvaio_t* KvsStoreDB::_aio_write(int keyspaceid, void *addr, uint32_t len, IoContext *ioc)
+kvaio_t* KvsStoreDB::_aio_write(int keyspaceid, void *addr, uint32_t len, IoContext *ioc, aio_callback_t cb)
 {
     FTRACE
-    ioc->pending_aios.push_back(new kvaio_t(nvme_cmd_kv_store, keyspaceid, aio_callback, ioc, this));
+    ioc->pending_aios.push_back(*_get_aio_pool(ioc)->get_aio(nvme_cmd_kv_store, keyspaceid, cb, ioc, this));
 
-    kvaio_t* aio = ioc->pending_aios.back();
+    kvaio_t* aio = &ioc->pending_aios.back();
     aio->value     = addr;
     aio->vallength = len;
     aio->valoffset = 0;
@@ -169,12 +182,17 @@ kvaio_t* KvsStoreDB::_aio_write(int keyspaceid, void *addr, uint32_t len, IoCont
 }
 
 
-kvaio_t* KvsStoreDB::_aio_read(int keyspaceid, uint32_t len, bufferlist *pbl, IoContext *ioc)
+// len 0: the read size hint of the key space, which learns from the value read
+kvaio_t* KvsStoreDB::_aio_read(int keyspaceid, uint32_t len, bufferlist *pbl, IoContext *ioc, aio_callback_t cb)
 {
     FTRACE
-    ioc->pending_aios.push_back(new kvaio_t(nvme_cmd_kv_retrieve, keyspaceid, aio_callback, ioc, this));
-    kvaio_t* aio = ioc->pending_aios.back();
+    ioc->pending_aios.push_back(*_get_aio_pool(ioc)->get_aio(nvme_cmd_kv_retrieve, keyspaceid, cb, ioc, this));
+    kvaio_t* aio = &ioc->pending_aios.back();
 
+    if (len == 0) {
+        len = get_read_hint(keyspaceid).get();
+        aio->adaptive = true;
+    }
     aio->bp = buffer::create_small_page_aligned(len);
     aio->pbl = pbl; // out bl - needs to be cleared when retrying
 
@@ -187,44 +205,75 @@ kvaio_t* KvsStoreDB::_aio_read(int keyspaceid, uint32_t len, bufferlist *pbl, Io
 
 
 
-kvaio_t* KvsStoreDB::_aio_remove(int keyspaceid, IoContext *ioc)
+kvaio_t* KvsStoreDB::_aio_remove(int keyspaceid, IoContext *ioc, aio_callback_t cb)
 {
     FTRACE
-    ioc->pending_aios.push_back(new kvaio_t(nvme_cmd_kv_delete, keyspaceid, aio_callback, ioc, this));
+    ioc->pending_aios.push_back(*_get_aio_pool(ioc)->get_aio(nvme_cmd_kv_delete, keyspaceid, cb, ioc, this));
 
-    kvaio_t* aio = ioc->pending_aios.back();
+    kvaio_t* aio = &ioc->pending_aios.back();
     aio->value     = 0;
     aio->vallength = 0;
     aio->valoffset = 0;
     return aio;
 }
 
-void KvsStoreDB::aio_read_chunk(const ghobject_t &oid, uint16_t chunkid, uint32_t len, bufferlist &bl, IoContext *ioc)
+std::string KvsStoreDB::get_chunk_key(const ghobject_t &oid, uint64_t version)
+{
+    char keybuffer[256];
+    const uint8_t len = construct_object_key(cct, oid, keybuffer, 0, version);
+    return std::string(keybuffer, len);
+}
+
+void KvsStoreDB::aio_read_chunk(const std::string &key, uint16_t chunkid, uint32_t len, bufferlist &bl, IoContext *ioc, aio_callback_t cb)
 {
     FTRACE
-    kvaio_t *aio = _aio_read(keyspace_notsorted, len, &bl, ioc);
-    aio->keylength = construct_object_key(cct, oid, aio->key, chunkid);
+    kvaio_t *aio = _aio_read(keyspace_notsorted, len, &bl, ioc, cb);
+    aio->keylength = construct_chunk_key(aio->key, key, chunkid);
 }
 
-void KvsStoreDB::aio_write_chunk(const ghobject_t &oid, uint16_t chunkid, void *addr, uint32_t len, IoContext *ioc)
+void KvsStoreDB::aio_write_chunk(const std::string &key, uint16_t chunkid, void *addr, uint32_t len, IoContext *ioc, aio_callback_t cb)
 {
     FTRACE
-    kvaio_t *aio = _aio_write(keyspace_notsorted, addr, len, ioc);
-    aio->keylength = construct_object_key(cct, oid, aio->key, chunkid);
+    kvaio_t *aio = _aio_write(keyspace_notsorted, addr, len, ioc, cb);
+    aio->keylength = construct_chunk_key(aio->key, key, chunkid);
 
 }
 
-void KvsStoreDB::aio_remove_chunk(const ghobject_t &oid, uint16_t chunkid, IoContext *ioc)
+void KvsStoreDB::aio_remove_chunk(const std::string &key, uint16_t chunkid, IoContext *ioc, aio_callback_t cb)
+{
+    FTRACE
+    kvaio_t *aio = _aio_remove(keyspace_notsorted, ioc, cb);
+    aio->keylength = construct_chunk_key(aio->key, key, chunkid);
+}
+
+int KvsStoreDB::read_blob(uint64_t sid, bufferlist &bl)
+{
+    FTRACE
+    char keybuffer[256];
+    kv_key key;
+    key.key    = keybuffer;
+    key.length = construct_blobkey_impl(keybuffer, sid);
+    return read_kvkey(&key, bl, false);
+}
+
+void KvsStoreDB::aio_write_blob(uint64_t sid, bufferlist &bl, IoContext *ioc)
+{
+    FTRACE
+    kvaio_t *aio = _aio_write(keyspace_notsorted, bl, ioc);
+    aio->keylength = construct_blobkey_impl(aio->key, sid);
+}
+
+void KvsStoreDB::aio_remove_blob(uint64_t sid, IoContext *ioc)
 {
     FTRACE
     kvaio_t *aio = _aio_remove(keyspace_notsorted, ioc);
-    aio->keylength = construct_object_key(cct, oid, aio->key, chunkid);
+    aio->keylength = construct_blobkey_impl(aio->key, sid);
 }
 
-void KvsStoreDB::aio_read_onode(const ghobject_t &oid, bufferlist &bl, IoContext *ioc)
+void KvsStoreDB::aio_read_onode(const ghobject_t &oid, bufferlist &bl, IoContext *ioc, uint32_t size_hint, aio_callback_t cb)
 {
     FTRACE
-    kvaio_t *aio = _aio_read(keyspace_sorted, KVS_OBJECT_SPLIT_SIZE, &bl, ioc);
+    kvaio_t *aio = _aio_read(keyspace_sorted, get_read_size(keyspace_sorted, size_hint), &bl, ioc, cb);
     aio->keylength = construct_onode_key(cct, oid, aio->key);
     // TR << "read onode: oid = " << oid  << " key = " << print_kvssd_key((const char*)aio->key, aio->keylength) ;
 
@@ -250,7 +299,7 @@ void KvsStoreDB::aio_remove_onode(const ghobject_t &oid, IoContext *ioc)
 void KvsStoreDB::aio_read_journal(int index, bufferlist &bl, IoContext *ioc)
 {
     FTRACE
-    kvaio_t *aio = _aio_read(keyspace_notsorted, KVS_OBJECT_SPLIT_SIZE, &bl, ioc);
+    kvaio_t *aio = _aio_read(keyspace_notsorted, 0, &bl, ioc);
     aio->keylength = construct_journalkey_impl(aio->key, index);
 }
 void KvsStoreDB::aio_write_journal(int index, void *addr, uint32_t len, IoContext *ioc)
@@ -272,7 +321,7 @@ void KvsStoreDB::aio_read_coll(const coll_t &cid, bufferlist &bl, IoContext *ioc
     const char *cidkey_str = cid.c_str();
     const int   cidkey_len = (int)strlen(cidkey_str);
 
-    kvaio_t *aio = _aio_read(keyspace_sorted, KVS_OBJECT_SPLIT_SIZE, &bl, ioc);
+    kvaio_t *aio = _aio_read(keyspace_sorted, 0, &bl, ioc);
     aio->keylength = construct_collkey_impl(aio->key, cidkey_str, cidkey_len);
 }
 
@@ -298,7 +347,35 @@ void KvsStoreDB::aio_remove_coll(const coll_t &cid, IoContext *ioc)
 
     //TR << "trying to delete COLL - " << print_kvssd_key((char *) aio->key, aio->keylength);
 }
-int KvsStoreDB::read_onode(const ghobject_t &oid, bufferlist &bl)
+int KvsStoreDB::open(const std::string &devpath, bool create)
+{
+    FTRACE
+    if (cct) {
+        kadi.emul_param.read_lat_us    = cct->_conf->kvsstore_emul_read_latency_us;
+        kadi.emul_param.write_lat_us   = cct->_conf->kvsstore_emul_write_latency_us;
+        kadi.emul_param.delete_lat_us  = cct->_conf->kvsstore_emul_delete_latency_us;
+        kadi.emul_param.iter_lat_us    = cct->_conf->kvsstore_emul_iter_latency_us;
+        kadi.emul_param.xfer_us_per_kb = cct->_conf->kvsstore_emul_xfer_us_per_kb;
+        kadi.emul_param.queue_depth    = cct->_conf->kvsstore_emul_queue_depth;
+        kadi.num_queues = cct->_conf->kvsstore_aio_queues;
+        submit_queues.set_limits(cct->_conf->kvsstore_queue_depth, cct->_conf->kvsstore_queue_max_bytes);
+    }
+    int r = kadi.open(devpath, keyspace_sorted);
+    if (r == 0) {
+        index_ckpt = kvsstore_index_ckpt_t();
+        if (create) {
+            // stores created before the partitions keep their single onode index
+            index_ckpt.format = KVS_INDEX_FORMAT_PARTITIONED;
+            index_ckpt.has_collections = true;
+            r = write_index_checkpoint();
+        } else {
+            read_index_checkpoint();
+        }
+    }
+    return r;
+}
+
+int KvsStoreDB::read_onode(const ghobject_t &oid, bufferlist &bl, uint32_t size_hint)
 {
     FTRACE
     char keybuffer[256];
@@ -306,45 +383,79 @@ int KvsStoreDB::read_onode(const ghobject_t &oid, bufferlist &bl)
     key.key    = keybuffer;
     key.length = construct_onode_key(cct, oid, keybuffer);
 
-    kv_value value;
-    bufferptr bp = buffer::create_small_page_aligned(8192+4096);
-    value.value  = bp.c_str();
-    value.length = bp.length();
-    value.offset = 0;
-
-    int r =  this->kadi.kv_retrieve_sync(keyspace_sorted, &key, &value);
-
-    if (r == 0) {
-        bp.set_length(value.length);
-        bl.append(std::move(bp));
-    }
-    return r;
+    return _read_sync(keyspace_sorted, &key, bl, get_read_size(keyspace_sorted, size_hint));
 }
 // low level sync read function
 int KvsStoreDB::read_kvkey(kv_key *key, bufferlist &bl, bool sorted)
 {
     FTRACE
     const int keyspaceid = (sorted)? keyspace_sorted:keyspace_notsorted;
-    kv_value value;
+    return _read_sync(keyspaceid, key, bl);
+}
 
-    bufferptr bp = buffer::create_small_page_aligned(8192);
-    value.value  = bp.c_str();
-    value.length = bp.length();
-    value.offset = 0;
+// len 0: the read size hint of the key space, as in _aio_read
+int KvsStoreDB::_read_sync(int keyspaceid, kv_key *key, bufferlist &bl, uint32_t len)
+{
+    FTRACE
+    bool adaptive = (len == 0);
+    if (adaptive) {
+        len = get_read_hint(keyspaceid).get();
+    }
+
+    while (true) {
+        kv_value value;
+        bufferptr bp = buffer::create_small_page_aligned(len);
+        value.value  = bp.c_str();
+        value.length = bp.length();
+        value.offset = 0;
+
+        const ceph::mono_time start = submit_queues.observed()? ceph::mono_clock::now() : ceph::mono_time();
+        int r =  this->kadi.kv_retrieve_sync(keyspaceid, key, &value);
+        if (r != 0) return r;
+        submit_queues.observe(nvme_cmd_kv_retrieve, keyspaceid, value.length, start);
+
+        if (adaptive) {
+            get_read_hint(keyspaceid).observe(value.actual_value_size);
+        }
+        if (value.actual_value_size > bp.length()) {
+            read_retries++;
+            adaptive = false;
+            len = value.actual_value_size;
+            continue;
+        }
 
-    int r =  this->kadi.kv_retrieve_sync(keyspaceid, key, &value);
-    if (r == 0) {
         //TR << print_value(r, 0x90, key->key, key->length, value.value, value.length);
         bp.set_length(value.length);
         bl.append(std::move(bp));
+        return 0;
+    }
+}
+
+void KvsReadSizeHint::observe(uint32_t actual)
+{
+    const uint32_t cur = get();
+    if (actual > cur) {
+        larger++;
+    }
+    uint32_t m = window_max.load(std::memory_order_relaxed);
+    while (actual > m && !window_max.compare_exchange_weak(m, actual, std::memory_order_relaxed)) {}
+
+    if (++reads % WINDOW != 0) return;
+
+    // end of a window
+    const uint32_t misses = larger.exchange(0);
+    m = window_max.exchange(0);
+    if (misses * 16 > WINDOW) {
+        size = std::min(MAX_SIZE, std::max(cur, 1u << cbits(m - 1)));
+    } else if (m <= cur / 2 && cur > DEFAULT_READBUF_SIZE) {
+        size = std::max(DEFAULT_READBUF_SIZE, cur / 2);
     }
-    return r;
 }
 
 int KvsStoreDB::read_sb(bufferlist &bl) {
     FTRACE
     IoContext ioc(0, __func__ );
-    kvaio_t *aio = _aio_read(keyspace_notsorted, KVS_OBJECT_SPLIT_SIZE, &bl, &ioc);
+    kvaio_t *aio = _aio_read(keyspace_notsorted, 0, &bl, &ioc);
     aio->keylength =  construct_kvsbkey_impl(aio->key);
 
     return ioc.aio_submit_and_wait(&kadi, __func__);
@@ -542,77 +653,269 @@ int KvsStoreDB::syncio_submit(IoContext *ioc)
 KvsIterator *KvsStoreDB::get_iterator(uint32_t prefix)
 {
     FTRACE
-	return new KvsBptreeIterator(&kadi, keyspace_notsorted, prefix);
+	return new KvsBptreeIterator(&kadi, keyspace_notsorted, prefix, &index_cache);
 }
 
-uint64_t KvsStoreDB::compact() {
+// the onode index that holds the objects of the collection
+uint32_t KvsStoreDB::get_onode_tree(const coll_t &cid)
+{
+    spg_t pgid;
+    if (index_ckpt.format < KVS_INDEX_FORMAT_PARTITIONED || !cid.is_pg(&pgid)) {
+        return GROUP_PREFIX_ONODE;
+    }
+    return get_onode_partition(int8_t(pgid.shard) + 0x80, pgid.pool() + 0x8000000000000000ull);
+}
+
+KvsIterator *KvsStoreDB::get_onode_iterator(const coll_t &cid)
+{
+    FTRACE
+    return get_iterator(get_onode_tree(cid));
+}
+
+// applies a collection key of the oplog to a set of collection names
+static void update_collection_set(std::set<std::string> &names, int opcode, const char *key, int length) {
+    std::string name(key + sizeof(kvs_coll_key), length - sizeof(kvs_coll_key));
+    if (opcode == nvme_cmd_kv_store) {
+        names.insert(name);
+    } else if (opcode == nvme_cmd_kv_delete) {
+        names.erase(name);
+    }
+}
+
+// the checkpointed collections, updated with the oplog pages not indexed yet. the pages
+// are only read: the indexer applies them in the background.
+// returns false if the checkpoint has no collection set
+bool KvsStoreDB::list_collections(std::set<std::string> &names) {
+    FTRACE
+    _begin_index_update();
+    const bool found = index_ckpt.has_collections;
+    if (found) {
+        names = index_ckpt.collections;
+
+        struct oplog_info info(keyspace_sorted, 0xffffffff);
+        kadi.list_oplog(info,
+                [&] (int opcode, int groupid, uint64_t sequence, const char* key, int length) {
+                if (*(uint32_t*)key == GROUP_PREFIX_COLL) {
+                    update_collection_set(names, opcode, key, length);
+                }
+        });
+        TRI << "collections: " << index_ckpt.collections.size() << " checkpointed, "
+            << names.size() << " after " << info.oplogpage_keys.size() << " oplog pages";
+    }
+    _end_index_update();
+    return found;
+}
+
+// starts checkpointing the collection set of a store that did not have one.
+// the oplog must be fully indexed, and the set must match the collection tree
+int KvsStoreDB::set_collections(const std::set<std::string> &names) {
+    FTRACE
+    _begin_index_update();
+    index_ckpt.collections = names;
+    index_ckpt.has_collections = true;
+    const int r = write_index_checkpoint();
+    _end_index_update();
+    return r;
+}
+
+// reads the path to the first leaf of each tree into the index cache
+void KvsStoreDB::warmup_index(const std::set<uint32_t> &trees) {
+    FTRACE
+    if (cct && cct->_conf->kvsstore_index_cache_bytes == 0) return;
+    for (uint32_t treeid : trees) {
+        KvsBptreeIterator it(&kadi, keyspace_notsorted, treeid, &index_cache);
+        it.begin();
+    }
+}
+
+void KvsStoreDB::_begin_index_update() {
+    std::unique_lock<std::mutex> cl (compact_lock);
+    while (compaction_started) {
+        TRI << "wait...";
+        compact_cond.wait(cl);
+    }
+    compaction_started = true;
+}
+
+void KvsStoreDB::_end_index_update() {
+    std::unique_lock<std::mutex> cl (compact_lock);
+    compaction_started = false;
+    compact_cond.notify_all();
+}
+
+// applies the oldest max_pages oplog pages (all pages if 0) to the onode and collection trees
+uint64_t KvsStoreDB::compact(uint32_t max_pages) {
 	FTRACE
-    {
-        std::unique_lock<std::mutex> cl (compact_lock);
-        if (compaction_started) {
-            TRI << "wait...";
-            compact_cond.wait(cl);
-            return 0;
-        } else {
-            compaction_started = true;
-        }
-    };
+    _begin_index_update();
 
 	TRI << "started";
 	uint64_t processed_keys = 0;
-    uint64_t keys = 0;
-	bptree onode_tree(&kadi, keyspace_notsorted, GROUP_PREFIX_ONODE);
-	bptree  coll_tree(&kadi, keyspace_notsorted, GROUP_PREFIX_COLL);
-	bptree *tree;
+	const bool partitioned = (index_ckpt.format >= KVS_INDEX_FORMAT_PARTITIONED);
+	index_updates_t updates;
 
-	processed_keys = kadi.list_oplog(keyspace_sorted, 0xffffffff,
+	struct oplog_info info(keyspace_sorted, 0xffffffff);
+	info.max_pages = max_pages;
+
+	processed_keys = kadi.list_oplog(info,
 			[&] (int opcode, int groupid, uint64_t sequence, const char* key, int length) {
 
 			const uint32_t prefix = *(uint32_t*)key;
-            std::string treename = "";
+			uint32_t treeid;
 			if (prefix == GROUP_PREFIX_ONODE) {
-				tree = &onode_tree;
-                treename = "onode tree: ";
+				treeid = (partitioned)? get_onode_partition(key) : GROUP_PREFIX_ONODE;
 			} else if (prefix == GROUP_PREFIX_COLL) {
-				tree = &coll_tree;
-                treename = "coll tree: ";
+				treeid = GROUP_PREFIX_COLL;
+				// persisted with the checkpoint below
+				update_collection_set(index_ckpt.collections, opcode, key, length);
 			} else {
 				return;
 			}
-            //TR  << "found: opcode = " << opcode << ", key = " << print_key((const char*)key, length) << ", length = " << length ;
-			if (opcode == nvme_cmd_kv_store) {
-                //TR << "tree-insert " << treename << " key: " << print_kvssd_key(std::string((char*)key,length)) ;
-                tree->insert((char*)key, length);
-			} else if (opcode == nvme_cmd_kv_delete) {
-                //TR << "tree-remove " << treename << " key: " << print_kvssd_key(std::string((char*)key,length)) ;
-                tree->remove((char*)key, length);
-
+			if (opcode == nvme_cmd_kv_store || opcode == nvme_cmd_kv_delete) {
+				updates[treeid].emplace_back(opcode, std::string(key, length));
 			}
-
-                keys++;
-			//cout << "read: group"  << groupid << ", seq " << sequence << ", " << print_key((const char*)key, length) << ", length = " << length << endl;
 	});
 
-    TRI << "compaction 1: found and read " << processed_keys << " oplog pages, inserted/removed keys = " << keys ;
+    const uint32_t pages = info.oplogpage_keys.size();
 
-    onode_tree.flush();
+    TRI << "compaction 1: found " << info.pages_found << " oplog pages, read " << pages << ", inserted/removed keys = " << processed_keys
+        << ", trees = " << updates.size();
 
-    coll_tree.flush();
+    if (pages > 0) {
+        _apply_index_updates(updates);
 
-    TRI << "compaction 2: updated the index structure " ;
+        // the trees are persistent now. the pages are removed only after the checkpoint
+        // is written, so a crash in between replays them, which is idempotent.
+        index_ckpt.sequence = std::max(index_ckpt.sequence, info.last_sequence);
+        index_ckpt.pages   += pages;
+        write_index_checkpoint();
 
-    {
-        std::unique_lock<std::mutex> cl (compact_lock);
-        compaction_started = false;
-        compact_cond.notify_all();
-    };
+        kadi.delete_oplogpages(info);
+        index_pages_applied += pages;
+    }
+    index_pages_pending = info.pages_found - pages;
+
+    TRI << "compaction 2: updated the index structure, checkpoint sequence = " << index_ckpt.sequence;
+
+    _end_index_update();
     TRI << "finished";
 	return processed_keys;
 }
 
+// updates and stores each tree on its own, on up to kvsstore_index_threads threads
+void KvsStoreDB::_apply_index_updates(index_updates_t &updates) {
+    FTRACE
+    std::vector<index_updates_t::value_type*> trees;
+    for (auto &u : updates) {
+        trees.push_back(&u);
+    }
+
+    std::atomic<size_t> next = {0};
+    auto worker = [&] () {
+        for (size_t i = next++; i < trees.size(); i = next++) {
+            bptree tree(&kadi, keyspace_notsorted, trees[i]->first, &index_cache);
+            for (auto &op : trees[i]->second) {
+                if (op.first == nvme_cmd_kv_store) {
+                    tree.insert(&op.second[0], op.second.length());
+                } else {
+                    tree.remove(&op.second[0], op.second.length());
+                }
+            }
+            tree.flush();
+        }
+    };
+
+    const size_t nthreads = std::min<size_t>(trees.size(), (cct)? cct->_conf->kvsstore_index_threads : 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+// removes the onode index of a pool shard that has no collection and no objects left. the
+// oplog must be indexed up to the removal of its last collection. only the meta is removed
+// here, drop_partition_pages() removes the pages in the following rounds of the indexer
+void KvsStoreDB::drop_onode_partition(uint32_t treeid) {
+    FTRACE
+    if (treeid == GROUP_PREFIX_ONODE) return;
+
+    _begin_index_update();
+    {
+        bptree tree(&kadi, keyspace_notsorted, treeid, &index_cache);
+        if (!tree.meta->isnew) {
+            const uint64_t end = tree.drop_meta();
+            uint64_t &left = partition_drops[treeid];
+            left = std::max(left, end);
+            TRI << "dropped onode partition " << treeid << ", pages to remove = " << end - bptree_first_pgid(treeid);
+        }
+    }
+    _end_index_update();
+}
+
+// removes up to max_pages page ids of the dropped onode trees, from the last one down.
+// a tree written again in the meantime (a new collection of its pool shard) reuses the
+// page ids from the first one: its drop stops there. returns the page ids removed
+uint64_t KvsStoreDB::drop_partition_pages(uint64_t max_pages) {
+    FTRACE
+    uint64_t removed = 0;
+    _begin_index_update();
+    for (auto it = partition_drops.begin(); it != partition_drops.end() && removed < max_pages; ) {
+        const uint32_t treeid = it->first;
+        const uint64_t first = bptree_first_pgid(treeid);
+        bptree tree(&kadi, keyspace_notsorted, treeid, &index_cache);
+        if (!tree.meta->isnew || it->second <= first) {
+            it = partition_drops.erase(it);
+            continue;
+        }
+        const uint64_t from = std::max(first, it->second - std::min(it->second - first, max_pages - removed));
+        tree.drop_pages(from, it->second);
+        removed += it->second - from;
+        it->second = from;
+        ++it;
+    }
+    _end_index_update();
+    return removed;
+}
+
+int KvsStoreDB::read_index_checkpoint() {
+    FTRACE
+    char keybuffer[256];
+    kv_key k;
+    k.key = keybuffer;
+    k.length = construct_kvindexkey_impl(keybuffer);
+
+    bufferlist bl;
+    int r = read_kvkey(&k, bl, false);
+    if (r != 0) return r;   // not indexed yet
+
+    auto p = bl.cbegin();
+    decode(index_ckpt, p);
+    return 0;
+}
+
+int KvsStoreDB::write_index_checkpoint() {
+    FTRACE
+    char keybuffer[256];
+    bufferlist bl;
+    encode(index_ckpt, bl);
+
+    kv_value v;
+    v.value  = (void*)bl.c_str();
+    v.length = bl.length();
+    v.offset = 0;
+    kv_key k;
+    k.key = keybuffer;
+    k.length = construct_kvindexkey_impl(keybuffer);
+
+    return this->kadi.kv_store_sync(keyspace_notsorted, &k, &v);
+}
+
 
-KvsBptreeIterator::KvsBptreeIterator(KADI *adi, int ksid_skp, uint32_t prefix):
-        tree(adi,ksid_skp, prefix)
+KvsBptreeIterator::KvsBptreeIterator(KADI *adi, int ksid_skp, uint32_t prefix, bptree_node_cache *cache):
+        tree(adi,ksid_skp, prefix, cache, true)
 {
     FTRACE
     iter = tree.get_iterator();
@@ -2,6 +2,7 @@
 #define SRC_OS_KVSSTORE_KVSSTORE_KVCMDS_H_
 
 #include <map>
+#include <set>
 #include <atomic>
 #include "kvsstore_types.h"
 #include "kadi/kadi_cmds.h"
@@ -12,6 +13,10 @@ enum KVS_JOURNAL_ENTRY {
     KVS_JOURNAL_ENTRY_COLL  = 1
 };
 
+#define KVS_INDEX_FORMAT_GLOBAL       0   // one onode index for all collections
+#define KVS_INDEX_FORMAT_PARTITIONED  1   // an onode index per pool shard
+#define KVS_INDEX_DROP_PAGES          1024   // page ids of dropped onode indexes removed per indexer round
+
 #define KVS_ITERATOR_TYPE_SORTED    0
 #define KVS_ITERATOR_TYPE_INTORDER  1
 
@@ -30,9 +35,12 @@ static const uint32_t DEFAULT_READBUF_SIZE = 8192U;
 static const uint32_t KVS_OBJECT_SPLIT_SIZE = DEFAULT_READBUF_SIZE;
 
 #define KVS_OBJECT_SPLIT_SHIFT      13
+#define KVS_OBJECT_SPLIT_SHIFT_MIN  12  // 4 KiB
+#define KVS_OBJECT_SPLIT_SHIFT_MAX  21  // 2 MiB, the largest value a KV-SSD stores
 #define KVKEY_MAX_SIZE				255
 #define OMAP_KEY_MAX_SIZE 			241
 #define MAX_BATCH_VALUE_SIZE 		8192
+#define KVS_INLINE_MAX_SIZE 		4096    // keeps the onode within one onode read
 
 //# CACHE
 //-------------------------
@@ -46,10 +54,18 @@ static const uint32_t KVS_OBJECT_SPLIT_SIZE = DEFAULT_READBUF_SIZE;
 inline int align_4B(uint32_t length) { return ((length - 1) / 4 + 1)*4;   }
 
 
-inline uint16_t get_chunk_index(uint64_t offset) {
-    return (uint16_t) (offset >> KVS_OBJECT_SPLIT_SHIFT);
+inline uint16_t get_chunk_index(uint64_t offset, uint32_t shift = KVS_OBJECT_SPLIT_SHIFT) {
+    return (uint16_t) (offset >> shift);
+}
+
+// log2 of the chunk size the object data is stored with
+inline uint32_t get_chunk_shift(const kvsstore_onode_t &onode) {
+    return onode.chunk_shift ? onode.chunk_shift : KVS_OBJECT_SPLIT_SHIFT;
 }
 
+// called when each I/O operation finishes
+void aio_callback(kv_io_context &op, void *post_data);
+
 ///  ====================================================
 ///  Iterator Interface
 ///  ====================================================
@@ -76,7 +92,7 @@ class KvsBptreeIterator: public KvsIterator {
     bptree_iterator *iter;
 
 public:
-    KvsBptreeIterator(KADI *adi, int ksid_skp, uint32_t prefix);
+    KvsBptreeIterator(KADI *adi, int ksid_skp, uint32_t prefix, bptree_node_cache *cache);
 
     int begin() override;
     int end() override;
@@ -154,6 +170,29 @@ struct KvsJournal {
 };
 
 
+///  ====================================================
+///  Read size hints
+///  ====================================================
+
+/// default read buffer size of a key space, learned from the sizes of the values read.
+/// it grows when more than 1/16 of the values of a window did not fit, and halves
+/// when none of them needed more than half of it.
+class KvsReadSizeHint {
+    std::atomic<uint32_t> size;
+    std::atomic<uint32_t> reads = {0};
+    std::atomic<uint32_t> larger = {0};     ///< values of the window larger than size
+    std::atomic<uint32_t> window_max = {0};
+
+public:
+    static const uint32_t WINDOW = 1024;
+    static const uint32_t MAX_SIZE = 64*1024;
+
+    KvsReadSizeHint(): size(DEFAULT_READBUF_SIZE) {}
+
+    inline uint32_t get() const { return size.load(std::memory_order_relaxed); }
+    void observe(uint32_t actual);
+};
+
 class KvsStoreDB
 {
 public:
@@ -164,6 +203,18 @@ public:
 	std::mutex compact_lock;
 	std::condition_variable compact_cond;
 
+	// progress of the incremental oplog indexing
+	kvsstore_index_ckpt_t index_ckpt;
+	std::atomic<uint64_t> index_pages_applied = {0};
+	std::atomic<uint64_t> index_pages_pending = {0};
+	std::map<uint32_t, uint64_t> partition_drops;   ///< dropped onode trees -> end of the page ids left to remove (index thread)
+	bptree_node_cache index_cache;      ///< index nodes shared by the indexer and the iterators
+	kvaio_pool aio_pool;                ///< descriptors of the I/O contexts that have no pool of their own
+	kvsubmit_queues submit_queues;      ///< admission control of the device queue pairs
+
+	KvsReadSizeHint read_hints[2];      ///< sorted, not sorted key space
+	std::atomic<uint64_t> read_retries = {0};  ///< reads issued again with a larger buffer
+
     int keyspace_sorted = 0;
     int keyspace_notsorted = 1;
 
@@ -178,16 +229,38 @@ public:
     //kvaio_t* _syncio_remove(int keyspaceid, IoContext *ioc);
 
     kvaio_t* _aio_write(int keyspaceid, bufferlist &bl, IoContext *ioc);
-    kvaio_t* _aio_write(int keyspaceid, void *addr, uint32_t len, IoContext *ioc);
-    kvaio_t* _aio_remove(int keyspaceid, IoContext *ioc);
-    kvaio_t* _aio_read(int keyspaceid, uint32_t len, bufferlist *pbl, IoContext *ioc);
+    kvaio_t* _aio_write(int keyspaceid, void *addr, uint32_t len, IoContext *ioc, aio_callback_t cb = aio_callback);
+    kvaio_t* _aio_remove(int keyspaceid, IoContext *ioc, aio_callback_t cb = aio_callback);
+    kvaio_t* _aio_read(int keyspaceid, uint32_t len, bufferlist *pbl, IoContext *ioc, aio_callback_t cb = aio_callback);
+
+    inline kvaio_pool *_get_aio_pool(IoContext *ioc) {
+        if (ioc->aio_pool == nullptr) ioc->aio_pool = &aio_pool;
+        ioc->submit_queues = &submit_queues;
+        return ioc->aio_pool;
+    }
+    int _read_sync(int keyspaceid, kv_key *key, bufferlist &bl, uint32_t len = 0);
+
+    inline KvsReadSizeHint &get_read_hint(int keyspaceid) {
+        return read_hints[(keyspaceid == keyspace_sorted)? 0 : 1];
+    }
+
+    // buffer size for a value of about size_hint bytes: 0 (the key space default) unless it is too small
+    inline uint32_t get_read_size(int keyspaceid, uint32_t size_hint) {
+        return (size_hint > get_read_hint(keyspaceid).get())? p2roundup(size_hint, 4096u) : 0;
+    }
+
+    // chunks are addressed by the data key of chunk 0 of their object
+    std::string get_chunk_key(const ghobject_t &oid, uint64_t version);
+    void aio_read_chunk(const std::string &key, uint16_t chunkid, uint32_t len, bufferlist &bl, IoContext *ioc, aio_callback_t cb = aio_callback);
+    void aio_write_chunk(const std::string &key, uint16_t chunkid, void *addr, uint32_t len, IoContext *ioc, aio_callback_t cb = aio_callback);
+    void aio_remove_chunk(const std::string &key, uint16_t chunkid, IoContext *ioc, aio_callback_t cb = aio_callback);
 
-    void aio_read_chunk(const ghobject_t &oid, uint16_t chunkid, uint32_t len, bufferlist &bl, IoContext *ioc);
-    void aio_write_chunk(const ghobject_t &oid, uint16_t chunkid, void *addr, uint32_t len, IoContext *ioc);
-    void aio_remove_chunk(const ghobject_t &oid, uint16_t chunkid, IoContext *ioc);
+    int  read_blob(uint64_t sid, bufferlist &bl);
+    void aio_write_blob(uint64_t sid, bufferlist &bl, IoContext *ioc);
+    void aio_remove_blob(uint64_t sid, IoContext *ioc);
 
-    int  read_onode(const ghobject_t &oid, bufferlist &bl);
-    void aio_read_onode(const ghobject_t &oid, bufferlist &bl, IoContext *ioc);
+    int  read_onode(const ghobject_t &oid, bufferlist &bl, uint32_t size_hint = 0);
+    void aio_read_onode(const ghobject_t &oid, bufferlist &bl, IoContext *ioc, uint32_t size_hint = 0, aio_callback_t cb = aio_callback);
     void aio_write_onode(const ghobject_t &oid, bufferlist &bl, IoContext *ioc);
     void aio_remove_onode(const ghobject_t &oid, IoContext *ioc);
 
@@ -195,7 +268,7 @@ public:
     int aio_read_omap_keyblock(uint64_t nid, uint32_t start_id, uint32_t end_id, std::vector<bufferlist*> &bls);
     int aio_delete_omap_keyblock(uint64_t nid, uint32_t startid, uint32_t endid, IoContext &ioc);
 
-    void aio_read_omap( const uint64_t index, const std::string &strkey, bufferlist &bl, IoContext *ioc);
+    void aio_read_omap( const uint64_t index, const std::string &strkey, bufferlist &bl, IoContext *ioc, uint32_t size_hint = 0);
     void aio_write_omap( uint64_t index, const std::string &strkey, bufferlist &bl, IoContext *ioc);
     void aio_remove_omap( uint64_t index, const std::string &strkey, IoContext *ioc);
 
@@ -220,16 +293,27 @@ public:
 
 
 
-    inline int poll_completion(uint32_t &num_events, uint32_t timeout_us) {	return kadi.poll_completion(num_events, timeout_us); }
+    inline int poll_completion(uint32_t &num_events, uint32_t timeout_us, int qid = 0) {	return kadi.poll_completion(num_events, timeout_us, qid); }
 
 
-    inline int open(const std::string &devpath) {return kadi.open(devpath, keyspace_sorted);	}
+    int open(const std::string &devpath, bool create = false);
     inline int close() { return kadi.close(); }
     inline bool is_opened() { return kadi.is_opened(); }
 
-    uint64_t compact();
+    uint64_t compact(uint32_t max_pages = 0);
+    int read_index_checkpoint();
+    int write_index_checkpoint();
     KvsIterator *get_iterator(uint32_t prefix);
 
+    bool list_collections(std::set<std::string> &names);
+    int set_collections(const std::set<std::string> &names);
+    void warmup_index(const std::set<uint32_t> &trees);
+
+    uint32_t get_onode_tree(const coll_t &cid);
+    KvsIterator *get_onode_iterator(const coll_t &cid);
+    void drop_onode_partition(uint32_t treeid);
+    uint64_t drop_partition_pages(uint64_t max_pages);
+
 
 
 	inline int get_freespace(uint64_t &bytesused, uint64_t &capacity, double &utilization) {
@@ -246,6 +330,13 @@ public:
 	}
 
 private:
+    // oplog updates (opcode, key) of each tree
+    typedef std::map<uint32_t, std::vector<std::pair<int, std::string> > > index_updates_t;
+
+    void _begin_index_update();
+    void _end_index_update();
+    void _apply_index_updates(index_updates_t &updates);
+
 	inline int kvkey_lex_compare(unsigned char* first1, unsigned char* last1, unsigned char* first2, unsigned char* last2)
 	{
 		for ( ; (first1 != last1) && (first2 != last2); ++first1, (void) ++first2 ) {
@@ -1,8 +1,14 @@
 #include "kvsstore_omap.h"
 #include "kvsstore_types.h"
 #include "kvsstore_debug.h"
-// 5K
-#define OMAP_WRITEBUFER_LEN 5120
+#include <algorithm>
+
+// the delta log is merged into the pages once it grows beyond this
+#define OMAP_DELTA_MAX          2048U
+// fill level of the pages written when a page is split
+#define OMAP_PAGE_FILL          6144U
+// number of pages cached per onode
+#define OMAP_PAGE_CACHE_MAX     16U
 
 
 void kvsstore_omap_list::insert_keys_from_buffer(char *buf, uint32_t endpos, std::set<std::string> &to) {
@@ -35,143 +41,337 @@ int kvsstore_omap_list::decompress(CephContext* cct, bufferlist &in, bufferlist
     return cp->decompress(in, out);
 }
 
-void kvsstore_omap_list::load_omap(CephContext* cct, const readfunc_t &reader) {
+bool kvsstore_omap_list::_has_legacy_keys() const {
+    return onode->omap_keys.length() > 0 || (onode->omap_wb.have_raw() && onode->omap_wb.length() > 0);
+}
+
+void kvsstore_omap_list::_load_delta(CephContext* cct) {
     FTRACE
-//    TRU << "loading omap: buffer length " << onode->omap_bp.length() << ", omaps = " << onode->omaps.size();
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    if (cache.delta_loaded) return;
 
+    // keys of the old compressed format are treated as pending insertions
     if (onode->omap_keys.length() > 0) {
         bufferlist data;
-
+        std::set<std::string> keys;
         decompress(cct, onode->omap_keys, data);
-        TRC << "decompress: before " << onode->omap_keys.length() << ", after " << data.length();
+        insert_keys_from_buffer(data.c_str(), data.length(), keys);
+        for (const std::string &k : keys) cache.delta[k] = true;
+    }
+    if (onode->omap_wb.have_raw() && onode->omap_wb.length() > 0) {
+        std::set<std::string> keys;
+        insert_keys_from_buffer(onode->omap_wb.c_str(), onode->omap_wb.length(), keys);
+        for (const std::string &k : keys) cache.delta[k] = true;
+    }
+
+    // delta records: [op][key length][key], replayed in order
+    if (onode->omap_delta.length() > 0) {
+        const char *buf = onode->omap_delta.c_str();
+        const uint32_t endpos = onode->omap_delta.length();
+        uint32_t curpos = 0;
+        while (curpos < endpos) {
+            const bool set = *(uint8_t*) (buf + curpos); curpos += sizeof(uint8_t);
+            const int stringlen = *(uint8_t*) (buf + curpos); curpos += sizeof(uint8_t);
+            cache.delta[std::string(buf + curpos, stringlen)] = set;
+            curpos += stringlen;
+        }
+    }
+    cache.delta_loaded = true;
+}
 
-        insert_keys_from_buffer(data.c_str(), data.length(), onode->omaps);
+void kvsstore_omap_list::_append_delta(const std::string &key, bool set) {
+    const uint8_t rec[2] = { (uint8_t)set, (uint8_t)key.length() };
+    onode->omap_delta.append((const char*)rec, sizeof(rec));
+    onode->omap_delta.append(key.c_str(), rec[1]);
+    onode->omap_cache.delta[key] = set;
+    onode->omap_dirty = true;
+}
 
+bool kvsstore_omap_list::_load_dir(const readfunc_t &reader) {
+    FTRACE
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    if (cache.dir_loaded) return true;
+    if (onode->omap_dir_block == 0) {
+        cache.dir_loaded = true;
+        return true;
     }
 
-    if (onode->omap_wb.have_raw() && onode->omap_wb.length() > 0) {
-        insert_keys_from_buffer(onode->omap_wb.c_str(), onode->omap_wb.length(), onode->omaps);
+    const uint32_t nblocks = (onode->omap_dir_length + DEFAULT_OMAPBUF_SIZE - 1) / DEFAULT_OMAPBUF_SIZE;
+    std::vector<bufferlist*> bls;
+    if (!reader(onode->nid, onode->omap_dir_block, onode->omap_dir_block + nblocks, bls)) {
+        TRERR << "failed to read the omap directory of nid " << onode->nid;
+        return false;
     }
-    onode->omap_loaded = true;
 
+    bufferlist bl;
+    for (bufferlist *b : bls) {
+        bl.claim_append(*b);
+        delete b;
+    }
+    auto p = bl.cbegin();
+    decode(cache.dir, p);
+    cache.dir_loaded = true;
+    return true;
+}
+
+const std::set<std::string>* kvsstore_omap_list::_load_page(uint32_t block, const readfunc_t &reader) {
+    FTRACE
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    auto it = cache.pages.find(block);
+    if (it != cache.pages.end()) return &it->second;
+
+    std::vector<bufferlist*> bls;
+    if (!reader(onode->nid, block, block + 1, bls)) {
+        TRERR << "failed to read omap page " << block << " of nid " << onode->nid;
+        return nullptr;
+    }
+
+    // block ids are never reused, so evicting the oldest pages first is enough
+    if (cache.pages.size() >= OMAP_PAGE_CACHE_MAX) {
+        cache.pages.erase(cache.pages.begin());
+    }
+    std::set<std::string> &keys = cache.pages[block];
+    insert_keys_from_buffer(bls[0]->c_str(), bls[0]->length(), keys);
+    delete bls[0];
+    return &keys;
 }
 
+std::map<std::string, uint32_t>::const_iterator kvsstore_omap_list::_find_page(const std::string &key) const {
+    // a page holds the keys from its first key up to the first key of the next page,
+    // keys before the first page belong to the first page
+    const std::map<std::string, uint32_t> &dir = onode->omap_cache.dir;
+    auto it = dir.upper_bound(key);
+    if (it != dir.begin()) --it;
+    return it;
+}
 
-void kvsstore_omap_list::flush(CephContext* cct, IoContext &ioc, const writefunc_t &writer, std::vector<bufferlist*> &tempbuffers)
+void kvsstore_omap_list::_write_pages(const std::set<std::string> &keys, std::map<std::string, uint32_t> &newdir,
+                                      IoContext &ioc, const writefunc_t &writer, std::vector<bufferlist*> &tempbuffers)
 {
     FTRACE
-    if (onode->omap_dirty) {
-        if (onode->omaps.size() > 0) {
-            uint32_t max_buffersize = onode->omaps.size() * 256;
-            bufferptr buffer = buffer::create_small_page_aligned(max_buffersize);
-            buffer.set_length(0);
-
-            for (const std::string &k : onode->omaps) {
-                serialize_key(k, buffer);
-            }
+    uint32_t total = 0;
+    for (const std::string &k : keys) total += k.length() + 1;
+
+    // keep the page whole if it fits, otherwise split it leaving room for later insertions
+    const uint32_t fill = (total <= DEFAULT_OMAPBUF_SIZE)? DEFAULT_OMAPBUF_SIZE : OMAP_PAGE_FILL;
+
+    auto it = keys.begin();
+    while (it != keys.end()) {
+        bufferptr buffer = buffer::create_small_page_aligned(DEFAULT_OMAPBUF_SIZE);
+        buffer.set_length(0);
+        const std::string &first = *it;
+        while (it != keys.end() && buffer.length() + it->length() + 1 <= fill) {
+            serialize_key(*it, buffer);
+            ++it;
+        }
 
-            bufferlist in;
-            in.push_back(std::move(buffer));
+        const uint32_t block = onode->omap_next_block++;
+        bufferlist *bl = new bufferlist();
+        bl->push_back(std::move(buffer));
+        tempbuffers.push_back(bl);
+        writer(onode->nid, bl, block, ioc);
+        newdir[first] = block;
+    }
+}
 
-            compress(cct, in, onode->omap_keys);
+void kvsstore_omap_list::_merge(CephContext* cct, IoContext &ioc, const writefunc_t &writer, const removefunc_t &remover,
+                                const readfunc_t &reader, std::vector<bufferlist*> &tempbuffers)
+{
+    FTRACE
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    if (!_load_dir(reader)) {
+        ceph_abort_msg("failed to read the omap directory");
+    }
 
-            TRC << "compressed data: " << in.length() << "->" << onode->omap_keys.length();
-            onode->omaps.clear();
-            onode->omap_loaded = false;
-            if (onode->omap_wb.have_raw()) {
-                onode->omap_wb.set_length(0);
-            }
+    // rewrite only the pages that the delta touches, under new block ids
+    std::map<std::string, uint32_t> newdir;
+    auto d = cache.delta.begin();
+    if (cache.dir.empty()) {
+        std::set<std::string> keys;
+        for (; d != cache.delta.end(); ++d) {
+            if (d->second) keys.insert(keys.end(), d->first);
+        }
+        _write_pages(keys, newdir, ioc, writer, tempbuffers);
+    }
 
+    for (auto p = cache.dir.begin(); p != cache.dir.end(); ++p) {
+        auto next = std::next(p);
+        auto dend = (next == cache.dir.end())? cache.delta.end() : cache.delta.lower_bound(next->first);
+        if (d == dend) {
+            newdir.insert(newdir.end(), *p);
+            continue;
         }
-        onode->omap_dirty = false;
+
+        const std::set<std::string> *page = _load_page(p->second, reader);
+        if (page == nullptr) {
+            ceph_abort_msg("failed to read an omap page");
+        }
+        std::set<std::string> keys(*page);
+        for (; d != dend; ++d) {
+            if (d->second)
+                keys.insert(d->first);
+            else
+                keys.erase(d->first);
+        }
+
+        remover(onode->nid, p->second, p->second + 1, ioc);
+        cache.pages.erase(p->second);
+        _write_pages(keys, newdir, ioc, writer, tempbuffers);
     }
 
-}
+    TRC << "omap merge: nid " << onode->nid << ", delta " << cache.delta.size() << " keys, pages " << cache.dir.size() << "->" << newdir.size();
 
-void kvsstore_omap_list::insert(CephContext* cct, const std::string &key, const readfunc_t &reader) {
-    FTRACE
-    if (onode->omap_loaded) {
-        onode->omaps.insert(key);
-        onode->omap_dirty = true;
+    // replace the directory
+    if (onode->omap_dir_block != 0) {
+        const uint32_t nblocks = (onode->omap_dir_length + DEFAULT_OMAPBUF_SIZE - 1) / DEFAULT_OMAPBUF_SIZE;
+        remover(onode->nid, onode->omap_dir_block, onode->omap_dir_block + nblocks, ioc);
+        onode->omap_dir_block = 0;
+        onode->omap_dir_length = 0;
+    }
+    if (!newdir.empty()) {
+        bufferlist dirbl;
+        encode(newdir, dirbl);
+        onode->omap_dir_block = onode->omap_next_block;
+        onode->omap_dir_length = dirbl.length();
+        for (uint32_t off = 0; off < dirbl.length(); off += DEFAULT_OMAPBUF_SIZE) {
+            bufferlist *bl = new bufferlist();
+            bl->substr_of(dirbl, off, std::min(DEFAULT_OMAPBUF_SIZE, dirbl.length() - off));
+            tempbuffers.push_back(bl);
+            writer(onode->nid, bl, onode->omap_next_block++, ioc);
+        }
     }
+    cache.dir.swap(newdir);
 
-    if (!onode->omap_wb.have_raw()) {
-        onode->omap_wb = buffer::create_small_page_aligned(2048);
+    cache.delta.clear();
+    onode->omap_delta.clear();
+    onode->omap_keys.clear();
+    if (onode->omap_wb.have_raw()) {
         onode->omap_wb.set_length(0);
     }
+}
 
-    if (onode->omap_wb.length() + key.length() + 1 > 2048) {
-        load_omap(cct, reader);
-        onode->omaps.insert(key);
-        onode->omap_dirty = true;
-        onode->omap_wb.set_length(0);
-    } else {
-        serialize_key(key, onode->omap_wb);
+void kvsstore_omap_list::flush(CephContext* cct, IoContext &ioc, const writefunc_t &writer, const removefunc_t &remover,
+                               const readfunc_t &reader, std::vector<bufferlist*> &tempbuffers)
+{
+    FTRACE
+    std::lock_guard l(onode->omap_cache.lock);
+    if (!onode->omap_dirty) return;
+    onode->omap_dirty = false;
+
+    _load_delta(cct);
+
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    if (onode->omap_dir_block == 0 && !_has_legacy_keys() &&
+        std::none_of(cache.delta.begin(), cache.delta.end(), [] (const auto &d) { return d.second; })) {
+        // only removals of keys that are no longer there
+        cache.delta.clear();
+        onode->omap_delta.clear();
+        return;
     }
 
-#if 0
-    if (!onode->omap_loaded) {
-        load_omap(cct, reader);
+    if (onode->omap_delta.length() > OMAP_DELTA_MAX || _has_legacy_keys()) {
+        _merge(cct, ioc, writer, remover, reader, tempbuffers);
     }
+}
 
-    onode->omaps.insert(key);
-    onode->omap_dirty = true;
-#endif
-};
+void kvsstore_omap_list::insert(CephContext* cct, const std::string &key, const readfunc_t &reader) {
+    FTRACE
+    std::lock_guard l(onode->omap_cache.lock);
+    _load_delta(cct);
+    _append_delta(key, true);
+}
 
-void kvsstore_omap_list::clear(IoContext &ioc, const removefunc_t &removefunc)
+void kvsstore_omap_list::clear(IoContext &ioc, const removefunc_t &removefunc, const readfunc_t &reader)
 {
     FTRACE
-    // clear write buffer
-    if (onode->omap_keys.length() > 0 && onode->omap_keys.get_num_buffers() > 0)
-        onode->omap_keys.clear();
+    std::lock_guard l(onode->omap_cache.lock);
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+
+    if (_load_dir(reader)) {
+        for (const auto &p : cache.dir) {
+            removefunc(onode->nid, p.second, p.second + 1, ioc);
+        }
+    }
+    if (onode->omap_dir_block != 0) {
+        const uint32_t nblocks = (onode->omap_dir_length + DEFAULT_OMAPBUF_SIZE - 1) / DEFAULT_OMAPBUF_SIZE;
+        removefunc(onode->nid, onode->omap_dir_block, onode->omap_dir_block + nblocks, ioc);
+    }
+
+    onode->omap_dir_block = 0;
+    onode->omap_dir_length = 0;
+    onode->omap_delta.clear();
+    onode->omap_keys.clear();
     if (onode->omap_wb.have_raw()) {
         onode->omap_wb.set_length(0);
     }
-    onode->omaps.clear();
+    cache.reset();
+    cache.delta_loaded = true;
+    cache.dir_loaded = true;
     onode->omap_dirty = false;
-
 }
 
 bool kvsstore_omap_list::erase (CephContext *cct, const std::string &key, const readfunc_t &reader) {
     FTRACE
-
-    if (!onode->omap_loaded) {
-        load_omap(cct, reader);
-    }
-
-    const bool erased = (onode->omaps.erase(key) > 0);
-    onode->omap_dirty |= erased;
-
-    return erased;
+    std::lock_guard l(onode->omap_cache.lock);
+    _load_delta(cct);
+    _append_delta(key, false);
+    return true;
 };
 
 bool kvsstore_omap_list::erase(CephContext *cct, const std::string &first, const std::string &last, const readfunc_t &reader, const listenerfunc_t &listener) {
     FTRACE
-
-    if (!onode->omap_loaded) {
-        load_omap(cct, reader);
+    std::lock_guard l(onode->omap_cache.lock);
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    _load_delta(cct);
+    if (!_load_dir(reader)) {
+        ceph_abort_msg("failed to read the omap directory");
     }
 
-    auto before = onode->omaps.size();
-    std::set<std::string>::iterator p = onode->omaps.lower_bound(first);
-    std::set<std::string>::iterator e = onode->omaps.lower_bound(last);
+    // only the pages that overlap [first, last) are read
+    std::set<std::string> found;
+    if (!cache.dir.empty()) {
+        for (auto p = _find_page(first); p != cache.dir.end() && p->first < last; ++p) {
+            const std::set<std::string> *page = _load_page(p->second, reader);
+            if (page == nullptr) {
+                ceph_abort_msg("failed to read an omap page");
+            }
+            found.insert(page->lower_bound(first), page->lower_bound(last));
+        }
+    }
+    for (auto d = cache.delta.lower_bound(first); d != cache.delta.end() && d->first < last; ++d) {
+        if (d->second)
+            found.insert(d->first);
+        else
+            found.erase(d->first);
+    }
 
-    while (p != e) {
-        listener(*p);
-        onode->omaps.erase(p++);
+    for (const std::string &key : found) {
+        listener(key);
+        _append_delta(key, false);
     }
-    auto erased = (onode->omaps.size() - before > 0);
-    onode->omap_dirty |= erased;
-    return erased;
+    return !found.empty();
 }
 
 int kvsstore_omap_list::list(CephContext *cct,std::set<std::string> *out, const readfunc_t &reader){
     FTRACE
-    if (!onode->omap_loaded) {
-        load_omap(cct, reader);
+    std::lock_guard l(onode->omap_cache.lock);
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    _load_delta(cct);
+    if (!_load_dir(reader)) return -EIO;
+
+    std::set<std::string> keys;
+    for (const auto &p : cache.dir) {
+        const std::set<std::string> *page = _load_page(p.second, reader);
+        if (page == nullptr) return -EIO;
+        keys.insert(page->begin(), page->end());
+    }
+    for (const auto &d : cache.delta) {
+        if (d.second)
+            keys.insert(d.first);
+        else
+            keys.erase(d.first);
     }
-    out->insert(onode->omaps.begin(), onode->omaps.end());
+    out->insert(keys.begin(), keys.end());
     TRU << "list done: output = " << out->size();
     return 0;
 }
@@ -179,14 +379,72 @@ int kvsstore_omap_list::list(CephContext *cct,std::set<std::string> *out, const
 int kvsstore_omap_list::lookup(CephContext *cct,const std::set<std::string> &keys, std::set<std::string> *out, const readfunc_t &reader)
 {
     FTRACE
-    if (!onode->omap_loaded) {
-        load_omap(cct, reader);
-    }
+    std::lock_guard l(onode->omap_cache.lock);
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    _load_delta(cct);
+    if (!_load_dir(reader)) return -EIO;
+
     for (const std::string &key : keys) {
         TRU << "lookup " << key;
-        if (onode->omaps.find(key) != onode->omaps.end())
+        auto d = cache.delta.find(key);
+        if (d != cache.delta.end()) {
+            if (d->second) out->insert(key);
+            continue;
+        }
+        if (cache.dir.empty()) continue;
+
+        const std::set<std::string> *page = _load_page(_find_page(key)->second, reader);
+        if (page == nullptr) return -EIO;
+        if (page->find(key) != page->end())
             out->insert(key);
     }
     TRU << "lookup done: output = " << out->size();
     return 0;
 }
+
+// returns up to max keys in order, starting at from, reading only the pages that hold them
+int kvsstore_omap_list::list_range(CephContext *cct, const std::string &from, bool inclusive, uint32_t max,
+                                   std::vector<std::string> *out, const readfunc_t &reader)
+{
+    FTRACE
+    std::lock_guard l(onode->omap_cache.lock);
+    kvsstore_omap_cache_t &cache = onode->omap_cache;
+    _load_delta(cct);
+    if (!_load_dir(reader)) return -EIO;
+
+    auto d = (inclusive)? cache.delta.lower_bound(from) : cache.delta.upper_bound(from);
+    if (cache.dir.empty()) {
+        for (; d != cache.delta.end() && out->size() < max; ++d) {
+            if (d->second) out->push_back(d->first);
+        }
+        return 0;
+    }
+
+    for (auto p = _find_page(from); p != cache.dir.end() && out->size() < max; ++p) {
+        auto next = std::next(p);
+        auto dend = (next == cache.dir.end())? cache.delta.end() : cache.delta.lower_bound(next->first);
+
+        const std::set<std::string> *page = _load_page(p->second, reader);
+        if (page == nullptr) return -EIO;
+        auto k = (inclusive)? page->lower_bound(from) : page->upper_bound(from);
+
+        // merge the page with the delta entries that fall into it
+        while (out->size() < max) {
+            const bool has_k = (k != page->end());
+            const bool has_d = (d != dend);
+            if (!has_k && !has_d) break;
+
+            if (has_d && (!has_k || d->first <= *k)) {
+                if (has_k && d->first == *k) ++k;
+                if (d->second) out->push_back(d->first);
+                ++d;
+            } else {
+                out->push_back(*k);
+                ++k;
+            }
+        }
+        d = dend;
+    }
+    TRU << "list range done: output = " << out->size();
+    return 0;
+}
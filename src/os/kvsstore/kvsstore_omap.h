@@ -8,12 +8,46 @@
 #include "include/buffer.h"
 #include "compressor/Compressor.h"
 #include <set>
+#include <map>
+#include <mutex>
 #include <functional>
 
 #define DEFAULT_OMAPBUF_SIZE 8192U
 
 struct IoContext;
 
+/// in-memory state of the paged omap key index, not encoded
+///
+/// The keys of an object are kept in sorted pages of at most
+/// DEFAULT_OMAPBUF_SIZE bytes, stored as omap key blocks. A directory that
+/// maps the first key of each page to its block id is stored in one or more
+/// consecutive key blocks. Recent changes are appended to a delta log in the
+/// onode and merged into the affected pages once the log grows too large.
+struct kvsstore_omap_cache_t {
+    std::mutex lock;
+    bool delta_loaded = false;
+    std::map<std::string, bool> delta;               ///< pending changes: true = set, false = removed
+    bool dir_loaded = false;
+    std::map<std::string, uint32_t> dir;             ///< first key of a page -> block id
+    std::map<uint32_t, std::set<std::string>> pages; ///< recently read pages by block id
+
+    kvsstore_omap_cache_t() {}
+    // a copied onode starts with an empty cache
+    kvsstore_omap_cache_t(const kvsstore_omap_cache_t &) {}
+    kvsstore_omap_cache_t& operator=(const kvsstore_omap_cache_t &) {
+        reset();
+        return *this;
+    }
+
+    void reset() {
+        delta_loaded = false;
+        delta.clear();
+        dir_loaded = false;
+        dir.clear();
+        pages.clear();
+    }
+};
+
 struct kvsstore_omap_list {
 private:
     struct kvsstore_onode_t *onode;
@@ -30,35 +64,30 @@ public:
     }
 
     void insert(CephContext* cct, const std::string &key, const readfunc_t &reader);
-    void load_omap(CephContext* cct, const readfunc_t &reader);
-    void flush(CephContext* cct, IoContext &ioc, const writefunc_t &writer, std::vector<bufferlist*> &tempbuffers);
+    void flush(CephContext* cct, IoContext &ioc, const writefunc_t &writer, const removefunc_t &remover, const readfunc_t &reader, std::vector<bufferlist*> &tempbuffers);
     int  compress(CephContext* cct, bufferlist &in, bufferlist &out);
     int  decompress(CephContext* cct, bufferlist &in, bufferlist &out);
     bool erase (CephContext* cct, const std::string &key, const readfunc_t &readfunc);
     bool erase(CephContext* cct, const std::string &first, const std::string &last, const readfunc_t &readfunc, const listenerfunc_t &listener);
-    void clear(IoContext &ioc, const removefunc_t &removefunc);
+    void clear(IoContext &ioc, const removefunc_t &removefunc, const readfunc_t &readfunc);
     int list(CephContext* cct,std::set<std::string> *out, const readfunc_t &readfunc);
     int lookup(CephContext* cct,const std::set<std::string> &keys, std::set<std::string> *out, const readfunc_t &readfunc);
+    int list_range(CephContext* cct, const std::string &from, bool inclusive, uint32_t max, std::vector<std::string> *out, const readfunc_t &readfunc);
     void insert_keys_from_buffer(char *buf, uint32_t endpos, std::set<std::string> &to);
     void serialize_key(const std::string &key, bufferptr &buffer);
 
-/*
-    int lookup(const std::set<std::string> &keys, std::set<std::string> *out, const readfunc_t &readfunc){ return 0; }
-    int list(std::set<std::string> *out, const readfunc_t &readfunc){ return 0; }
-    void prepare_encoding(const std::function< void (uint64_t, std::vector<bufferlist*>&, int , IoContext &ctx)> &writefunc, const removefunc_t &removefunc){ return; }
-    bool erase (const std::string &key, const readfunc_t &readfunc) { return true; }
-    bool erase(const std::string &first, const std::string &last, const readfunc_t &readfunc, const listenerfunc_t &listener){ return true; }
-
-    kvsstore_omap_list(struct kvsstore_onode_t *onode_):onode(onode_) {
-
-    }
-    void insert( const std::string &key) {
-        return;
-    }
-    void clear(const removefunc_t &removefunc) {
-        return;
-    }
-    */
+private:
+    // called with onode->omap_cache.lock held
+    void _load_delta(CephContext* cct);
+    void _append_delta(const std::string &key, bool set);
+    bool _load_dir(const readfunc_t &reader);
+    const std::set<std::string>* _load_page(uint32_t block, const readfunc_t &reader);
+    std::map<std::string, uint32_t>::const_iterator _find_page(const std::string &key) const;
+    void _write_pages(const std::set<std::string> &keys, std::map<std::string, uint32_t> &newdir,
+                      IoContext &ioc, const writefunc_t &writer, std::vector<bufferlist*> &tempbuffers);
+    void _merge(CephContext* cct, IoContext &ioc, const writefunc_t &writer, const removefunc_t &remover,
+                const readfunc_t &reader, std::vector<bufferlist*> &tempbuffers);
+    bool _has_legacy_keys() const;
 };
 
 
@@ -106,17 +106,24 @@ KvsStoreTypes::OnodeRef KvsStoreTypes::Collection::get_onode(const ghobject_t &o
 		}
 	}
 
+	// the caller may change the onode: a prefetch in flight could cache an older one
+	if (num_prefetching.load()) {
+		invalidate_prefetch(oid);
+	}
+
 	KvsStoreTypes::OnodeRef o = onode_map.lookup(oid);
 	if (o) {
+        onode_map.cache->logger->inc(l_kvsstore_onode_hits);
         return o;
     }
+    onode_map.cache->logger->inc(l_kvsstore_onode_misses);
 
 	bufferlist v;
     int r = KV_ERR_KEY_NOT_EXIST;
 	KvsStoreTypes::Onode *on;
 
 	if (!is_createop) {
-	    r = store->db.read_onode(oid, v);
+	    r = store->db.read_onode(oid, v, onode_size_hint);
 	}
 
 	if (r == KV_ERR_KEY_NOT_EXIST) {
@@ -125,6 +132,7 @@ KvsStoreTypes::OnodeRef KvsStoreTypes::Collection::get_onode(const ghobject_t &o
 		// new object, new onode
 		on = new KvsStoreTypes::Onode(this, oid);
 	} else if (r == KV_SUCCESS) {
+		if (v.length() > onode_size_hint) onode_size_hint = v.length();
 		on = KvsStoreTypes::Onode::decode(this, oid, v);
     } else {
 		TRERR << "KV I/O error: ret = " << r ;
@@ -136,6 +144,15 @@ KvsStoreTypes::OnodeRef KvsStoreTypes::Collection::get_onode(const ghobject_t &o
 }
 
 
+void KvsStoreTypes::Collection::invalidate_prefetch(const ghobject_t &oid) {
+    FTRACE
+    std::lock_guard<std::mutex> l(prefetch_lock);
+    auto it = prefetching.find(oid);
+    if (it != prefetching.end()) {
+        it->second = false;
+    }
+}
+
 void KvsStoreTypes::Collection::split_cache(Collection *dest) {
     FTRACE
     ldout(store->cct, 10) << __func__ << " to " << dest << dendl;
@@ -209,7 +226,7 @@ void KvsStoreTypes::TransContext::aio_finish(KvsStore *store) {
 
 KvsStoreTypes::OpSequencer::OpSequencer(KvsStore *store, uint32_t sequencer_id, const coll_t &c)
 	: RefCountedObject(store->cct),
-	store(store), cid(c), sequencer_id(sequencer_id) {
+	store(store), cid(c), aio_pool(store->cct->_conf->kvsstore_aio_pool_size), sequencer_id(sequencer_id) {
 }
 
 
@@ -75,18 +75,58 @@ struct kvsstore_sb_t {
 };
 
 
+/// progress of the oplog indexer
+struct kvsstore_index_ckpt_t {
+    uint64_t sequence;      ///< highest oplog page sequence applied to the index
+    uint64_t pages;         ///< number of oplog pages applied so far
+    uint32_t format;        ///< KVS_INDEX_FORMAT_*, fixed at mkfs
+    bool has_collections;   ///< false until the collection set below is complete
+    std::set<std::string> collections;  ///< names of the collections in the indexed oplog
+
+    explicit kvsstore_index_ckpt_t(): sequence(0), pages(0), format(0), has_collections(false) {}
+
+    DENC(kvsstore_index_ckpt_t, v, p) {
+        DENC_START(3, 1, p);
+            denc(v.sequence, p);
+            denc(v.pages, p);
+            if (struct_v >= 2) {
+                denc(v.format, p);
+            }
+            if (struct_v >= 3) {
+                denc(v.has_collections, p);
+                denc(v.collections, p);
+            }
+        DENC_FINISH(p);
+    }
+    void dump(Formatter *f) const{
+        f->dump_unsigned("sequence", sequence);
+        f->dump_unsigned("pages", pages);
+        f->dump_unsigned("format", format);
+        f->dump_bool("has_collections", has_collections);
+        f->dump_unsigned("num_collections", collections.size());
+    }
+    static void generate_test_instances(list<kvsstore_index_ckpt_t*>& o){}
+};
+
 /// collection metadata
 struct kvsstore_cnode_t {
     uint32_t bits;   ///< how many bits of coll pgid are significant
+    uint8_t chunk_shift = 0;    ///< log2 of the data chunk size of new objects (0: default)
 
     explicit kvsstore_cnode_t(int b=0) : bits(b) {}
 
     DENC(kvsstore_cnode_t, v, p) {
-        DENC_START(1, 1, p);
+        DENC_START(2, 1, p);
             denc(v.bits, p);
+            if (struct_v >= 2) {
+                denc(v.chunk_shift, p);
+            }
         DENC_FINISH(p);
     }
-    void dump(Formatter *f) const{f->dump_unsigned("bits", bits);}
+    void dump(Formatter *f) const{
+        f->dump_unsigned("bits", bits);
+        f->dump_unsigned("chunk_shift", chunk_shift);
+    }
     static void generate_test_instances(list<kvsstore_cnode_t*>& o){}
 
 };
@@ -115,31 +155,171 @@ bool map_compare2 (Map const &lhs, Map const &rhs) {
     return true;
 }
 
+/// header of a compressed data chunk, followed by the compressed data
+struct kvsstore_compression_header_t {
+    uint8_t type = 0;       ///< Compressor::CompressionAlgorithm
+    uint32_t length = 0;    ///< length of the uncompressed chunk
+
+    DENC(kvsstore_compression_header_t, v, p) {
+        DENC_START(1, 1, p);
+            denc(v.type, p);
+            denc(v.length, p);
+        DENC_FINISH(p);
+    }
+};
+WRITE_CLASS_DENC(kvsstore_compression_header_t)
+
+/// a run of chunks that an object shares with its clones
+struct kvsstore_shared_extent_t {
+    uint16_t length = 0;    ///< number of chunks
+    uint64_t sid = 0;       ///< blob that holds them
+
+    DENC(kvsstore_shared_extent_t, v, p) {
+        DENC_START(1, 1, p);
+            denc(v.length, p);
+            denc_varint(v.sid, p);
+        DENC_FINISH(p);
+    }
+};
+WRITE_CLASS_DENC(kvsstore_shared_extent_t)
+
+/// shared blob: chunks frozen by a clone, stored under the data keys of the
+/// object they were cloned from, and freed when no object references them
+struct kvsstore_blob_t {
+    uint32_t refs = 0;                      ///< objects that reference the blob
+    std::string key;                        ///< data key of chunk 0
+    std::map<uint16_t, uint16_t> chunks;    ///< chunk runs: first chunk -> number of chunks
+
+    DENC(kvsstore_blob_t, v, p) {
+        DENC_START(1, 1, p);
+            denc(v.refs, p);
+            denc(v.key, p);
+            denc(v.chunks, p);
+        DENC_FINISH(p);
+    }
+};
+WRITE_CLASS_DENC(kvsstore_blob_t)
+
 /// onode: per-object metadata
 struct kvsstore_onode_t {
     uint64_t nid = 0;
     uint64_t size = 0;
+    uint8_t chunk_shift = 0;    ///< log2 of the data chunk size (0: default), fixed while size > 0
+    uint64_t data_ver = 0;      ///< version in the data keys of the chunks the object writes
+    std::map<uint16_t, kvsstore_shared_extent_t> shared;   ///< chunks shared with clones, by first chunk
+    std::map<uint64_t, std::string> blobs;                  ///< data key of chunk 0 of each referenced blob
+    interval_set<uint32_t> holes;   ///< chunks below the size that are not stored, read as zeros
+    interval_set<uint32_t> compressed;   ///< chunks stored with a compression header
+    uint32_t alloc_hint_flags = 0;  ///< CEPH_OSD_ALLOC_HINT_FLAG_*
+    bool inlined = false;           ///< the data is stored in the onode, not in chunks
+    bufferlist inline_data;         ///< data of an inlined object, size bytes long
     bufferlist omap_header;
     // omap
-    bool omap_loaded = false;
     bool omap_dirty  = false;
-    //std::set<std::string> omaps_write_buffer;
-    std::set<std::string> omaps;
+    uint32_t omap_dir_block = 0;      ///< first key block of the page directory (0: no pages)
+    uint32_t omap_dir_length = 0;     ///< encoded length of the page directory
+    uint32_t omap_next_block = 1;     ///< next omap key block id to allocate
+    bufferlist omap_delta;            ///< changes not yet merged into the pages
+    kvsstore_omap_cache_t omap_cache;
+    // keys of onodes written before the paged index, migrated on the next update
     bufferptr omap_wb;
-    //std::set<std::string> omaps_cache;
-    uint8_t  num_omap_extents = 0;
     bufferlist omap_keys;
-    //bufferlist omap_wb;
 //
     map<mempool::kvsstore_cache_other::string, bufferptr>  attrs;        ///< attrs
 
     inline bool has_omap() const {
-        if (omap_loaded) return !omaps.empty();
-        return (omap_wb.have_raw() && omap_wb.length() > 0) || num_omap_extents > 0;
+        return omap_dir_block != 0 || omap_delta.length() > 0 || omap_keys.length() > 0 ||
+               (omap_wb.have_raw() && omap_wb.length() > 0);
+    }
+
+    /// blob that holds the chunk, 0 if the object owns it
+    uint64_t get_shared(uint16_t chunkid) const {
+        auto it = shared.upper_bound(chunkid);
+        if (it == shared.begin()) return 0;
+        --it;
+        return (chunkid < it->first + it->second.length)? it->second.sid : 0;
+    }
+
+    /// data key of chunk 0 of where the chunk is stored
+    const std::string &get_chunk_key(uint16_t chunkid, const std::string &own) const {
+        const uint64_t sid = get_shared(chunkid);
+        return (sid)? blobs.at(sid) : own;
+    }
+
+    /// stops sharing the chunk, returns the blob it was shared through
+    uint64_t unshare(uint16_t chunkid) {
+        auto it = shared.upper_bound(chunkid);
+        if (it == shared.begin()) return 0;
+        --it;
+        const uint16_t first = it->first;
+        const kvsstore_shared_extent_t e = it->second;
+        if (chunkid >= first + e.length) return 0;
+
+        shared.erase(it);
+        if (chunkid > first) {
+            shared[first] = { (uint16_t)(chunkid - first), e.sid };
+        }
+        if (chunkid + 1 < first + e.length) {
+            shared[chunkid + 1] = { (uint16_t)(first + e.length - chunkid - 1), e.sid };
+        }
+        return e.sid;
+    }
+
+    bool references(uint64_t sid) const {
+        for (const auto &p : shared) {
+            if (p.second.sid == sid) return true;
+        }
+        return false;
+    }
+
+    bool is_hole(uint32_t chunkid) const {
+        return holes.contains(chunkid);
+    }
+
+    void punch_holes(uint32_t chunkid, uint32_t n) {
+        if (n > 0) holes.union_insert(chunkid, n);
+    }
+
+    void fill_hole(uint32_t chunkid) {
+        if (holes.contains(chunkid)) holes.erase(chunkid, 1);
+    }
+
+    bool is_compressed(uint32_t chunkid) const {
+        return compressed.contains(chunkid);
+    }
+
+    void set_compressed(uint32_t chunkid, bool c) {
+        if (c && !compressed.contains(chunkid)) {
+            compressed.union_insert(chunkid, 1);
+        } else if (!c && compressed.contains(chunkid)) {
+            compressed.erase(chunkid, 1);
+        }
+    }
+
+    /// forgets the compressed chunks from the chunk on
+    void trim_compressed(uint32_t nchunks) {
+        if (nchunks == 0) {
+            compressed.clear();
+            return;
+        }
+        interval_set<uint32_t> below;
+        below.insert(0, nchunks);
+        compressed.intersection_of(below);
+    }
+
+    /// forgets the holes from the chunk on
+    void trim_holes(uint32_t nchunks) {
+        if (nchunks == 0) {
+            holes.clear();
+            return;
+        }
+        interval_set<uint32_t> below;
+        below.insert(0, nchunks);
+        holes.intersection_of(below);
     }
 
     DENC(kvsstore_onode_t, v, p) {
-        DENC_START(1, 1, p);
+        DENC_START(7, 1, p);
             denc_varint(v.nid, p);
             denc_varint(v.size, p);
             denc(v.attrs, p);
@@ -148,6 +328,31 @@ struct kvsstore_onode_t {
             denc(v.omap_wb, p);
             denc(v.omap_header, p);
             //denc(v.flags, p);
+            if (struct_v >= 2) {
+                denc(v.chunk_shift, p);
+            }
+            if (struct_v >= 3) {
+                denc_varint(v.omap_dir_block, p);
+                denc_varint(v.omap_dir_length, p);
+                denc_varint(v.omap_next_block, p);
+                denc(v.omap_delta, p);
+            }
+            if (struct_v >= 4) {
+                denc_varint(v.data_ver, p);
+                denc(v.shared, p);
+                denc(v.blobs, p);
+            }
+            if (struct_v >= 5) {
+                denc(v.holes, p);
+            }
+            if (struct_v >= 6) {
+                denc(v.inlined, p);
+                denc(v.inline_data, p);
+            }
+            if (struct_v >= 7) {
+                denc(v.compressed, p);
+                denc(v.alloc_hint_flags, p);
+            }
         DENC_FINISH(p);
     }
 
@@ -283,6 +488,7 @@ public:
     struct BufferSpace {
         enum {
             BYPASS_CLEAN_CACHE = 0x1,  // bypass clean cache
+            NOCACHE_READ = 0x2,        // hits do not promote the clean buffers
         };
 
         typedef boost::intrusive::list<
@@ -300,6 +506,8 @@ public:
         // few IOs in flight to the same Blob at the same time).
         state_list_t writing;   ///< writing buffers, sorted by seq, ascending
 
+        uint64_t gen = 0;       ///< changes whenever the object data changes (protected by the cache lock)
+
         ~BufferSpace() {
             ceph_assert(buffer_map.empty());
             ceph_assert(writing.empty());
@@ -364,6 +572,7 @@ public:
         // return value is the highest cache_private of a trimmed buffer, or 0.
         int discard(BufferCacheShard* cache, uint32_t offset, uint32_t length) {
             std::lock_guard l(cache->lock);
+            gen++;
             int ret = _discard(cache, offset, length);
             cache->_trim();
             return ret;
@@ -373,6 +582,7 @@ public:
         void write(BufferCacheShard* cache, uint64_t seq, uint32_t offset, bufferlist& bl,
                    unsigned flags) {
             std::lock_guard l(cache->lock);
+            gen++;
             Buffer *b = new Buffer(this, Buffer::STATE_WRITING, seq, offset, bl,
                                    flags);
             b->cache_private = _discard(cache, offset, bl.length());
@@ -388,6 +598,27 @@ public:
             cache->_trim();
         }
 
+        uint64_t get_gen(BufferCacheShard* cache) {
+            std::lock_guard l(cache->lock);
+            return gen;
+        }
+
+        // adds prefetched data, unless the data changed since get_gen() or the range is cached already
+        bool did_prefetch(BufferCacheShard* cache, uint64_t gen_, uint32_t offset, bufferlist& bl) {
+            std::lock_guard l(cache->lock);
+            if (gen_ != gen) return false;
+            const uint32_t end = offset + bl.length();
+            for (auto i = _data_lower_bound(offset); i != buffer_map.end() && i->first < end; ++i) {
+                if (!i->second->is_empty()) return false;
+            }
+            // only the history of evicted buffers (2q) overlaps, it tells where the data goes
+            Buffer *b = new Buffer(this, Buffer::STATE_CLEAN, 0, offset, bl);
+            b->cache_private = _discard(cache, offset, bl.length());
+            _add_buffer(cache, b, 1, nullptr);
+            cache->_trim();
+            return true;
+        }
+
         void read(BufferCacheShard* cache, uint32_t offset, uint32_t length,
                   ready_regions_t& res,
                   interval_set<uint32_t>& res_intervals,
@@ -556,6 +787,7 @@ public:
         ghobject_t oid;
 
         boost::intrusive::list_member_hook<> lru_item;
+        uint16_t cache_private = 0; ///< opaque (to us) value used by Cache impl
 
         kvsstore_onode_t onode;   ///< metadata stored as value in kv store
         bool exists;              ///< true if object logically exists
@@ -570,6 +802,21 @@ public:
         std::mutex flush_lock; // = ceph::make_mutex("KvsStore::flush_lock");  ///< protect flush_txns
         std::condition_variable flush_cond;   ///< wait here for uncommitted txns
 
+        // sequential read detection for KvsStore::_readahead
+        struct ReadAhead {
+            std::mutex lock;
+            uint64_t next_off = 0;    ///< where a sequential reader continues
+            uint64_t end = 0;         ///< end of the prefetched range
+            uint32_t seq = 0;         ///< number of back-to-back sequential reads
+            uint32_t window = 0;      ///< prefetch window in chunks
+        } ra;
+
+        uint32_t omap_value_hint = 0;   ///< largest omap value written, sizes the omap value reads
+
+        // compressibility probe of KvsStore::_compress_chunk
+        uint32_t comp_rejected = 0;     ///< chunks that did not compress before one did
+        bool comp_accepted = false;     ///< a chunk of the object compressed
+
         Onode(Collection *c, const ghobject_t& o)
                 : nref(0), c(c), oid(o), exists(false) {
         }
@@ -609,6 +856,21 @@ public:
         // contention.
         OnodeSpace onode_map;
 
+        std::atomic<uint32_t> onode_size_hint = {0};   ///< largest onode seen, sizes the onode reads
+
+        // onodes being loaded by KvsStore::prefetch_onode; a prefetched onode is
+        // only cached if the object was not looked up while it was read
+        std::mutex prefetch_lock;
+        std::map<ghobject_t, bool> prefetching;     ///< oid -> still valid
+        std::atomic<uint32_t> num_prefetching = {0};
+
+        void invalidate_prefetch(const ghobject_t &oid);
+
+        // data chunk compression, set by KvsStore::_set_compression; protected by lock
+        Compressor::CompressionMode comp_mode = Compressor::COMP_NONE;
+        CompressorRef compressor;
+        double comp_required_ratio = 1.0;
+
         ContextQueue *commit_queue;
 
         OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false);
@@ -639,6 +901,19 @@ public:
     };
 
 
+    /// a chunk store, or removal, of a transaction; written back by the OpSequencer
+    struct WriteBackChunk {
+        std::string key;        ///< data key of chunk 0 of the object
+        uint16_t chunkid;
+        bool remove;
+        bufferlist data;
+
+        WriteBackChunk(const std::string &key_, uint16_t id, bool rm, bufferlist *bl = 0):
+            key(key_), chunkid(id), remove(rm) {
+            if (bl) data = *bl;
+        }
+    };
+
     ///  ====================================================
     ///  Transaction Context
     ///  ====================================================
@@ -680,17 +955,25 @@ public:
 
         list<Context*> 		oncommits;  		 ///< more commit completions
         list<CollectionRef> removed_collections; ///< colls we removed
+        std::vector<uint32_t> dropped_onode_trees; ///< onode indexes of the pool shards we removed the last collection of
         std::vector<bufferlist*> omap_data;       /// temporary write buffer for omap
         std::vector<bufferlist*> coll_data;       /// temporary write buffer for collection
 
         IoContext *ioc;	// I/O operations
+        std::vector<WriteBackChunk> wb_chunks;   ///< data chunks, stored through the write-back buffer
+        std::atomic_int io_parts = {0};          ///< ioc and write-back flush, while they are in flight
+        std::set<uint64_t> blobs_dirty;          ///< shared blobs whose reference counts changed
 
         uint64_t seq = 0;
 
         uint64_t last_nid = 0;     ///< if non-zero, highest new nid we allocated
         void *parent;
+
+        utime_t start;             ///< when the transaction was queued
+        utime_t last_stamp;        ///< when it entered its current stage
+
         explicit TransContext(void *parent_, CephContext *cct_, Collection *c,  OpSequencer *o, list<Context*> *on_commits)
-                : ch(c), osr(o), parent(parent_)
+                : ch(c), osr(o), parent(parent_), start(ceph_clock_now()), last_stamp(start)
         {
             ioc = new IoContext(this,__func__);
 
@@ -756,6 +1039,17 @@ public:
 
         std::atomic_bool zombie = {false};    ///< owning Sequencer has gone away
 
+        // write-back buffer: chunks queued while the previous flush is in flight
+        // are merged and stored by the next one
+        std::mutex wb_lock;
+        std::condition_variable wb_cond;
+        std::map<std::pair<std::string, uint16_t>, WriteBackChunk> wb_dirty;
+        std::vector<TransContext*> wb_txcs;      ///< transactions waiting for wb_dirty
+        uint64_t wb_bytes = 0;
+        bool wb_flushing = false;
+
+        kvaio_pool aio_pool;    ///< I/O command descriptors of the transactions and flushes
+
         const uint32_t sequencer_id;
 
         uint32_t get_sequencer_id() const {
@@ -865,6 +1159,7 @@ public:
 WRITE_CLASS_DENC(kvsstore_sb_t)
 WRITE_CLASS_DENC(kvsstore_onode_t)
 WRITE_CLASS_DENC(kvsstore_cnode_t)
+WRITE_CLASS_DENC(kvsstore_index_ckpt_t)
 
 static inline void intrusive_ptr_add_ref(KvsStoreTypes::Onode *o) {
     o->get();
@@ -2202,6 +2202,10 @@ OSD::OSD(CephContext *cct_, ObjectStore *store_,
   trace_endpoint.copy_name(ss.str());
 #endif
 
+  if (cct->_conf->enable_onode_prefetch == "enq") {
+    onode_prefetch = ONODE_PREFETCH_ENQ;
+  }
+
   // initialize shards
   num_shards = get_num_op_shards();
   for (uint32_t i = 0; i < num_shards; i++) {
@@ -9578,12 +9582,38 @@ void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch)
   op->osd_trace.keyval("cost", cost);
   op->mark_queued_for_pg();
   logger->tinc(l_osd_op_before_queue_op_lat, latency);
+  if (onode_prefetch == ONODE_PREFETCH_ENQ) {
+    prefetch_op_onode(pg, op);
+  }
   op_shardedwq.queue(
     OpQueueItem(
       unique_ptr<OpQueueItem::OpQueueable>(new PGOpItem(pg, std::move(op))),
       cost, priority, stamp, owner, epoch));
 }
 
+/*
+ * hints the store to load the object of a client op before the op runs.  It
+ * completes the decoding of the op, so no other thread may see the op yet.
+ */
+void OSD::prefetch_op_onode(spg_t pgid, const OpRequestRef& op)
+{
+  if (op->get_req()->get_type() != CEPH_MSG_OSD_OP) {
+    return;
+  }
+  ObjectStore::CollectionHandle ch = store->open_collection(coll_t(pgid));
+  if (!ch) {
+    return;
+  }
+  MOSDOp *m = static_cast<MOSDOp*>(op->get_nonconst_req());
+  if (m->finish_decode()) {
+    op->reset_desc();   // for TrackedOp
+    m->clear_payload();
+  }
+  // the head holds the snapset, so ops on snapshots load it as well
+  store->prefetch_onode(
+    ch, ghobject_t(m->get_hobj().get_head(), ghobject_t::NO_GEN, pgid.shard));
+}
+
 void OSD::enqueue_peering_evt(spg_t pgid, PGPeeringEventRef evt)
 {
   dout(15) << __func__ << " " << pgid << " " << evt->get_desc() << dendl;
@@ -1706,6 +1706,14 @@ protected:
   } op_shardedwq;
 
 
+  /// when the store is told about the object of a client op (enable_onode_prefetch)
+  enum {
+    ONODE_PREFETCH_DISABLED,
+    ONODE_PREFETCH_ENQ,   ///< when the op is queued
+  };
+  int onode_prefetch = ONODE_PREFETCH_DISABLED;
+  void prefetch_op_onode(spg_t pgid, const OpRequestRef& op);
+
   void enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch);
   void dequeue_op(
     PGRef pg, OpRequestRef op,
@@ -1052,6 +1052,7 @@ public:
     TARGET_SIZE_RATIO,  // fraction of total cluster
     PG_AUTOSCALE_BIAS,
     READ_LEASE_INTERVAL,
+    KVS_CHUNK_SIZE,     // KvsStore data chunk size of new objects
   };
 
   enum type_t {
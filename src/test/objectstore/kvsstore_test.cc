@@ -411,6 +411,718 @@ TEST_P(KvsStoreTest, ZeroLengthZero) {
   ASSERT_EQ(0, r);
 }
 
+TEST_P(KvsStoreTest, SparseHoles) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("sparse", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  bufferlist a, b;
+  a.append(std::string(65536, 'a'));
+  b.append(std::string(65536, 'b'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, a.length(), a);
+    t.write(cid, hoid, 1048576, b.length(), b);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // the gap between the writes is a hole
+    bufferlist in, zeros;
+    zeros.append_zero(1048576 - 65536);
+    r = store->read(ch, hoid, 65536, 1048576 - 65536, in);
+    ASSERT_EQ(r, 1048576 - 65536);
+    ASSERT_TRUE(bl_eq(zeros, in));
+
+    map<uint64_t, uint64_t> m;
+    r = store->fiemap(ch, hoid, 0, 1048576 + 65536, m);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(m.size(), 2u);
+    ASSERT_EQ(m[0], 65536u);
+    ASSERT_EQ(m[1048576], 65536u);
+  }
+  {
+    // zeroing whole chunks and extending the object leave holes
+    ObjectStore::Transaction t;
+    t.zero(cid, hoid, 0, 65536);
+    t.truncate(cid, hoid, 4194304);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    struct stat st;
+    r = store->stat(ch, hoid, &st);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(st.st_size, 4194304);
+
+    map<uint64_t, uint64_t> m;
+    r = store->fiemap(ch, hoid, 0, 4194304, m);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(m.size(), 1u);
+    ASSERT_EQ(m[1048576], 65536u);
+
+    bufferlist in, expected;
+    expected.append_zero(1048576);
+    expected.append(b);
+    expected.append_zero(4194304 - 1048576 - 65536);
+    r = store->read(ch, hoid, 0, 4194304, in);
+    ASSERT_EQ(r, 4194304);
+    ASSERT_TRUE(bl_eq(expected, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, InlineSmallObject) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("inline", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  bufferlist small, big;
+  small.append(std::string(100, 's'));
+  big.append(std::string(16384, 'b'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, small.length(), small);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist in;
+    r = store->read(ch, hoid, 0, 4096, in);
+    ASSERT_EQ(r, 100);
+    ASSERT_TRUE(bl_eq(small, in));
+  }
+  {
+    // growing past the inline limit moves the data to chunks
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 50, big.length(), big);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist in, expected;
+    expected.substr_of(small, 0, 50);
+    expected.append(big);
+    r = store->read(ch, hoid, 0, expected.length(), in);
+    ASSERT_EQ(r, (int)expected.length());
+    ASSERT_TRUE(bl_eq(expected, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, OnodePartitions) {
+  int r;
+  coll_t cid1(spg_t(pg_t(0, 3), shard_id_t::NO_SHARD));
+  coll_t cid2(spg_t(pg_t(0, 4), shard_id_t::NO_SHARD));
+  ghobject_t hoid1(hobject_t("obj1", "", CEPH_NOSNAP, 0, 3, ""));
+  ghobject_t hoid2(hobject_t("obj2", "", CEPH_NOSNAP, 0, 4, ""));
+  auto ch1 = open_collection_safe(cid1);
+  auto ch2 = open_collection_safe(cid2);
+  {
+    ObjectStore::Transaction t;
+    t.touch(cid1, hoid1);
+    r = queue_transaction(store, ch1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.touch(cid2, hoid2);
+    r = queue_transaction(store, ch2, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // each pool has its own onode index
+    vector<ghobject_t> objects;
+    r = store->collection_list(ch1, ghobject_t(), ghobject_t::get_max(), INT_MAX, &objects, 0);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(objects.size(), 1u);
+    ASSERT_EQ(objects[0], hoid1);
+
+    objects.clear();
+    r = store->collection_list(ch2, ghobject_t(), ghobject_t::get_max(), INT_MAX, &objects, 0);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(objects.size(), 1u);
+    ASSERT_EQ(objects[0], hoid2);
+  }
+  {
+    // the last collection of pool 3 drops its index
+    ObjectStore::Transaction t;
+    t.remove(cid1, hoid1);
+    t.remove_collection(cid1);
+    r = queue_transaction(store, ch1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch1 = open_collection_safe(cid1);
+  {
+    vector<ghobject_t> objects;
+    r = store->collection_list(ch1, ghobject_t(), ghobject_t::get_max(), INT_MAX, &objects, 0);
+    ASSERT_EQ(r, 0);
+    ASSERT_TRUE(objects.empty());
+
+    objects.clear();
+    r = store->collection_list(ch2, ghobject_t(), ghobject_t::get_max(), INT_MAX, &objects, 0);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(objects.size(), 1u);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid1);
+    r = queue_transaction(store, ch1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid2, hoid2);
+    t.remove_collection(cid2);
+    r = queue_transaction(store, ch2, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, LargeOmapValue) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("large_omap", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  map<string, bufferlist> omap;
+  omap["big"].append(std::string(20000, 'v'));
+  {
+    ObjectStore::Transaction t;
+    t.touch(cid, hoid);
+    t.omap_setkeys(cid, hoid, omap);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // after a remount nothing hints the size, so the value does not fit the first read
+  ch.reset();
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  ch = store->open_collection(cid);
+  {
+    set<string> keys;
+    keys.insert("big");
+    map<string, bufferlist> out;
+    r = store->omap_get_values(ch, hoid, keys, &out);
+    ASSERT_GE(r, 0);
+    ASSERT_EQ(1u, out.size());
+    ASSERT_TRUE(bl_eq(omap["big"], out["big"]));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, BatchedChunkTruncate) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("batched_chunks", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  bufferlist data;
+  for (unsigned i = 0; i < 20; i++) {
+    data.append(std::string(8192, 'a' + i));
+  }
+  {
+    // the chunk stores of the write are packed into batch commands
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, data.length(), data);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // and so are the chunk deletes of the truncate
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 3 * 8192 + 100);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  ch = store->open_collection(cid);
+  {
+    bufferlist expected, in;
+    expected.substr_of(data, 0, 3 * 8192 + 100);
+    r = store->read(ch, hoid, 0, data.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(bl_eq(expected, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, CompressedChunks) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("compressed_chunks", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  pool_opts_t opts;
+  opts.set(pool_opts_t::COMPRESSION_MODE, std::string("force"));
+  opts.set(pool_opts_t::COMPRESSION_ALGORITHM, std::string("snappy"));
+  r = store->set_collection_opts(ch, opts);
+  ASSERT_EQ(0, r);
+  bufferlist data;
+  for (unsigned i = 0; i < 4; i++) {
+    data.append(std::string(8192, 'a' + i));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, data.length(), data);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // a partial write reads the compressed chunk back before storing it again
+    bufferlist bl;
+    bl.append(std::string(100, 'z'));
+    data.copy_in(8192 + 50, bl.length(), bl);
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 8192 + 50, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // the chunks are read from the device, not from the cache
+  ch.reset();
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  ch = store->open_collection(cid);
+  {
+    bufferlist in;
+    r = store->read(ch, hoid, 0, data.length(), in);
+    ASSERT_EQ((int)data.length(), r);
+    ASSERT_TRUE(bl_eq(data, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, PrefetchOnode) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("prefetched", CEPH_NOSNAP)));
+  ghobject_t missing(hobject_t(sobject_t("never_written", CEPH_NOSNAP)));
+  auto ch = open_collection_safe(cid);
+  bufferlist bl;
+  bl.append("prefetch me");
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  ch = store->open_collection(cid);
+
+  // the hint races with the reads and writes that follow it
+  store->prefetch_onode(ch, hoid);
+  store->prefetch_onode(ch, missing);
+  {
+    bufferlist in;
+    r = store->read(ch, hoid, 0, bl.length(), in);
+    ASSERT_EQ((int)bl.length(), r);
+    ASSERT_TRUE(bl_eq(bl, in));
+  }
+  ASSERT_FALSE(store->exists(ch, missing));
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  store->prefetch_onode(ch, hoid);
+  ASSERT_FALSE(store->exists(ch, hoid));
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(KvsStoreTest, RecycledAioDescriptors) {
+  int r;
+  coll_t cid;
+  // a pool smaller than a transaction: descriptors are both reused and freed
+  g_ceph_context->_conf.set_val_or_die("kvsstore_aio_pool_size", "4");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  auto ch = open_collection_safe(cid);
+  const unsigned num_objects = 16;
+  for (unsigned round = 0; round < 4; round++) {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objects; i++) {
+      ghobject_t hoid(hobject_t(sobject_t("recycled_" + stringify(i), CEPH_NOSNAP)));
+      bufferlist bl;
+      bl.append(std::string(3 * 8192, 'a' + round + i));
+      t.write(cid, hoid, 0, bl.length(), bl);
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (unsigned i = 0; i < num_objects; i++) {
+    ghobject_t hoid(hobject_t(sobject_t("recycled_" + stringify(i), CEPH_NOSNAP)));
+    bufferlist expected, in;
+    expected.append(std::string(3 * 8192, 'a' + 3 + i));
+    r = store->read(ch, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(bl_eq(expected, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objects; i++) {
+      t.remove(cid, ghobject_t(hobject_t(sobject_t("recycled_" + stringify(i), CEPH_NOSNAP))));
+    }
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf.rm_val("kvsstore_aio_pool_size");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST_P(KvsStoreTest, SubmissionQueueBackpressure) {
+  int r;
+  coll_t cid;
+  // one command in flight per queue pair: the others wait in the submission queue
+  g_ceph_context->_conf.set_val_or_die("kvsstore_queue_depth", "1");
+  g_ceph_context->_conf.set_val_or_die("kvsstore_queue_max_bytes", "4096");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+
+  auto ch = open_collection_safe(cid);
+  ghobject_t hoid(hobject_t(sobject_t("backpressure", CEPH_NOSNAP)));
+  bufferlist data;
+  for (unsigned i = 0; i < 32; i++) {
+    data.append(std::string(8192, 'A' + i));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, data.length(), data);
+    t.setattr(cid, hoid, "attr", data);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist in;
+    r = store->read(ch, hoid, 0, data.length(), in);
+    ASSERT_EQ((int)data.length(), r);
+    ASSERT_TRUE(bl_eq(data, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  g_ceph_context->_conf.rm_val("kvsstore_queue_depth");
+  g_ceph_context->_conf.rm_val("kvsstore_queue_max_bytes");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+}
+
+TEST_P(KvsStoreTest, PipelineCounters) {
+  int r;
+  coll_t cid;
+  g_ceph_context->_conf.set_val_or_die("kvsstore_perf_detail", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+
+  const PerfCounters *pc = store->get_perf_counters();
+  auto count = [pc] (int idx) { return pc->get_tavg_ns(idx).first; };
+  const uint64_t finalized = count(l_kvsstore_state_finalize_lat);
+  const uint64_t stores = count(l_kvsstore_dev_store_notsorted_lat);
+
+  auto ch = open_collection_safe(cid);
+  ghobject_t hoid(hobject_t(sobject_t("counted", CEPH_NOSNAP)));
+  bufferlist bl;
+  bl.append(std::string(16384, 'c'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_LT(finalized, count(l_kvsstore_state_finalize_lat));
+  ASSERT_LT(stores, count(l_kvsstore_dev_store_notsorted_lat));
+
+  // every byte read is either a buffer cache hit or a miss
+  const uint64_t hits = pc->get(l_kvsstore_buffer_hit_bytes);
+  const uint64_t misses = pc->get(l_kvsstore_buffer_miss_bytes);
+  const uint64_t onode_hits = pc->get(l_kvsstore_onode_hits);
+  {
+    bufferlist in;
+    r = store->read(ch, hoid, 0, bl.length(), in);
+    ASSERT_EQ((int)bl.length(), r);
+  }
+  ASSERT_EQ(hits + misses + bl.length(),
+            pc->get(l_kvsstore_buffer_hit_bytes) + pc->get(l_kvsstore_buffer_miss_bytes));
+  ASSERT_LT(onode_hits, pc->get(l_kvsstore_onode_hits));
+
+  // the cache lookups of the readahead are not counted as reads
+  ghobject_t seqoid(hobject_t(sobject_t("counted_seq", CEPH_NOSNAP)));
+  bufferlist big;
+  big.append(std::string(256 * 1024, 's'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, seqoid, 0, big.length(), big);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  r = store->umount();   // drops the buffer cache
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  pc = store->get_perf_counters();
+  ch = store->open_collection(cid);
+  {
+    const uint64_t before = pc->get(l_kvsstore_buffer_hit_bytes) + pc->get(l_kvsstore_buffer_miss_bytes);
+    const uint64_t issued = pc->get(l_kvsstore_prefetch_issued);
+    for (uint64_t off = 0; off < big.length(); off += 8192) {
+      bufferlist in;
+      r = store->read(ch, seqoid, off, 8192, in, CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL);
+      ASSERT_EQ(8192, r);
+    }
+    ASSERT_LT(issued, pc->get(l_kvsstore_prefetch_issued));
+    ASSERT_EQ(before + big.length(),
+              pc->get(l_kvsstore_buffer_hit_bytes) + pc->get(l_kvsstore_buffer_miss_bytes));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, seqoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  g_ceph_context->_conf.rm_val("kvsstore_perf_detail");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  // the readahead of the sequential reads is drained before unmounting
+  ASSERT_EQ(0u, ((KvsStore*) store.get())->chunk_prefetches.load());
+  r = store->mount();
+  ASSERT_EQ(0, r);
+}
+
+TEST_P(KvsStoreTest, TwoQCacheKeepsHotBuffers) {
+  const uint32_t len = 4096;
+  // returns true if a buffer read twice survives a scan of the shard
+  auto survives_scan = [len] (const std::string &type) {
+    KvsStoreTypes::BufferCacheShard *cache =
+        KvsStoreTypes::BufferCacheShard::create(g_ceph_context, type, nullptr);
+    cache->set_max(4 * len);
+    KvsStoreTypes::BufferSpace bs;
+    auto load = [&] (uint32_t off) {
+      bufferlist bl;
+      bl.append(std::string(len, 'b'));
+      bs.did_read(cache, off, bl);
+    };
+    load(0);
+    for (uint32_t i = 1; i <= 4; ++i) load(i * len);
+    load(0);
+    for (uint32_t i = 100; i < 200; ++i) load(i * len);
+
+    KvsStoreTypes::ready_regions_t res;
+    interval_set<uint32_t> res_intervals;
+    bs.read(cache, 0, len, res, res_intervals, KvsStoreTypes::BufferSpace::NOCACHE_READ);
+    const bool hit = res_intervals.size() == len;
+    {
+      std::lock_guard l(cache->lock);
+      bs._clear(cache);
+    }
+    delete cache;
+    return hit;
+  };
+  ASSERT_FALSE(survives_scan("lru"));
+  ASSERT_TRUE(survives_scan("2q"));
+}
+
+TEST_P(KvsStoreTest, NodeCacheKeepsCurrentImageOfRetiredNode) {
+  struct test_node: public kv_indexnode {
+    test_node(const bp_addr_t &addr_, const std::string &image):
+      kv_indexnode(addr_, (char*)malloc(image.size()), image.size()) {
+      memcpy(buffer, image.data(), image.size());
+    }
+    void dump() override {}
+  };
+  const uint32_t prefix = 1;
+  const uint64_t pgid = bptree_first_pgid(prefix);
+  const bp_addr_t addr = create_treenode_addr(pgid);
+  const std::string v0(4096, '0'), v1(4096, '1');
+  bptree_node_cache cache(8192);
+
+  ASSERT_TRUE(cache.add(prefix, addr, BPTREE_LATEST, v0.data(), v0.size()));
+  const uint64_t snap = cache.open_snapshot(prefix);
+  {
+    // publish gen 1 and release the pool's pin
+    std::unordered_map<bp_addr_t, kv_indexnode*> nodes;
+    std::unordered_map<bp_addr_t, bptree_page_ref> pinned;
+    test_node n(addr, v1);
+    n.set_dirty();
+    nodes[addr] = &n;
+    cache.publish(prefix, nodes, pinned);
+  }
+  // fill the cache with other nodes
+  const std::string other(4096, 'x');
+  for (uint64_t i = 1; i <= 8; i++) {
+    cache.add(prefix, create_treenode_addr(pgid + i), BPTREE_LATEST, other.data(), other.size());
+  }
+
+  bool found = false;
+  bptree_page_ref latest = cache.get(prefix, addr, BPTREE_LATEST, found);
+  if (found) {
+    ASSERT_TRUE(latest);
+    ASSERT_EQ(v1, latest->data);
+  }
+  bptree_page_ref old = cache.get(prefix, addr, snap, found);
+  ASSERT_TRUE(found);
+  ASSERT_TRUE(old);
+  ASSERT_EQ(v0, old->data);
+  cache.close_snapshot(prefix, snap);
+}
+
+TEST_P(KvsStoreTest, OnodePartitionDroppedByIndexer) {
+  int r;
+  KvsStore *kvsstore = (KvsStore*) store.get();
+  coll_t cid(spg_t(pg_t(0, 5), shard_id_t::NO_SHARD));
+  ghobject_t hoid(hobject_t("obj", "", CEPH_NOSNAP, 0, 5, ""));
+  const uint32_t treeid = kvsstore->db.get_onode_tree(cid);
+  auto has_meta = [&] () {
+    bptree tree(&kvsstore->db.kadi, kvsstore->db.keyspace_notsorted, treeid, &kvsstore->db.index_cache);
+    return !tree.meta->isnew;
+  };
+  auto wait_for = [&] (bool exists) {
+    for (int i = 0; i < 100 && has_meta() != exists; i++) {
+      usleep(100 * 1000);
+    }
+    return has_meta() == exists;
+  };
+
+  auto ch = open_collection_safe(cid);
+  {
+    ObjectStore::Transaction t;
+    t.touch(cid, hoid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_TRUE(wait_for(true));
+  {
+    // dropped by the index thread after the txc commits
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  ASSERT_TRUE(wait_for(false));
+}
+
+TEST_P(KvsStoreTest, SharedBlobCacheTrimmed) {
+  int r;
+  coll_t cid;
+  const int nobjs = 4;
+  // blobs are read back from the device once they are trimmed
+  g_ceph_context->_conf.set_val_or_die("kvsstore_blob_cache_size", "1");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  KvsStore *kvsstore = (KvsStore*) store.get();
+  auto ch = open_collection_safe(cid);
+  bufferlist orig;
+  orig.append(std::string(65536, 'a'));
+  for (int i = 0; i < nobjs; i++) {
+    ghobject_t src(hobject_t(sobject_t("blob_src_" + stringify(i), CEPH_NOSNAP)));
+    ghobject_t dst(hobject_t(sobject_t("blob_dst_" + stringify(i), CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    t.write(cid, src, 0, orig.length(), orig);
+    t.clone(cid, src, dst);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch->flush();
+  {
+    std::lock_guard<std::mutex> l(kvsstore->blob_lock);
+    ASSERT_GE(1u, kvsstore->blob_map.size());
+  }
+  for (int i = 0; i < nobjs; i++) {
+    ghobject_t src(hobject_t(sobject_t("blob_src_" + stringify(i), CEPH_NOSNAP)));
+    ghobject_t dst(hobject_t(sobject_t("blob_dst_" + stringify(i), CEPH_NOSNAP)));
+    {
+      ObjectStore::Transaction t;
+      t.remove(cid, src);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+    bufferlist in;
+    r = store->read(ch, dst, 0, orig.length(), in);
+    ASSERT_EQ((int)orig.length(), r);
+    ASSERT_TRUE(bl_eq(orig, in));
+    {
+      ObjectStore::Transaction t;
+      t.remove(cid, dst);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  ch->flush();
+  {
+    std::lock_guard<std::mutex> l(kvsstore->blob_lock);
+    ASSERT_TRUE(kvsstore->blob_map.empty());
+    ASSERT_TRUE(kvsstore->blob_lru.empty());
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf.rm_val("kvsstore_blob_cache_size");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
 #if DEBUG_NOW
 TEST_P(KvsStoreTest, SimpleRemount) {
   coll_t cid;
@@ -2579,6 +3291,75 @@ TEST_P(KvsStoreTest, OmapSimple) {
   }
 }
 
+TEST_P(KvsStoreTest, OmapManyKeys) {
+  int r;
+  coll_t cid;
+  auto ch = open_collection_safe(cid);
+  ghobject_t hoid(hobject_t(sobject_t("omap_many", CEPH_NOSNAP)));
+  set<string> expected;
+  // enough keys to merge the delta log several times and split pages
+  for (unsigned batch = 0; batch < 20; ++batch) {
+    ObjectStore::Transaction t;
+    map<string,bufferlist> km;
+    for (unsigned i = 0; i < 100; ++i) {
+      char key[32];
+      snprintf(key, sizeof(key), "key_%05u", batch * 100 + i);
+      km[key].append("value");
+      expected.insert(key);
+    }
+    t.touch(cid, hoid);
+    t.omap_setkeys(cid, hoid, km);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    set<string> rm;
+    unsigned n = 0;
+    for (const string &k : expected) {
+      if (n++ % 3 == 0) rm.insert(k);
+    }
+    for (const string &k : rm) expected.erase(k);
+    t.omap_rmkeys(cid, hoid, rm);
+    t.omap_rmkeyrange(cid, hoid, "key_00500", "key_00700");
+    expected.erase(expected.lower_bound("key_00500"), expected.lower_bound("key_00700"));
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    set<string> keys;
+    store->omap_get_keys(ch, hoid, &keys);
+    ASSERT_EQ(expected, keys);
+
+    set<string> probe = { "key_00000", "key_00001", "key_00600", "key_01999", "nokey" };
+    set<string> out;
+    store->omap_check_keys(ch, hoid, probe, &out);
+    set<string> want;
+    for (const string &k : probe) {
+      if (expected.count(k)) want.insert(k);
+    }
+    ASSERT_EQ(want, out);
+  }
+  {
+    // iterate across several read-ahead batches from a marker
+    set<string> seen;
+    ObjectMap::ObjectMapIterator iter = store->get_omap_iterator(ch, hoid);
+    for (iter->upper_bound("key_00100"); iter->valid(); iter->next()) {
+      seen.insert(iter->key());
+      ASSERT_EQ(iter->value().length(), 5u);
+    }
+    ASSERT_EQ(iter->status(), 0);
+    ASSERT_EQ(set<string>(expected.upper_bound("key_00100"), expected.end()), seen);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(KvsStoreTest, XattrTest) {
   coll_t cid;
   ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
@@ -2917,6 +3698,69 @@ TEST_P(KvsStoreTest, BasicTouchOmapCloneTest) {
   }
 }
 
+TEST_P(KvsStoreTest, CloneSharedChunks) {
+  int r;
+  coll_t cid;
+  auto ch = open_collection_safe(cid);
+  ghobject_t hoid(hobject_t(sobject_t("cow_src", CEPH_NOSNAP), "", 123, -1, ""));
+  ghobject_t hoid2(hobject_t(sobject_t("cow_dst", CEPH_NOSNAP), "", 123, -1, ""));
+  bufferlist orig, patch;
+  orig.append(std::string(65536, 'a'));
+  patch.append(std::string(100, 'b'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, orig.length(), orig);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.clone(cid, hoid, hoid2);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // overwriting the source leaves the clone untouched
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 1000, patch.length(), patch);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist in, expected;
+    expected.substr_of(orig, 0, 1000);
+    expected.append(patch);
+    expected.append(std::string(65536 - 1100, 'a'));
+    r = store->read(ch, hoid, 0, 65536, in);
+    ASSERT_EQ(r, 65536);
+    ASSERT_TRUE(bl_eq(expected, in));
+
+    in.clear();
+    r = store->read(ch, hoid2, 0, 65536, in);
+    ASSERT_EQ(r, 65536);
+    ASSERT_TRUE(bl_eq(orig, in));
+  }
+  {
+    // the clone keeps the shared chunks after the source is gone
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist in;
+    r = store->read(ch, hoid2, 0, 65536, in);
+    ASSERT_EQ(r, 65536);
+    ASSERT_TRUE(bl_eq(orig, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(KvsStoreTest, BasicWriteWithOmapCloneTest) {
   int r;
   coll_t cid;
@@ -4919,7 +5763,9 @@ int main(int argc, char **argv)
     // make sure we can adjust any config settings
     g_ceph_context->_conf._clear_safe_to_start_threads();
 
-    g_ceph_context->_conf.set_val_or_die("kvsstore_dev_path", "/dev/nvme2n1");
+    // KVSSTORE_TEST_DEV=emul: runs the tests on the in-process device emulator
+    const char *devpath = getenv("KVSSTORE_TEST_DEV");
+    g_ceph_context->_conf.set_val_or_die("kvsstore_dev_path", (devpath)? devpath:"/dev/nvme2n1");
     g_ceph_context->_conf.set_val_or_die("osd_journal_size", "400");
     g_ceph_context->_conf.set_val_or_die("filestore_index_retry_probability", "0.5");
     g_ceph_context->_conf.set_val_or_die("filestore_op_thread_timeout", "1000");